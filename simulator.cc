@@ -7,914 +7,5130 @@
 #include <string.h> 
 #include <cstring> 
 #include <limits.h> 
+#include <stdlib.h> 
+#include <algorithm>
+#include <array>
+#include <utility>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+#include <chrono>
+#include <cstdio>
+#include <cmath>
+#include <cerrno>
+#include <csignal>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_SSE2
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_AVX2_TARGET
+#endif
+#if defined(__unix__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <ucontext.h>
+#include <sys/wait.h>
+#endif
 // #include <cstdint> 
 #include "simulator.h"
 
 
-#define FLOAT_TO_FIXED1114(n) ((int)((n) * (float)(1<<(4)))) & 0xffff
-#define FIXED_TO_FLOAT1114(n) ((float)(-1*((n>>15)&0x1)*(1<<11)) + (float)((n&(0x7fff)) / (float)(1<<4)))
-#define FIXED1114_TO_INT(n) (( (n>>15)&0x1) ?  ((n>>4)|0xf000) : (n>>4)) 
-#define DEBUG
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#define HAVE_COMPUTED_GOTO
+#else
+#define ALWAYS_INLINE inline
+#endif
 
 using namespace std;
 
 ///////////////////////////////////
-///  architectural structures /// 
+///  simulator configuration  /// 
 ///////////////////////////////////
 
-
-ScalarRegister g_condition_code_register; // store conditional code 
-ScalarRegister g_scalar_registers[NUM_SCALAR_REGISTER];  
-VectorRegister g_vector_registers[NUM_VECTOR_REGISTER];
-
-VertexRegister g_gpu_vertex_registers[NUM_VERTEX_REGISTER]; 
-ScalarRegister g_gpu_status_register; 
- 
-unsigned char g_memory[MEMORY_SIZE]; // data memory 
-
-////////////////////////////////////
-
-vector<TraceOp> g_trace_ops;
-
-unsigned int g_instruction_count = 0;
-unsigned int g_vertex_id = 0; 
-unsigned int g_current_pc = 0; 
-unsigned int g_program_halt = 0; 
+ExecutionEngine g_execution_engine = ENGINE_SWITCH; 
+TraceControl g_trace_control;  // --trace* options 
+int g_num_threads = 0;  // batch mode worker threads, 0 = one per core 
+int g_gpu_threads = 0;  // rasterizer threads, 0 = one per core 
+bool g_gpu_async = false;  // graphics ops run on a render thread 
+bool g_depth_test = false;  // Z buffer with hierarchical-Z rejection 
+const char *g_memory_image = NULL;  // preloaded into data memory for every program 
+size_t g_memory_size = DEFAULT_MEMORY_SIZE;  // data memory of every context 
+CheckpointControl g_checkpoint_control;  // --checkpoint* options 
+volatile sig_atomic_t g_checkpoint_signaled = 0;  // SIGUSR1 since the last checkpoint 
+SampleControl g_sample_control;  // --sample-* options 
 
 ////////////////////////////////////////////////////////////////////////
-// desc: Set g_condition_code_register depending on the values of val1 and val2
+// desc: Set the condition code depending on the values of val1 and val2.
+//       Only the operands are recorded; ConditionCode() evaluates them.
 // hint: bit0 (N) is set only when val1 < val2
 // bit 2: negative 
 // bit 1: zero
 // bit 0: positive 
 ////////////////////////////////////////////////////////////////////////
-void SetConditionCodeInt(const int16_t val1, const int16_t val2) 
+static ALWAYS_INLINE void SetConditionCodeInt(SimulatorContext &context, const int16_t val1, const int16_t val2) 
 {
-  if (val1 < val2)
-    g_condition_code_register.int_value = 0x01;
-  else if (val1 == val2)
-    g_condition_code_register.int_value = 0x02;
-  else
-    g_condition_code_register.int_value = 0x04; 
-
+  context.condition_code_pending.unresolved = true;
+  context.condition_code_pending.int_difference = (int32_t) val1 - (int32_t) val2;
 }
 
-//Added this so I dont have to convert to float when checking for condition code
-void SetConditionCodeFloat(const float val1, const float val2) 
+// 1.11.4 operands order like their raw 16-bit values 
+static ALWAYS_INLINE void SetConditionCodeFixed(SimulatorContext &context, const Fixed1114 val1, const Fixed1114 val2) 
 {
-  if (val1 < val2)
-    g_condition_code_register.int_value = 0x01;
-  else if (val1 == val2)
-    g_condition_code_register.int_value = 0x02;
-  else
-    g_condition_code_register.int_value = 0x04; 
+  SetConditionCodeInt(context, val1.raw, val2.raw);
 }
 
 ////////////////////////////////////////////////////////////////////////
-// Initialize global variables
+// desc: Evaluate the condition code
+// output: 0x01 if val1 < val2, 0x02 if equal, 0x04 otherwise;
+//         condition_code_register if nothing pending
 ////////////////////////////////////////////////////////////////////////
-void InitializeGlobalVariables() 
+static ALWAYS_INLINE int ConditionCode(const SimulatorContext &context)
+{
+  const LazyConditionCode &pending = context.condition_code_pending;
+  if (!pending.unresolved)
+    return context.condition_code_register.int_value;
+  return pending.int_difference < 0 ? 0x01 : pending.int_difference == 0 ? 0x02 : 0x04;
+}
+
+// store the evaluated condition code in condition_code_register, for
+// code that reads or writes the register directly (the JIT) 
+static inline void ResolveConditionCode(SimulatorContext &context)
 {
-  g_vertex_id = 0;  // internal setting variables 
-  memset(&g_condition_code_register, 0x00, sizeof(ScalarRegister));
-  memset(&g_gpu_status_register, 0x00, sizeof(ScalarRegister));
-  memset(g_scalar_registers, 0x00, sizeof(ScalarRegister) * NUM_SCALAR_REGISTER);
-  memset(g_vector_registers, 0x00, sizeof(VectorRegister) * NUM_VECTOR_REGISTER);
-  memset(g_gpu_vertex_registers, 0x00, sizeof(VertexRegister) * NUM_VERTEX_REGISTER);
-  memset(g_memory, 0x00, sizeof(unsigned char) * MEMORY_SIZE);
+  context.condition_code_register.int_value = ConditionCode(context);
+  context.condition_code_pending.unresolved = false;
 }
 
 ////////////////////////////////////////////////////////////////////////
-// desc: Convert 16-bit 2's complement signed integer to 32-bit
+// desc: 1.11.4 register access. R8 - R14 keep the Fixed1114 bits
+//       sign-extended in int_value so traces and snapshots see the
+//       same 16-bit value the hardware holds.
 ////////////////////////////////////////////////////////////////////////
-int SignExtension(const int16_t value) 
+static ALWAYS_INLINE Fixed1114 FixedRegister(const ScalarRegister &reg)
 {
-  return (value >> 15) == 0 ? value : ((0xFFFF << 16) | value);
+  return Fixed1114::FromRaw(reg.int_value);
 }
 
-
+static ALWAYS_INLINE void SetFixedRegister(ScalarRegister &reg, const Fixed1114 value)
+{
+  reg.int_value = value.raw;
+}
 
 ////////////////////////////////////////////////////////////////////////
-// desc: Decode binary-encoded instruction and Parse into TraceOp structure
-//       which we will use execute later
-// input: 32-bit encoded instruction
-// output: TraceOp structure filled with the information provided from the input
+// desc: VADD and VMOVI on all NUM_VECTOR_ELEMENTS lanes at once; a
+//       VectorRegister is four packed 16-bit lanes (one 64-bit load)
 ////////////////////////////////////////////////////////////////////////
-TraceOp DecodeInstruction(const uint32_t instruction) 
+static ALWAYS_INLINE void VectorAdd(VectorRegister &dest, const VectorRegister &src1, const VectorRegister &src2)
 {
-  TraceOp ret_trace_op;
-  memset(&ret_trace_op, 0x00, sizeof(ret_trace_op));
+#ifdef HAVE_SSE2
+  __m128i sum = _mm_add_epi16(_mm_loadl_epi64((const __m128i *) &src1),
+                              _mm_loadl_epi64((const __m128i *) &src2));
+  _mm_storel_epi64((__m128i *) &dest, sum);
+#else
+  for (int i = 0; i < NUM_VECTOR_ELEMENTS; i++)
+    dest.element[i] = src1.element[i] + src2.element[i];
+#endif
+}
 
-  uint8_t opcode = (instruction & 0xFF000000) >> 24;
-  ret_trace_op.opcode = opcode;
+static ALWAYS_INLINE void VectorBroadcast(VectorRegister &dest, const Fixed1114 value)
+{
+#ifdef HAVE_SSE2
+  _mm_storel_epi64((__m128i *) &dest, _mm_set1_epi16(value.raw));
+#else
+  for (int i = 0; i < NUM_VECTOR_ELEMENTS; i++)
+    dest.element[i] = value;
+#endif
+}
 
-  switch (opcode) {
-    
-   
-   
-   case OP_ADD_D: 
-   {
-      int destination_register_idx = (instruction & 0x00F00000) >> 20;
-      int source_register_1_idx = (instruction & 0x000F0000) >> 16;
-      int source_register_2_idx = (instruction & 0x00000F00) >> 8;
-      ret_trace_op.scalar_registers[0] = destination_register_idx;
-      ret_trace_op.scalar_registers[1] = source_register_1_idx;
-      ret_trace_op.scalar_registers[2] = source_register_2_idx;
-   }
-    break;
-    
-    /* fill out all the instruction's decode information */ 
+////////////////////////////////////////////////////////////////////////
+// desc: Release the program loaded into context
+////////////////////////////////////////////////////////////////////////
+void UnloadProgram(SimulatorContext &context)
+{
+#if defined(__unix__)
+  if (context.program_mapping != NULL)
+    munmap(context.program_mapping, context.program_mapping_size);
+#endif
+  context.program_mapping = NULL;
+  context.program_mapping_size = 0;
+  context.instruction_words = NULL;
+  context.num_instructions = 0;
+  context.instruction_storage.clear();
+  context.trace_ops = NULL;
+  context.num_trace_ops = 0;
+  context.trace_op_storage.clear();
+  context.block_cache.clear();
+  context.block_lookup.clear();
+}
 
-    case OP_ADD_F:
-    {
-      int destination_register_idx = (instruction & 0x00F00000) >> 20;
-      int source_register_1_idx = (instruction & 0x000F0000) >> 16;
-      int source_register_2_idx = (instruction & 0x00000F00) >> 8;
-      ret_trace_op.scalar_registers[0] = destination_register_idx;
-      ret_trace_op.scalar_registers[1] = source_register_1_idx;
-      ret_trace_op.scalar_registers[2] = source_register_2_idx;
-    }
-    break;
+////////////////////////////////////////////////////////////////////////
+// DataMemory (see simulator.h)
+////////////////////////////////////////////////////////////////////////
+static_assert(MEMORY_IMAGE_PAGE_SIZE == 1 << MEMORY_PAGE_SHIFT,
+              "memory images are written a flagged page at a time");
 
-    case OP_ADDI_D:
-    {
-      int destination_register_idx = (instruction & 0x00F00000) >> 20;
-      int source_register_idx_idx = (instruction & 0x000F0000) >> 16;
-      int immediate_value = SignExtension(instruction & 0x0000FFFF);
-      ret_trace_op.scalar_registers[0] = destination_register_idx;
-      ret_trace_op.scalar_registers[1] = source_register_idx_idx;
-      ret_trace_op.int_value = immediate_value;
-    }
-    break;
+////////////////////////////////////////////////////////////////////////
+// desc: Parse a --memory-size: bytes, or with a K, M or G suffix
+// output: false unless it is a power of 2 from one page to
+//         MAX_MEMORY_SIZE
+////////////////////////////////////////////////////////////////////////
+bool ParseMemorySize(const char *text, size_t *size)
+{
+  char *end = NULL;
+  uint64_t value = strtoull(text, &end, 10);
+  if (end == text || value > MAX_MEMORY_SIZE)
+    return false;
+  int shift = *end == 'K' ? 10 : *end == 'M' ? 20 : *end == 'G' ? 30 : 0;
+  if (shift != 0)
+    end++;
+  value <<= shift;
+  if (*end != '\0' || (value & (value - 1)) != 0 || value < MEMORY_IMAGE_PAGE_SIZE ||
+      value > MAX_MEMORY_SIZE)
+    return false;
+  *size = value;
+  return true;
+}
 
-    case OP_ADDI_F: 
-    {
-      int destination_register_idx = (instruction & 0x00F00000) >> 20;
-      int source_register_idx_idx = (instruction & 0x000F0000) >> 16;
-      float immediate_value = FIXED_TO_FLOAT1114(instruction & 0x0000FFFF);
-      ret_trace_op.scalar_registers[0] = destination_register_idx;
-      ret_trace_op.scalar_registers[1] = source_register_idx;
-      ret_trace_op.float_value = immediate_value;
-      ret_trace_op.it_value = (int) immediate_value;
-    }
-    break;
+static_assert((DEFAULT_MEMORY_SIZE & (DEFAULT_MEMORY_SIZE - 1)) == 0 &&
+              DEFAULT_MEMORY_SIZE >= MEMORY_IMAGE_PAGE_SIZE && DEFAULT_MEMORY_SIZE <= MAX_MEMORY_SIZE,
+              "DEFAULT_MEMORY_SIZE must be a valid --memory-size");
 
+#ifdef HAVE_GUARDED_MEMORY
+DataMemory::DataMemory(const size_t size)
+  : size_(size), page_flags_(size >> MEMORY_PAGE_SHIFT)
+{
+  size_t reservation_size = 2 * MEMORY_GUARD_SIZE + size_;
+  void *region = mmap(NULL, reservation_size, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (region == MAP_FAILED) {
+    cerr << "Error: Cannot reserve " << reservation_size << " bytes for data memory" << endl;
+    abort();
+  }
+  reservation_ = (unsigned char *) region;
+  base_ = reservation_ + MEMORY_GUARD_SIZE;
+  Clear();
+}
 
-    case OP_VADD:
-    {
-      int destination_register_idx = (instruction & 0x003F0000) >> 16;
-      int source_register_1_idx = (instruction & 0x00003F00) >> 8;
-      int source_register_2_idx = (instruction & 0x0000003F);
-      ret_trace_op.vector_registers[0] = destination_register_idx;
-      ret_trace_op.vector_registers[1] = source_register_1_idx;
-      ret_trace_op.vector_registers[2] = source_register_2_idx;
-    }
-    break;
+DataMemory::~DataMemory()
+{
+  munmap(reservation_, 2 * MEMORY_GUARD_SIZE + size_);
+}
 
-    case OP_AND_D:
-    {
-      int destination_register_idx = (instruction & 0x00F00000) >> 20;
-      int source_register_1_idx = (instruction & 0x000F0000) >> 16;
-      int source_register_2_idx = (instruction & 0x00000F00) >> 8;
-      ret_trace_op.scalar_registers[0] = destination_register_idx;
-      ret_trace_op.scalar_registers[1] = source_register_1_idx;
-      ret_trace_op.scalar_registers[2] = source_register_2_idx;
-    }
-    break;
+// a fresh private mapping drops every page stored to so far 
+void DataMemory::Clear()
+{
+  if (mmap(base_, size_, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) {
+    cerr << "Error: Cannot map data memory" << endl;
+    abort();
+  }
+  fill(page_flags_.begin(), page_flags_.end(), 0);
+}
 
-    case OP_ANDI_D:
-    {
-      int destination_register_idx = (instruction & 0x00F00000) >> 20;
-      int source_register_1_idx = (instruction & 0x000F0000) >> 16;
-      int immediate_value = SignExtension(instruction & 0x0000FFFF);
-      ret_trace_op.scalar_registers[0] = destination_register_idx;
-      ret_trace_op.scalar_registers[1] = source_register_idx_idx;
-      ret_trace_op.int_value = immediate_value;
-    }
-    break;
+bool DataMemory::InGuardedRange(const void *host_address) const
+{
+  const unsigned char *address = (const unsigned char *) host_address;
+  return address >= reservation_ && address < reservation_ + 2 * MEMORY_GUARD_SIZE + size_;
+}
 
+size_t DataMemory::MapFile(const int address, const int fd, const uint64_t file_offset, const size_t size)
+{
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t length = size - size % page_size;
+  if (address % page_size != 0 || file_offset % page_size != 0 || length == 0)
+    return 0;
+  if (mmap(base_ + address, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+           fd, file_offset) != MAP_FAILED)
+    return length;
+  // a failed MAP_FIXED may have left a hole: put zero pages back 
+  mmap(base_ + address, length, PROT_READ | PROT_WRITE,
+       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+  return 0;
+}
+#else
+DataMemory::DataMemory(const size_t size)
+  : storage_(size), size_(size), base_(&storage_[0]), page_flags_(size >> MEMORY_PAGE_SHIFT)
+{
+}
 
-    case OP_MOV:
-    {
-      int destination_register_idx = (instruction & 0x000F0000) >> 16;
-      int source_register_idx = (instruction & 0x00000F00) >> 8;
-      ret_trace_op.scalar_registers[0] = destination_register_idx;
-      ret_trace_op.scalar_registers[1] = source_register_idx;
-    }
-    break;
+DataMemory::~DataMemory()
+{
+}
 
-    case OP_MOVI_D:
-    {
-      int destination_register_idx = (instruction & 0x000F0000) >> 16;
-      int immediate_value = SignExtension(instruction & 0x0000FFFF);
-      ret_trace_op.scalar_registers[0] = destination_register_idx;
-      ret_trace_op.int_value = immediate_value;
-    }
-    break;
+void DataMemory::Clear()
+{
+  fill(storage_.begin(), storage_.end(), 0);
+  fill(page_flags_.begin(), page_flags_.end(), 0);
+}
 
-    case OP_MOVI_F:
-    {
-      int destination_register_idx = (instruction & 0x000F0000) >> 16;
-      float immediate_value =  FIXED_TO_FLOAT1114(instruction & 0x0000FFFF);
-      ret_trace_op.scalar_registers[0] = destination_register_idx;
-      ret_trace_op.float_value = immediate_value;
-    }
-    break;
+bool DataMemory::InGuardedRange(const void *host_address) const
+{
+  return false;
+}
 
-    case OP_VMOV:
-    {
-      int destination_register_idx = (instruction & 0x003F0000) >> 16;
-      int source_register_idx = (instruction & 0x00003F00) >> 8;
-      ret_trace_op.vector_registers[0] = destination_register_idx;
-      ret_trace_op.vector_registers[1] = source_register_idx;
-    }
-    break;
- 
-    case OP_VMOVI:
-    {
-      int destination_register_idx = (instruction & 0x003F0000) >> 16;
-      float immediate_value = FIXED_TO_FLOAT1114(instruction & 0x0000FFFF)
-      ret_trace_op.vector_registers[0] = destination_register_idx;
-      ret_trace_op.float_value = immediate_value;
-    }
-    break;
+size_t DataMemory::MapFile(const int address, const int fd, const uint64_t file_offset, const size_t size)
+{
+  return 0;
+}
+#endif
 
-    case OP_CMP:
-    {
-      int source_register_1_idx = (instruction & 0x000F0000) >> 16;
-      int source_register_2_idx = (instruction & 0x00000F00) >> 8;
-      ret_trace_op.scalar_registers[0] = source_register_1_idx;
-      ret_trace_op.scalar_registers[1] = source_register_2_idx;
-    }
-    break;
+void DataMemory::MarkWritten(const int address, const size_t size)
+{
+  if (size == 0)
+    return;
+  size_t last = ((size_t) address + size - 1) >> MEMORY_PAGE_SHIFT;
+  for (size_t page = (size_t) address >> MEMORY_PAGE_SHIFT; page <= last; page++)
+    page_flags_[page] = MEMORY_PAGE_DIRTY | MEMORY_PAGE_WRITTEN;
+}
 
-    case OP_CMPI:
-    {
-      int source_register_idx = (instruction & 0x000F0000) >> 16;
-      int immediate_value = SignExtension(instruction & 0x0000FFFF);
-      ret_trace_op.scalar_registers[0] = source_register_idx;
-      ret_trace_op.int_value = immediate_value;
-    }
-    break;
+void DataMemory::ClearDirtyPages()
+{
+  for (size_t page = 0; page < page_flags_.size(); page++)
+    page_flags_[page] &= ~MEMORY_PAGE_DIRTY;
+}
 
-    case OP_VCOMPMOV: 
-    {
-      int element_idx = (instruction & 0x00C00000) >> 22;
-      int destination_register_idx = (instruction & 0x003F0000) >> 16;
-      int source_register_idx = (instruction & 0x00000F00) >> 8;
-      ret_trace_op.idx = element_idx;
-      ret_trace_op.vector_registers[0] = destination_register_idx;
-      ret_trace_op.scalar_registers[0] = source_register_idx;
-    }
-    break;
+////////////////////////////////////////////////////////////////////////
+// Initialize context for a new program
+////////////////////////////////////////////////////////////////////////
+void InitializeContext(SimulatorContext &context) 
+{
+  UnloadProgram(context);
+  context.instruction_count = 0;
+  context.current_pc = 0;
+  context.program_halt = 0;
+  context.memory_faulted = false;
+  context.memory_fault_address = 0;
+  context.trace_delta.valid = false;
+  context.trace_delta.stored_addresses.clear();
+  context.trace_delta.stored_compact_at = 4096;
+  context.next_checkpoint = 0;
+  context.checkpoint_failed = false;
+  context.checkpoint_base.clear();
+  context.checkpoint_chain = 0;
+  memset(&context.sample_stats, 0x00, sizeof(SampleStats));
+  context.trace_triggered =
+    g_trace_control.trigger_register < 0 && g_trace_control.trigger_opcode < 0;
+  context.vertex_id = 0;  // internal setting variables 
+  TransformMatrix identity = { 1 << 16, 0, 0, 0, 1 << 16, 0 };
+  context.gpu_matrix = identity;
+  context.gpu_pending_transforms.clear();
+  context.gpu_matrix_stack.clear();
+  context.gpu_vertex_buffer = VertexBuffer();
+  context.gpu_primitives.clear();
+  context.framebuffer.clear();
+  context.resolved_framebuffer.clear();
+  context.depth_buffer.clear();
+  context.hiz_block_max.clear();
+  context.hiz_tile_max.clear();
+  memset(&context.depth_stats, 0x00, sizeof(DepthStats));
+  context.frame_count = 0;
+  memset(&context.condition_code_register, 0x00, sizeof(ScalarRegister));
+  memset(&context.condition_code_pending, 0x00, sizeof(LazyConditionCode));
+  memset(&context.gpu_status_register, 0x00, sizeof(ScalarRegister));
+  memset(context.scalar_registers, 0x00, sizeof(ScalarRegister) * NUM_SCALAR_REGISTER);
+  memset(context.vector_registers, 0x00, sizeof(VectorRegister) * NUM_VECTOR_REGISTER);
+  memset(context.gpu_vertex_registers, 0x00, sizeof(VertexRegister) * NUM_VERTEX_REGISTER);
+  context.memory.Clear();
+}
 
-    case OP_VCOMPMOVI:
-    {
-      int element_idx = (instruction & 0x00C00000) >> 22;
-      int destinatiob_register_idx = (instruction & 0x003F0000) >> 16;
-      float immediate_value = FIXED_TO_FLOAT1114(instruction & 0x0000FFFF);
-      ret_trace_op.idx = element_idx;
-      ret_trace_op.vector_registers[0] = destination_register_idx;
-      ret_trace_op.float_value = immediate_value;
-    }
-    break;
+SimulatorContext::SimulatorContext()
+  : memory(g_memory_size), gpu_queue(NULL), frame_sink(NULL), instruction_words(NULL), num_instructions(0), trace_ops(NULL), num_trace_ops(0),
+    program_mapping(NULL), program_mapping_size(0), jit_code(NULL), jit_code_used(0),
+    trace_out(&cout), trace_sink(NULL)
+{
+  InitializeContext(*this);
+}
 
-    case OP_LDB:  //Should be the same as LDW 
-    case OP_LDW:
-    {
-      int destination_register_idx = (instruction & 0x00F00000) >> 20;
-      int base_register_idx = (instruction & 0x000F0000) >> 16;
-      int offset = SignExtension((int16_t)(instruction & 0x0000FFFF));
-      ret_trace_op.scalar_registers[0] = destination_register_idx;
-      ret_trace_op.scalar_registers[1] = base_register_idx;
-      ret_trace_op.int_value = offset;
-    }
-    break;
+SimulatorContext::~SimulatorContext()
+{
+  UnloadProgram(*this);
+#if defined(__unix__)
+  if (jit_code != NULL)
+    munmap(jit_code, JIT_CODE_SIZE);
+#endif
+}
 
-    case OP_STB:  //Should be the same as STW
-    case OP_STW:
-    {
-      int source_register_idx = (instruction & 0x00F00000) >> 20;
-      int base_register_idx = (instruction & 0x000F0000) >> 16;
-      int offset = SignExtension((int16_t)(instruction & 0x0000FFFF));
-      ret_trace_op.scalar_registers[0] = source_register_idx;
-      ret_trace_op.scalar_registers[1] = base_register_idx;
-      ret_trace_op.int_value = offset;
-    }
-    break;
+////////////////////////////////////////////////////////////////////////
+// desc: Convert 16-bit 2's complement signed integer to 32-bit
+////////////////////////////////////////////////////////////////////////
+int SignExtension(const int16_t value) 
+{
+  return (value >> 15) == 0 ? value : ((0xFFFF << 16) | value);
+}
 
-    case OP_SETVERTEX: 
-    case OP_SETCOLOR:
-    case OP_ROTATE:  // optional 
-    case OP_TRANSLATE: 
-    case OP_SCALE:  // optional ! the ones above this might be the same
-    {
-      int vector_register_idx = (instruction & 0x003F0000) >> 16;
-      ret_trace_op.vector_registers[0] vector_register_idx;
-    }
-    break;
 
-    case OP_PUSHMATRIX:       // deprecated
-    {
-    }
-    break;
- 
-    case OP_POPMATRIX:   // deprecated
-    {
-    }
-    break;
 
-    case OP_BEGINPRIMITIVE:  //todo
-    {
-    }
-    break;
+////////////////////////////////////////////////////////////////////////
+// Instruction decoder
+// Every opcode has one of the InstructionFormats below, which says
+// where its register, element, primitive type and immediate fields
+// are. DecodeFormat<kFormat> is the decoder for one format; with the
+// descriptor known at compile time its field tests fold away.
+// s_decode_table maps each of the 256 opcodes to its decoder and is
+// built at compile time from FormatOf(), so a new opcode only needs a
+// case there.
+////////////////////////////////////////////////////////////////////////
+enum ImmediateKind {
+  IMM_NONE,
+  IMM_INT,                      // sign-extended instruction[15:0] 
+  IMM_FIXED                     // 1.11.4 instruction[15:0] as a Fixed1114 
+};
 
-    case OP_ENDPRIMITIVE:    //todo
-    {
-    }
-    break;
+typedef struct InstructionFormat_ {
+  int8_t scalar_shift[3];       // 4-bit scalar register fields, -1 if absent 
+  int8_t vector_shift[3];       // 6-bit vector register fields, -1 if absent 
+  int8_t idx_shift;             // 2-bit VCOMPMOV element, -1 if absent 
+  int8_t primitive_shift;       // 4-bit BEGINPRIMITIVE type, -1 if absent 
+  uint8_t immediate;            // ImmediateKind 
+} InstructionFormat;
 
-    case OP_LOADIDENTITY:  // deprecated 
-    {
-    }
-    break;
+enum InstructionFormatId {
+  FMT_NONE,                     // opcode only 
+  FMT_SCALAR_3REG,              // ADD_D Rd, Rs1, Rs2 
+  FMT_SCALAR_REG_IMM,           // ADDI_D Rd, Rs, #imm ; LDW/STW Rd, Rbase, #offset 
+  FMT_SCALAR_REG_FIXED,         // ADDI_F Rd, Rs, #fixed 
+  FMT_SCALAR_2REG,              // MOV Rd, Rs ; CMP Rs1, Rs2 
+  FMT_SCALAR_IMM,               // MOVI_D Rd, #imm ; CMPI Rs, #imm 
+  FMT_SCALAR_FIXED,             // MOVI_F Rd, #fixed 
+  FMT_VECTOR_3REG,              // VADD Vd, Vs1, Vs2 
+  FMT_VECTOR_2REG,              // VMOV Vd, Vs 
+  FMT_VECTOR_FIXED,             // VMOVI Vd, #fixed 
+  FMT_VECTOR_1REG,              // SETVERTEX Vs 
+  FMT_VCOMPMOV,                 // VCOMPMOV Vd, idx, Rs 
+  FMT_VCOMPMOVI,                // VCOMPMOVI Vd, idx, #fixed 
+  FMT_PRIMITIVE,                // BEGINPRIMITIVE type 
+  FMT_PC_OFFSET,                // BRxx/JSR #offset 
+  FMT_BASE_REGISTER,            // JMP/JSRR Rbase 
+  NUM_INSTRUCTION_FORMATS
+};
 
-    case OP_FLUSH: //todo
-    case OP_DRAW:  //todo
-    case OP_BRN: //todo  Unsure if need to do anything
-    case OP_BRZ: //todo
-    case OP_BRP: //todo
-    case OP_BRNZ: //todo
-    case OP_BRNP: //todo
-    case OP_BRZP: //todo
-    case OP_BRNZP: //todo  
-    case OP_JSR:  //  ! the ones above this might be the same
-    {
-      int pc_offset = SignExtension((int16_t)(instruction & 0x0000FFFF));
-      ret_trace_op.int_value = pc_offset;
-    }
-    break;
+static constexpr InstructionFormat s_instruction_formats[NUM_INSTRUCTION_FORMATS] = {
+  /* FMT_NONE             */ { { -1, -1, -1 }, { -1, -1, -1 }, -1, -1, IMM_NONE },
+  /* FMT_SCALAR_3REG      */ { { 20, 16, 8 },  { -1, -1, -1 }, -1, -1, IMM_NONE },
+  /* FMT_SCALAR_REG_IMM   */ { { 20, 16, -1 }, { -1, -1, -1 }, -1, -1, IMM_INT },
+  /* FMT_SCALAR_REG_FIXED */ { { 20, 16, -1 }, { -1, -1, -1 }, -1, -1, IMM_FIXED },
+  /* FMT_SCALAR_2REG      */ { { 16, 8, -1 },  { -1, -1, -1 }, -1, -1, IMM_NONE },
+  /* FMT_SCALAR_IMM       */ { { 16, -1, -1 }, { -1, -1, -1 }, -1, -1, IMM_INT },
+  /* FMT_SCALAR_FIXED     */ { { 16, -1, -1 }, { -1, -1, -1 }, -1, -1, IMM_FIXED },
+  /* FMT_VECTOR_3REG      */ { { -1, -1, -1 }, { 16, 8, 0 },   -1, -1, IMM_NONE },
+  /* FMT_VECTOR_2REG      */ { { -1, -1, -1 }, { 16, 8, -1 },  -1, -1, IMM_NONE },
+  /* FMT_VECTOR_FIXED     */ { { -1, -1, -1 }, { 16, -1, -1 }, -1, -1, IMM_FIXED },
+  /* FMT_VECTOR_1REG      */ { { -1, -1, -1 }, { 16, -1, -1 }, -1, -1, IMM_NONE },
+  /* FMT_VCOMPMOV         */ { { 8, -1, -1 },  { 16, -1, -1 }, 22, -1, IMM_NONE },
+  /* FMT_VCOMPMOVI        */ { { -1, -1, -1 }, { 16, -1, -1 }, 22, -1, IMM_FIXED },
+  /* FMT_PRIMITIVE        */ { { -1, -1, -1 }, { -1, -1, -1 }, -1, 16, IMM_NONE },
+  /* FMT_PC_OFFSET        */ { { -1, -1, -1 }, { -1, -1, -1 }, -1, -1, IMM_INT },
+  /* FMT_BASE_REGISTER    */ { { 16, -1, -1 }, { -1, -1, -1 }, -1, -1, IMM_NONE },
+};
 
-    case OP_JMP: //should be the same as JSRR
-    case OP_JSRR:
-    {
-      int base_register = (instruction & 0x000F0000) >> 16;
-      ret_trace_op.scalar_registers[0] = base_register;
-    } 
-    case OP_HALT: 
-      break; 
-      
-    default:
-    break;
+static constexpr InstructionFormatId FormatOf(const int opcode)
+{
+  switch (opcode) {
+    case OP_ADD_D: case OP_ADD_F: case OP_AND_D:
+      return FMT_SCALAR_3REG;
+    case OP_ADDI_D: case OP_ANDI_D: case OP_LDB: case OP_LDW: case OP_STB: case OP_STW:
+      return FMT_SCALAR_REG_IMM;
+    case OP_ADDI_F:
+      return FMT_SCALAR_REG_FIXED;
+    case OP_MOV: case OP_CMP:
+      return FMT_SCALAR_2REG;
+    case OP_MOVI_D: case OP_CMPI:
+      return FMT_SCALAR_IMM;
+    case OP_MOVI_F:
+      return FMT_SCALAR_FIXED;
+    case OP_VADD:
+      return FMT_VECTOR_3REG;
+    case OP_VMOV:
+      return FMT_VECTOR_2REG;
+    case OP_VMOVI:
+      return FMT_VECTOR_FIXED;
+    case OP_SETVERTEX: case OP_SETCOLOR: case OP_ROTATE: case OP_TRANSLATE: case OP_SCALE:
+      return FMT_VECTOR_1REG;
+    case OP_VCOMPMOV:
+      return FMT_VCOMPMOV;
+    case OP_VCOMPMOVI:
+      return FMT_VCOMPMOVI;
+    case OP_BEGINPRIMITIVE:
+      return FMT_PRIMITIVE;
+    case OP_FLUSH: case OP_DRAW: case OP_JSR:
+    case OP_BRN: case OP_BRZ: case OP_BRP: case OP_BRNZ: case OP_BRNP: case OP_BRZP: case OP_BRNZP:
+      return FMT_PC_OFFSET;
+    case OP_JMP: case OP_JSRR:
+      return FMT_BASE_REGISTER;
+    default:  // PUSHMATRIX, POPMATRIX, ENDPRIMITIVE, LOADIDENTITY, HALT 
+      return FMT_NONE;
   }
+}
+
+// field at kShift of width kMask, or 0 when the format has no such field 
+template <int kShift, uint32_t kMask>
+static ALWAYS_INLINE uint8_t DecodeField(const uint32_t instruction)
+{
+  return kShift < 0 ? 0 : (instruction >> (kShift < 0 ? 0 : kShift)) & kMask;
+}
+
+template <int kFormat>
+TraceOp DecodeFormat(const uint32_t instruction)
+{
+  constexpr InstructionFormat format = s_instruction_formats[kFormat];
+  TraceOp ret_trace_op;
+  memset(&ret_trace_op, 0x00, sizeof(ret_trace_op));  // padding too: TraceOps are written to files 
+  ret_trace_op.opcode = (instruction & 0xFF000000) >> 24;
+  ret_trace_op.scalar_registers[0] = DecodeField<format.scalar_shift[0], 0x0F>(instruction);
+  ret_trace_op.scalar_registers[1] = DecodeField<format.scalar_shift[1], 0x0F>(instruction);
+  ret_trace_op.scalar_registers[2] = DecodeField<format.scalar_shift[2], 0x0F>(instruction);
+  ret_trace_op.vector_registers[0] = DecodeField<format.vector_shift[0], 0x3F>(instruction);
+  ret_trace_op.vector_registers[1] = DecodeField<format.vector_shift[1], 0x3F>(instruction);
+  ret_trace_op.vector_registers[2] = DecodeField<format.vector_shift[2], 0x3F>(instruction);
+  ret_trace_op.idx = DecodeField<format.idx_shift, 0x03>(instruction);
+  ret_trace_op.primitive_type = DecodeField<format.primitive_shift, 0x0F>(instruction);
 
+  int immediate = instruction & 0x0000FFFF;
+  if (format.immediate == IMM_INT)
+    ret_trace_op.int_value = SignExtension(immediate);
+  else if (format.immediate == IMM_FIXED)
+    ret_trace_op.fixed_value = Fixed1114::FromRaw(immediate);
   return ret_trace_op;
 }
 
+typedef TraceOp (*DecodeFn)(const uint32_t instruction);
+
+template <size_t... kOpcodes>
+constexpr array<DecodeFn, 256> MakeDecodeTable(index_sequence<kOpcodes...>)
+{
+  return {{ &DecodeFormat<FormatOf(kOpcodes)>... }};
+}
+
+static constexpr array<DecodeFn, 256> s_decode_table = MakeDecodeTable(make_index_sequence<256>());
+
 ////////////////////////////////////////////////////////////////////////
-// desc: Execute the behavior of the instruction (Simulate)
-// input: Instruction to execute 
-// output: Non-branch operation ? -1 : OTHER (PC-relative or absolute address)
+// desc: Decode binary-encoded instruction and Parse into TraceOp structure
+//       which we will use execute later
+// input: 32-bit encoded instruction
+// output: TraceOp structure filled with the information provided from the input
 ////////////////////////////////////////////////////////////////////////
-int ExecuteInstruction(const TraceOp &trace_op) 
+TraceOp DecodeInstruction(const uint32_t instruction) 
 {
-  int ret_next_instruction_idx = -1;
+  return s_decode_table[instruction >> 24](instruction);
+}
 
-  uint8_t opcode = trace_op.opcode;
-  switch (opcode) {
-    case OP_ADD_D: 
-    {
-      int source_value_1 = g_scalar_registers[trace_op.scalar_registers[1]].int_value;
-      int source_value_2 = g_scalar_registers[trace_op.scalar_registers[2]].int_value;
-      g_scalar_registers[trace_op.scalar_registers[0]].int_value = 
-        source_value_1 + source_value_2;
-      SetConditionCodeInt(g_scalar_registers[trace_op.scalar_registers[0]].int_value, 0);
-    }
-    break;
+////////////////////////////////////////////////////////////////////////
+// GPU back end
+// SETCOLOR/SETVERTEX fill gpu_vertex_registers[vertex_id] and the
+// vertex buffer (see Vertex pipeline), DRAW turns the buffer into
+// primitives of the GSR[3:2] type and FLUSH rasterizes everything
+// queued since the previous FLUSH.
+// Rasterization is tile based: primitives are binned into
+// RASTER_TILE_SIZE screen tiles, and tiles are drawn in parallel by
+// the flushing thread plus the helpers of the shared RasterPool, at
+// most g_gpu_threads in all. A tile is only touched by the worker that
+// owns it and draws its primitives in submission order, so the result
+// does not depend on the number of threads.
+////////////////////////////////////////////////////////////////////////
+#define NUM_TILES_X ((FRAMEBUFFER_WIDTH + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE)
+#define NUM_TILES_Y ((FRAMEBUFFER_HEIGHT + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE)
 
-    /* fill out instruction behaviors */ 
+static inline uint32_t PackColor(const int r, const int g, const int b)
+{
+  return (min(max(r, 0), 255) << 16) | (min(max(g, 0), 255) << 8) | min(max(b, 0), 255);
+}
 
-    case OP_ADD_F:
-    {
-      float source_value_1 = g_scalar_registers[trace_op.scalar_registers[1]].float_value;
-      float source_value_2 = g_scalar_registers[trace_op.scalar_registers[2]].float_value;
-      g_scalar_registers[trace_op.scalar_registers[0]].float_value = 
-        source_value_1 + source_value_2;
-      SetConditionCodeFloat(g_scalar_registers[trace_op.scalar_registers[0]].float_value, 0.0f);
-    }
-    break;
- 
-    case OP_ADDI_D:
-    {
-      int source_value_1 = g_scalar_registers[trace_op.scalar_registers[1]].int_value;
-      int source_value_2 = trace_op.int_value;
-      g_scalar_registers[trace_op.scalar_registers[0]].int_value = 
-        source_value_1 + source_value_2;
-      SetConditionCodeInt(g_scalar_registers[trace_op.scalar_registers[0]].int_value, 0);
-    }
-    break;
+typedef struct TileRect_ {
+  int x0, y0, x1, y1;  // inclusive pixel bounds 
+} TileRect;
 
-    case OP_ADDI_F:
-    {
-      float source_value_1 = g_scalar_registers[trace_op.scalar_registers[1]].float_value;
-      float source_value_2 = trace_op.float_value;
-      g_scalar_registers[trace_op.scalar_registers[0]].float_value = 
-        source_value_1 + source_value_2;
-      SetConditionCodeFloat(g_scalar_registers[trace_op.scalar_registers[0]].int_value, 0.0f);
-    }
-    break;
+static inline int TileIndex(const TileRect &rect)
+{
+  return (rect.y0 / RASTER_TILE_SIZE) * NUM_TILES_X + rect.x0 / RASTER_TILE_SIZE;
+}
 
-    case OP_VADD:
-    {
-      for (int i = 0; i < NUM_VECTOR_ELEMENTS; i++)
-        g_vector_registers[trace_op.vector_registers[0]].element[i].float_value = 
-          g_vector_registers[trace_op.vector_registers[1]].element[i].float_value + 
-          g_vector_registers[trace_op.vector_registers[2]].element[i].float_value;
-    }
-    break;
+TileRect TileBounds(const int tile_idx)
+{
+  TileRect rect;
+  rect.x0 = (tile_idx % NUM_TILES_X) * RASTER_TILE_SIZE;
+  rect.y0 = (tile_idx / NUM_TILES_X) * RASTER_TILE_SIZE;
+  rect.x1 = min(rect.x0 + RASTER_TILE_SIZE, FRAMEBUFFER_WIDTH) - 1;
+  rect.y1 = min(rect.y0 + RASTER_TILE_SIZE, FRAMEBUFFER_HEIGHT) - 1;
+  return rect;
+}
 
-    case OP_AND_D:
-    {
-      int source_value_1 = g_scalar_registers[trace_op.scalar_registers[1]].int_value;
-      int source_value_2 = g_scalar_registers[trace_op.scalar_registers[2]].int_value;
-      g_scalar_registers[trace_op.scalar_registers[0]].int_value = 
-        source_value_1 & source_value_2;
-      SetConditionCodeInt(g_scalar_registers[trace_op.scalar_registers[0]].int_value, 0);
-    }
-    break
+// GpuDraw clips triangles reaching further than this from the origin,
+// so their edge functions fit the 32-bit kernels. Lines are stepped in
+// 64 bits and are not clipped. 
+#define RASTER_GUARD_BAND (1 << 13)
 
-    case OP_ANDI_D:
-    {
-      int source_value_1 = g_scalar_registers[trace_op.scalar_registers[1]].int_value;
-      int source_value_2 = trace_op.int_value;
-      g_scalar_registers[trace_op.scalar_registers[0]].int_value = 
-        source_value_1 & source_value_2;
-      SetConditionCodeInt(g_scalar_registers[trace_op.scalar_registers[0]].int_value, 0);
+static_assert((int64_t) 8 * RASTER_GUARD_BAND * RASTER_GUARD_BAND < INT_MAX / 2,
+              "edge functions inside the guard band must fit 32-bit kernels");
+
+// twice the signed area of (a, b, p); positive when p is left of a->b.
+// Exact while coordinate differences fit 31 bits. 
+static inline int64_t EdgeFunction(const VertexRegister &a, const VertexRegister &b, const int x, const int y)
+{
+  return ((int64_t) b.x_value - a.x_value) * ((int64_t) y - a.y_value) -
+         ((int64_t) b.y_value - a.y_value) * ((int64_t) x - a.x_value);
+}
+
+// top-left fill rule: pixels exactly on an edge shared by two triangles
+// are drawn by only one of them 
+static inline int EdgeBias(const VertexRegister &a, const VertexRegister &b)
+{
+  int dx = b.x_value - a.x_value;
+  int dy = b.y_value - a.y_value;
+  return (dy < 0 || (dy == 0 && dx > 0)) ? 0 : -1;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Depth test (--depth-test)
+// A triangle pixel is drawn when its interpolated 16.16 z is <= the
+// depth_buffer, so primitives at equal depth keep drawing in
+// submission order. The hierarchy keeps the farthest depth of every
+// RASTER_BLOCK_SIZE block and every tile: a triangle whose nearest
+// vertex is behind a tile's max, or whose plane is behind a block's
+// max, cannot pass anywhere in it and is skipped before any per-pixel
+// work. Lines are depth tested per pixel but never rejected early.
+////////////////////////////////////////////////////////////////////////
+#define DEPTH_FAR INT_MAX
+#define NUM_DEPTH_BLOCKS_X (FRAMEBUFFER_WIDTH / RASTER_BLOCK_SIZE)
+#define NUM_DEPTH_BLOCKS_Y (FRAMEBUFFER_HEIGHT / RASTER_BLOCK_SIZE)
+
+typedef struct DepthTarget_ {
+  int32_t *depth;               // depth_buffer 
+  int32_t *block_max;           // hiz_block_max 
+  int32_t *tile_max;            // hiz_tile_max 
+  DepthStats stats;             // this worker's counts 
+} DepthTarget;
+
+static inline bool DepthTestPixel(DepthTarget *depth, int32_t *stored, const int32_t z)
+{
+  depth->stats.pixels_tested++;
+  if (z > *stored) {
+    depth->stats.pixels_failed++;
+    return false;
+  }
+  *stored = z;
+  return true;
+}
+
+// true if the nearest vertex is behind everything drawn in the tile 
+static inline bool DepthTileHidden(const DepthTarget *depth, const GpuPrimitive &primitive,
+                                   const TileRect &rect)
+{
+  int z_min = min(primitive.vertices[0].z_value, min(primitive.vertices[1].z_value,
+                                                     primitive.vertices[2].z_value));
+  return ((int64_t) z_min << 16) > depth->tile_max[TileIndex(rect)];
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Reference triangle rasterizer: evaluates every edge function
+//       and divides the barycentric colour sum at each pixel. Used when
+//       the fixed-point setup would overflow, and as the --raster-bench
+//       baseline.
+////////////////////////////////////////////////////////////////////////
+void RasterizeTriangleReference(uint32_t *framebuffer, const GpuPrimitive &primitive, const TileRect &rect,
+                                DepthTarget *depth)
+{
+  const VertexRegister *v0 = &primitive.vertices[0];
+  const VertexRegister *v1 = &primitive.vertices[1];
+  const VertexRegister *v2 = &primitive.vertices[2];
+  int64_t area = EdgeFunction(*v0, *v1, v2->x_value, v2->y_value);
+  if (area == 0)
+    return;
+  if (area < 0) {
+    swap(v1, v2);
+    area = -area;
+  }
+
+  int x0 = max(rect.x0, min(v0->x_value, min(v1->x_value, v2->x_value)));
+  int y0 = max(rect.y0, min(v0->y_value, min(v1->y_value, v2->y_value)));
+  int x1 = min(rect.x1, max(v0->x_value, max(v1->x_value, v2->x_value)));
+  int y1 = min(rect.y1, max(v0->y_value, max(v1->y_value, v2->y_value)));
+  if (x0 > x1 || y0 > y1)
+    return;
+
+  int bias0 = EdgeBias(*v1, *v2);
+  int bias1 = EdgeBias(*v2, *v0);
+  int bias2 = EdgeBias(*v0, *v1);
+  for (int y = y0; y <= y1; y++) {
+    uint32_t *row = framebuffer + y * FRAMEBUFFER_WIDTH;
+    for (int x = x0; x <= x1; x++) {
+      int64_t w0 = EdgeFunction(*v1, *v2, x, y);
+      int64_t w1 = EdgeFunction(*v2, *v0, x, y);
+      int64_t w2 = EdgeFunction(*v0, *v1, x, y);
+      if ((w0 + bias0) < 0 || (w1 + bias1) < 0 || (w2 + bias2) < 0)
+        continue;
+      if (depth != NULL) {
+        int64_t z = ((w0 * v0->z_value + w1 * v1->z_value + w2 * v2->z_value) << 16) / area;
+        if (!DepthTestPixel(depth, depth->depth + y * FRAMEBUFFER_WIDTH + x, (int32_t) z))
+          continue;
+      }
+      int r = (w0 * v0->r_value + w1 * v1->r_value + w2 * v2->r_value) / area;
+      int g = (w0 * v0->g_value + w1 * v1->g_value + w2 * v2->g_value) / area;
+      int b = (w0 * v0->b_value + w1 * v1->b_value + w2 * v2->b_value) / area;
+      row[x] = PackColor(r, g, b);
     }
-    break;
+  }
+}
 
-    case OP_MOV:
-     {
-      if (trace_op.scalar_registers[0] < 7) {
-        g_scalar_registers[trace_op.scalar_registers[0]].int_value =
-          g_scalar_registers[trace_op.scalar_registers[1]].int_value;
-        SetConditionCodeInt(g_scalar_registers[trace_op.registers[0]].int_value, 0);
-      } else if (trace_op.scalar_registers[0] > 7) {
-        g_scalar_registers[trace_op.scalar_registers[0]].float_value =
-          g_scalar_registers[trace_op.scalar_registers[1]].float_value;
-        SetConditionCodeFloat(g_scalar_registers[trace_op.scalar_registers[0]].float_value, 0.0f);
+////////////////////////////////////////////////////////////////////////
+// Block triangle kernels
+// SetupTriangle turns a triangle into edge functions and 16.16
+// fixed-point r, g, b planes, evaluated at a RASTER_BLOCK_SIZE aligned
+// origin. Each kernel then steps the setup incrementally. The scalar
+// kernel does one pixel at a time. The SSE2 and AVX2 kernels take
+// 4x4 and 8x8 blocks: a block is rejected when it is outside an edge
+// at every corner, otherwise it is evaluated one row (one vector) at a
+// time. Colours can differ from the reference by 1 because of the
+// rounding of the fixed-point gradients.
+////////////////////////////////////////////////////////////////////////
+#define RASTER_BLOCK_SIZE 8
+
+static_assert(RASTER_TILE_SIZE % RASTER_BLOCK_SIZE == 0 && FRAMEBUFFER_WIDTH % RASTER_BLOCK_SIZE == 0,
+              "an aligned pixel block must not straddle two tiles");
+
+typedef struct TriangleSetup_ {
+  int x0, y0, x1, y1;           // bounding box clipped to the tile 
+  int origin_x, origin_y;       // (x0, y0) rounded down to RASTER_BLOCK_SIZE 
+  int w[3], w_dx[3], w_dy[3];   // biased edge functions: covered when all >= 0 
+  int c[4], c_dx[4], c_dy[4];   // r, g, b and (with depth) z in 16.16 fixed point 
+  int z_min;                    // nearest vertex z, 16.16 
+} TriangleSetup;
+
+enum TriangleSetupResult {
+  SETUP_CULLED,
+  SETUP_OK,
+  SETUP_OVERFLOW,               // edges or gradients too steep for 32-bit fixed point 
+};
+
+typedef void (*TriangleKernelFn)(uint32_t *framebuffer, const TriangleSetup &setup, DepthTarget *depth);
+
+TriangleSetupResult SetupTriangle(const GpuPrimitive &primitive, const TileRect &rect,
+                                  const bool with_depth, TriangleSetup *setup)
+{
+  const VertexRegister *v[3] = { &primitive.vertices[0], &primitive.vertices[1], &primitive.vertices[2] };
+  int64_t area = EdgeFunction(*v[0], *v[1], v[2]->x_value, v[2]->y_value);
+  if (area == 0)
+    return SETUP_CULLED;
+  if (area < 0) {
+    swap(v[1], v[2]);
+    area = -area;
+  }
+
+  setup->x0 = max(rect.x0, min(v[0]->x_value, min(v[1]->x_value, v[2]->x_value)));
+  setup->y0 = max(rect.y0, min(v[0]->y_value, min(v[1]->y_value, v[2]->y_value)));
+  setup->x1 = min(rect.x1, max(v[0]->x_value, max(v[1]->x_value, v[2]->x_value)));
+  setup->y1 = min(rect.y1, max(v[0]->y_value, max(v[1]->y_value, v[2]->y_value)));
+  if (setup->x0 > setup->x1 || setup->y0 > setup->y1)
+    return SETUP_CULLED;
+  setup->origin_x = setup->x0 & ~(RASTER_BLOCK_SIZE - 1);
+  setup->origin_y = setup->y0 & ~(RASTER_BLOCK_SIZE - 1);
+
+  // largest offset from the origin a kernel evaluates 
+  const int64_t kSpan = RASTER_TILE_SIZE + RASTER_BLOCK_SIZE;
+
+  // edge e is opposite vertex e, so its value is vertex e's weight 
+  int64_t weight[3];
+  for (int e = 0; e < 3; e++) {
+    const VertexRegister &a = *v[(e + 1) % 3];
+    const VertexRegister &b = *v[(e + 2) % 3];
+    weight[e] = EdgeFunction(a, b, setup->origin_x, setup->origin_y);
+    int64_t w_dx = (int64_t) a.y_value - b.y_value, w_dy = (int64_t) b.x_value - a.x_value;
+    if (llabs(weight[e]) + 1 + kSpan * (llabs(w_dx) + llabs(w_dy)) > INT_MAX)
+      return SETUP_OVERFLOW;
+    setup->w[e] = weight[e] + EdgeBias(a, b);
+    setup->w_dx[e] = w_dx;
+    setup->w_dy[e] = w_dy;
+  }
+  const int num_planes = with_depth ? 4 : 3;
+  for (int ch = 0; ch < num_planes; ch++) {
+    int64_t value[3];
+    for (int i = 0; i < 3; i++)
+      value[i] = (ch == 0) ? v[i]->r_value : (ch == 1) ? v[i]->g_value :
+                 (ch == 2) ? v[i]->b_value : v[i]->z_value;
+    int64_t c = ((weight[0] * value[0] + weight[1] * value[1] + weight[2] * value[2]) << 16) / area;
+    int64_t c_dx = ((int64_t) (setup->w_dx[0] * value[0] + setup->w_dx[1] * value[1] +
+                               setup->w_dx[2] * value[2]) * 65536 + area / 2) / area;
+    int64_t c_dy = ((int64_t) (setup->w_dy[0] * value[0] + setup->w_dy[1] * value[1] +
+                               setup->w_dy[2] * value[2]) * 65536 + area / 2) / area;
+    if (llabs(c) + kSpan * (llabs(c_dx) + llabs(c_dy)) > INT_MAX)
+      return SETUP_OVERFLOW;
+    setup->c[ch] = c;
+    setup->c_dx[ch] = c_dx;
+    setup->c_dy[ch] = c_dy;
+  }
+  setup->z_min = min(v[0]->z_value, min(v[1]->z_value, v[2]->z_value)) * 65536;
+  return SETUP_OK;
+}
+
+// recompute the max depth of the RASTER_BLOCK_SIZE block containing
+// (x, y) after pixels in it passed the depth test 
+static inline void UpdateBlockMax(DepthTarget *depth, const int x, const int y)
+{
+  int bx = x & ~(RASTER_BLOCK_SIZE - 1), by = y & ~(RASTER_BLOCK_SIZE - 1);
+  int32_t block_max = INT_MIN;
+  for (int r = 0; r < RASTER_BLOCK_SIZE; r++) {
+    const int32_t *row = depth->depth + (by + r) * FRAMEBUFFER_WIDTH + bx;
+    for (int i = 0; i < RASTER_BLOCK_SIZE; i++)
+      block_max = max(block_max, row[i]);
+  }
+  depth->block_max[(by / RASTER_BLOCK_SIZE) * NUM_DEPTH_BLOCKS_X + bx / RASTER_BLOCK_SIZE] = block_max;
+}
+
+static inline void UpdateBlockMaxes(DepthTarget *depth, const int x0, const int y0,
+                                    const int x1, const int y1)
+{
+  for (int y = y0 & ~(RASTER_BLOCK_SIZE - 1); y <= y1; y += RASTER_BLOCK_SIZE)
+    for (int x = x0 & ~(RASTER_BLOCK_SIZE - 1); x <= x1; x += RASTER_BLOCK_SIZE)
+      UpdateBlockMax(depth, x, y);
+}
+
+template <bool kDepth>
+void RasterizeTriangleScalar(uint32_t *framebuffer, const TriangleSetup &setup, DepthTarget *depth)
+{
+  const int num_planes = kDepth ? 4 : 3;
+  for (int y = setup.y0; y <= setup.y1; y++) {
+    int dx = setup.x0 - setup.origin_x, dy = y - setup.origin_y;
+    int w[3], c[4];
+    for (int i = 0; i < 3; i++)
+      w[i] = setup.w[i] + setup.w_dx[i] * dx + setup.w_dy[i] * dy;
+    for (int i = 0; i < num_planes; i++)
+      c[i] = setup.c[i] + setup.c_dx[i] * dx + setup.c_dy[i] * dy;
+    uint32_t *row = framebuffer + y * FRAMEBUFFER_WIDTH;
+    int32_t *depth_row = kDepth ? depth->depth + y * FRAMEBUFFER_WIDTH : NULL;
+    for (int x = setup.x0; x <= setup.x1; x++) {
+      if ((w[0] | w[1] | w[2]) >= 0 && (!kDepth || DepthTestPixel(depth, &depth_row[x], c[3])))
+        row[x] = PackColor(c[0] >> 16, c[1] >> 16, c[2] >> 16);
+      for (int i = 0; i < 3; i++)
+        w[i] += setup.w_dx[i];
+      for (int i = 0; i < num_planes; i++)
+        c[i] += setup.c_dx[i];
+    }
+  }
+  if (kDepth)
+    UpdateBlockMaxes(depth, setup.x0, setup.y0, setup.x1, setup.y1);
+}
+
+// true if the block at (bx, by) is outside some edge at all four corners 
+static inline bool BlockOutside(const TriangleSetup &setup, const int bx, const int by,
+                                const int block_size, int *corner_w)
+{
+  int dx = bx - setup.origin_x, dy = by - setup.origin_y;
+  bool outside = false;
+  for (int e = 0; e < 3; e++) {
+    corner_w[e] = setup.w[e] + setup.w_dx[e] * dx + setup.w_dy[e] * dy;
+    int max_w = corner_w[e] + (max(setup.w_dx[e], 0) + max(setup.w_dy[e], 0)) * (block_size - 1);
+    outside |= max_w < 0;
+  }
+  return outside;
+}
+
+// true if the triangle's plane is behind everything drawn in the
+// RASTER_BLOCK_SIZE block containing the block at (bx, by) 
+static inline bool DepthBlockHidden(const TriangleSetup &setup, const DepthTarget *depth,
+                                    const int bx, const int by, const int block_size)
+{
+  int dx = bx - setup.origin_x, dy = by - setup.origin_y;
+  int64_t z = setup.c[3] + (int64_t) setup.c_dx[3] * dx + (int64_t) setup.c_dy[3] * dy +
+              (int64_t) (min(setup.c_dx[3], 0) + min(setup.c_dy[3], 0)) * (block_size - 1);
+  z = max(z, (int64_t) setup.z_min);
+  return z > depth->block_max[(by / RASTER_BLOCK_SIZE) * NUM_DEPTH_BLOCKS_X + bx / RASTER_BLOCK_SIZE];
+}
+
+#ifdef HAVE_SSE2
+template <bool kDepth>
+void RasterizeTriangleSSE2(uint32_t *framebuffer, const TriangleSetup &setup, DepthTarget *depth)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i lane = _mm_setr_epi32(0, 1, 2, 3);
+  __m128i w_step[3], c_step[4];
+  for (int i = 0; i < 3; i++)
+    w_step[i] = _mm_setr_epi32(0, setup.w_dx[i], 2 * setup.w_dx[i], 3 * setup.w_dx[i]);
+  for (int i = 0; i < (kDepth ? 4 : 3); i++)
+    c_step[i] = _mm_setr_epi32(0, setup.c_dx[i], 2 * setup.c_dx[i], 3 * setup.c_dx[i]);
+
+  for (int by = setup.origin_y; by <= setup.y1; by += 4) {
+    for (int bx = setup.origin_x; bx <= setup.x1; bx += 4) {
+      int corner_w[3];
+      if (BlockOutside(setup, bx, by, 4, corner_w))
+        continue;
+      if (kDepth && DepthBlockHidden(setup, depth, bx, by, 4)) {
+        depth->stats.blocks_rejected++;
+        continue;
+      }
+      int dx = bx - setup.origin_x, dy = by - setup.origin_y;
+      __m128i x = _mm_add_epi32(_mm_set1_epi32(bx), lane);
+      __m128i in_x = _mm_andnot_si128(_mm_cmplt_epi32(x, _mm_set1_epi32(setup.x0)),
+                                      _mm_cmplt_epi32(x, _mm_set1_epi32(setup.x1 + 1)));
+      bool depth_written = false;
+
+      for (int r = max(0, setup.y0 - by); r < 4 && by + r <= setup.y1; r++) {
+        __m128i w0 = _mm_add_epi32(_mm_set1_epi32(corner_w[0] + setup.w_dy[0] * r), w_step[0]);
+        __m128i w1 = _mm_add_epi32(_mm_set1_epi32(corner_w[1] + setup.w_dy[1] * r), w_step[1]);
+        __m128i w2 = _mm_add_epi32(_mm_set1_epi32(corner_w[2] + setup.w_dy[2] * r), w_step[2]);
+        __m128i covered = _mm_and_si128(in_x,
+          _mm_cmpgt_epi32(_mm_or_si128(w0, _mm_or_si128(w1, w2)), _mm_set1_epi32(-1)));
+        if (_mm_movemask_epi8(covered) == 0)
+          continue;
+        if (kDepth) {
+          int z = setup.c[3] + setup.c_dx[3] * dx + setup.c_dy[3] * (dy + r);
+          __m128i *z_dest = (__m128i *) (depth->depth + (by + r) * FRAMEBUFFER_WIDTH + bx);
+          __m128i old_z = _mm_loadu_si128(z_dest);
+          __m128i new_z = _mm_add_epi32(_mm_set1_epi32(z), c_step[3]);
+          __m128i passed = _mm_andnot_si128(_mm_cmpgt_epi32(new_z, old_z), covered);
+          int num_tested = __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(covered)));
+          int num_passed = __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(passed)));
+          depth->stats.pixels_tested += num_tested;
+          depth->stats.pixels_failed += num_tested - num_passed;
+          if (num_passed == 0)
+            continue;
+          _mm_storeu_si128(z_dest, _mm_or_si128(_mm_and_si128(passed, new_z),
+                                                _mm_andnot_si128(passed, old_z)));
+          covered = passed;
+          depth_written = true;
+        }
+
+        __m128i channel[3];
+        for (int i = 0; i < 3; i++) {
+          int c = setup.c[i] + setup.c_dx[i] * dx + setup.c_dy[i] * (dy + r);
+          __m128i value = _mm_srai_epi32(_mm_add_epi32(_mm_set1_epi32(c), c_step[i]), 16);
+          // saturate to 0..255, one byte per lane in the low 4 bytes 
+          channel[i] = _mm_packus_epi16(_mm_packs_epi32(value, zero), zero);
+        }
+        __m128i pixels = _mm_unpacklo_epi16(_mm_unpacklo_epi8(channel[2], channel[1]),
+                                            _mm_unpacklo_epi8(channel[0], zero));
+
+        __m128i *dest = (__m128i *) (framebuffer + (by + r) * FRAMEBUFFER_WIDTH + bx);
+        __m128i old_pixels = _mm_loadu_si128(dest);
+        _mm_storeu_si128(dest, _mm_or_si128(_mm_and_si128(covered, pixels),
+                                            _mm_andnot_si128(covered, old_pixels)));
       }
+      if (kDepth && depth_written)
+        UpdateBlockMax(depth, bx, by);
     }
-    break;
+  }
+}
+#endif
 
-    case OP_MOVI_D:
-    {
-      g_scalar_registers[trace_op.scalar_registers[0]].int_value = trace_op.int_value;
-      SetConditionCodeInt(g_scalar_registers[trace_op.scalar_registers[0]].int_value, 0);
+#ifdef HAVE_AVX2_TARGET
+template <bool kDepth>
+__attribute__((target("avx2")))
+void RasterizeTriangleAVX2(uint32_t *framebuffer, const TriangleSetup &setup, DepthTarget *depth)
+{
+  const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256i w_step[3], c_step[4];
+  for (int i = 0; i < 3; i++)
+    w_step[i] = _mm256_mullo_epi32(lane, _mm256_set1_epi32(setup.w_dx[i]));
+  for (int i = 0; i < (kDepth ? 4 : 3); i++)
+    c_step[i] = _mm256_mullo_epi32(lane, _mm256_set1_epi32(setup.c_dx[i]));
+
+  for (int by = setup.origin_y; by <= setup.y1; by += 8) {
+    for (int bx = setup.origin_x; bx <= setup.x1; bx += 8) {
+      int corner_w[3];
+      if (BlockOutside(setup, bx, by, 8, corner_w))
+        continue;
+      if (kDepth && DepthBlockHidden(setup, depth, bx, by, 8)) {
+        depth->stats.blocks_rejected++;
+        continue;
+      }
+      int dx = bx - setup.origin_x, dy = by - setup.origin_y;
+      __m256i x = _mm256_add_epi32(_mm256_set1_epi32(bx), lane);
+      __m256i in_x = _mm256_andnot_si256(_mm256_cmpgt_epi32(_mm256_set1_epi32(setup.x0), x),
+                                         _mm256_cmpgt_epi32(_mm256_set1_epi32(setup.x1 + 1), x));
+      bool depth_written = false;
+
+      for (int r = max(0, setup.y0 - by); r < 8 && by + r <= setup.y1; r++) {
+        __m256i w0 = _mm256_add_epi32(_mm256_set1_epi32(corner_w[0] + setup.w_dy[0] * r), w_step[0]);
+        __m256i w1 = _mm256_add_epi32(_mm256_set1_epi32(corner_w[1] + setup.w_dy[1] * r), w_step[1]);
+        __m256i w2 = _mm256_add_epi32(_mm256_set1_epi32(corner_w[2] + setup.w_dy[2] * r), w_step[2]);
+        __m256i covered = _mm256_and_si256(in_x,
+          _mm256_cmpgt_epi32(_mm256_or_si256(w0, _mm256_or_si256(w1, w2)), _mm256_set1_epi32(-1)));
+        if (_mm256_testz_si256(covered, covered))
+          continue;
+        if (kDepth) {
+          int z = setup.c[3] + setup.c_dx[3] * dx + setup.c_dy[3] * (dy + r);
+          int *z_dest = depth->depth + (by + r) * FRAMEBUFFER_WIDTH + bx;
+          __m256i old_z = _mm256_loadu_si256((const __m256i *) z_dest);
+          __m256i new_z = _mm256_add_epi32(_mm256_set1_epi32(z), c_step[3]);
+          __m256i passed = _mm256_andnot_si256(_mm256_cmpgt_epi32(new_z, old_z), covered);
+          int num_tested = __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(covered)));
+          int num_passed = __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(passed)));
+          depth->stats.pixels_tested += num_tested;
+          depth->stats.pixels_failed += num_tested - num_passed;
+          if (num_passed == 0)
+            continue;
+          _mm256_maskstore_epi32(z_dest, passed, new_z);
+          covered = passed;
+          depth_written = true;
+        }
+
+        __m256i pixels = _mm256_setzero_si256();
+        for (int i = 0; i < 3; i++) {
+          int c = setup.c[i] + setup.c_dx[i] * dx + setup.c_dy[i] * (dy + r);
+          __m256i value = _mm256_srai_epi32(_mm256_add_epi32(_mm256_set1_epi32(c), c_step[i]), 16);
+          value = _mm256_min_epi32(_mm256_max_epi32(value, _mm256_setzero_si256()), _mm256_set1_epi32(255));
+          pixels = _mm256_or_si256(pixels, _mm256_slli_epi32(value, 16 - 8 * i));
+        }
+        _mm256_maskstore_epi32((int *) (framebuffer + (by + r) * FRAMEBUFFER_WIDTH + bx), covered, pixels);
+      }
+      if (kDepth && depth_written) {
+        // the 8x8 block is exactly one hierarchy block 
+        const int *z_block = depth->depth + by * FRAMEBUFFER_WIDTH + bx;
+        __m256i block_max = _mm256_loadu_si256((const __m256i *) z_block);
+        for (int r = 1; r < 8; r++)
+          block_max = _mm256_max_epi32(block_max,
+                                       _mm256_loadu_si256((const __m256i *) (z_block + r * FRAMEBUFFER_WIDTH)));
+        block_max = _mm256_max_epi32(block_max, _mm256_permute2x128_si256(block_max, block_max, 1));
+        block_max = _mm256_max_epi32(block_max, _mm256_shuffle_epi32(block_max, 0x4E));
+        block_max = _mm256_max_epi32(block_max, _mm256_shuffle_epi32(block_max, 0xB1));
+        depth->block_max[(by / 8) * NUM_DEPTH_BLOCKS_X + bx / 8] =
+          _mm_cvtsi128_si32(_mm256_castsi256_si128(block_max));
+      }
     }
-    break;
+  }
+}
+#endif
 
-    case OP_MOVI_F:
-    {
-      g_scalar_registers[trace_op.scalar_registers[0]].float_value = trace_op.float_value;
-      SetConditionCodeFloat(g_scalar_registers[trace_op.scalar_registers[0]].float_value, 0.0f);
+template <bool kDepth>
+TriangleKernelFn SelectTriangleKernel()
+{
+#ifdef HAVE_AVX2_TARGET
+  if (__builtin_cpu_supports("avx2"))
+    return RasterizeTriangleAVX2<kDepth>;
+#endif
+#ifdef HAVE_SSE2
+  return RasterizeTriangleSSE2<kDepth>;
+#else
+  return RasterizeTriangleScalar<kDepth>;
+#endif
+}
+
+// tile max from its block maxes, after a triangle is done in the tile 
+void UpdateTileMax(DepthTarget *depth, const TileRect &rect)
+{
+  int32_t tile_max = INT_MIN;
+  for (int by = rect.y0; by <= rect.y1; by += RASTER_BLOCK_SIZE)
+    for (int bx = rect.x0; bx <= rect.x1; bx += RASTER_BLOCK_SIZE)
+      tile_max = max(tile_max, depth->block_max[(by / RASTER_BLOCK_SIZE) * NUM_DEPTH_BLOCKS_X +
+                                                bx / RASTER_BLOCK_SIZE]);
+  depth->tile_max[TileIndex(rect)] = tile_max;
+}
+
+void ClearDepth(SimulatorContext &context)
+{
+  context.depth_buffer.assign(FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT, DEPTH_FAR);
+  context.hiz_block_max.assign(NUM_DEPTH_BLOCKS_X * NUM_DEPTH_BLOCKS_Y, DEPTH_FAR);
+  context.hiz_tile_max.assign(NUM_TILES_X * NUM_TILES_Y, DEPTH_FAR);
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Draw a Gouraud-shaded triangle, clipped to rect, with the best
+//       block kernel for this CPU; depth tested unless depth is NULL
+////////////////////////////////////////////////////////////////////////
+void RasterizeTriangle(uint32_t *framebuffer, const GpuPrimitive &primitive, const TileRect &rect,
+                       DepthTarget *depth)
+{
+  static const TriangleKernelFn s_triangle_kernel = SelectTriangleKernel<false>();
+  static const TriangleKernelFn s_depth_kernel = SelectTriangleKernel<true>();
+  if (depth != NULL && DepthTileHidden(depth, primitive, rect)) {
+    depth->stats.tiles_rejected++;
+    return;
+  }
+
+  TriangleSetup setup;
+  switch (SetupTriangle(primitive, rect, depth != NULL, &setup)) {
+    case SETUP_OK:
+      (depth != NULL ? s_depth_kernel : s_triangle_kernel)(framebuffer, setup, depth);
+      break;
+    case SETUP_OVERFLOW:
+      RasterizeTriangleReference(framebuffer, primitive, rect, depth);
+      if (depth != NULL)
+        UpdateBlockMaxes(depth, setup.x0, setup.y0, setup.x1, setup.y1);
+      break;
+    default:
+      return;
+  }
+  if (depth != NULL)
+    UpdateTileMax(depth, rect);
+}
+
+////////////////////////////////////////////////////////////////////////
+// Line rasterizer
+// A line steps along its major axis from the vertex with the smaller
+// major coordinate. The minor coordinate of step i is the exact line
+// rounded to the nearest pixel, b0 + floor((2 * i * db + n) / (2 * n)),
+// kept as a Bresenham remainder that is started in closed form at the
+// first step inside the tile. Every tile therefore agrees on the pixels
+// of a line, and only pays for its own part of it. Steps with the same
+// minor coordinate form a run, which an x-major line fills as a row
+// span. Colour (and with --depth-test, z) is interpolated per step in
+// 16.16 fixed point from vertices[0] to vertices[1].
+////////////////////////////////////////////////////////////////////////
+
+// fill row[0, length) with the colours c + i * c_step (16.16 r, g, b) 
+static inline void FillSpan(uint32_t *row, const int length, const int *c, const int *c_step)
+{
+  int i = 0;
+#ifdef HAVE_SSE2
+  if (length >= 4) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i value[3], step[3];
+    for (int ch = 0; ch < 3; ch++) {
+      value[ch] = _mm_setr_epi32(c[ch], c[ch] + c_step[ch], c[ch] + 2 * c_step[ch], c[ch] + 3 * c_step[ch]);
+      step[ch] = _mm_set1_epi32(4 * c_step[ch]);
     }
-    break;
+    for (; i + 4 <= length; i += 4) {
+      __m128i channel[3];
+      for (int ch = 0; ch < 3; ch++) {
+        channel[ch] = _mm_srai_epi32(value[ch], 16);
+        channel[ch] = _mm_packus_epi16(_mm_packs_epi32(channel[ch], zero), zero);
+        value[ch] = _mm_add_epi32(value[ch], step[ch]);
+      }
+      _mm_storeu_si128((__m128i *) (row + i),
+                       _mm_unpacklo_epi16(_mm_unpacklo_epi8(channel[2], channel[1]),
+                                          _mm_unpacklo_epi8(channel[0], zero)));
+    }
+  }
+#endif
+  for (; i < length; i++)
+    row[i] = PackColor((c[0] + i * c_step[0]) >> 16, (c[1] + i * c_step[1]) >> 16,
+                       (c[2] + i * c_step[2]) >> 16);
+}
 
-    case OP_VMOV:
-    {
-      for (int i = 0; i < NUM_VECTOR_ELEMENTS; i++) {
-        g_vector_registers[trace_op.vector_registers[0]].element[i].float_value =
-          g_vector_registers[trace_op.vector_registers[1]].element[i].float_value;
+// draw length pixels, stride apart, starting with the 16.16 colour and
+// z in c 
+static inline void DrawLineRun(uint32_t *pixel, const int stride, const int length, const int *c,
+                               const int *c_step, DepthTarget *depth, int32_t *z_pixel)
+{
+  if (stride == 1 && depth == NULL) {
+    FillSpan(pixel, length, c, c_step);
+    return;
+  }
+  int value[4] = { c[0], c[1], c[2], c[3] };
+  for (int k = 0; k < length; k++) {
+    if (depth == NULL || DepthTestPixel(depth, z_pixel + k * stride, value[3]))
+      pixel[k * stride] = PackColor(value[0] >> 16, value[1] >> 16, value[2] >> 16);
+    for (int ch = 0; ch < 4; ch++)
+      value[ch] += c_step[ch];
+  }
+}
+
+// true if no pixel of the line can be inside rect: the chosen pixels
+// are within half a pixel of the line, so all four corners would be
+// further than that on one side. Lines longer than the guard band are
+// never rejected, their edge function could overflow. 
+static inline bool LineMissesRect(const GpuPrimitive &primitive, const TileRect &rect)
+{
+  const VertexRegister &a = primitive.vertices[0];
+  const VertexRegister &b = primitive.vertices[1];
+  int64_t margin = max(llabs((int64_t) b.x_value - a.x_value), llabs((int64_t) b.y_value - a.y_value));
+  if (margin > RASTER_GUARD_BAND)
+    return false;
+  int64_t e[4] = { EdgeFunction(a, b, rect.x0, rect.y0), EdgeFunction(a, b, rect.x1, rect.y0),
+                   EdgeFunction(a, b, rect.x0, rect.y1), EdgeFunction(a, b, rect.x1, rect.y1) };
+  return min(min(e[0], e[1]), min(e[2], e[3])) > margin ||
+         max(max(e[0], e[1]), max(e[2], e[3])) < -margin;
+}
+
+// floor((2 * i * db + length) / (2 * length)) and its remainder, for
+// 0 <= db <= length < 2^32 and 0 <= i < 2^32, in 64 bits 
+static inline int64_t LineMinorSteps(const int64_t i, const int64_t db, const int64_t length,
+                                     int64_t *remainder)
+{
+  const int64_t two_length = 2 * max<int64_t>(length, 1);
+  int64_t high = 2 * (i >> 16) * db;
+  int64_t low = ((high % two_length) << 16) + 2 * (i & 0xFFFF) * db + length;
+  *remainder = low % two_length;
+  return ((high / two_length) << 16) + low / two_length;
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Draw the line from vertices[0] to vertices[1], clipped to rect,
+//       interpolating colour between them; depth tested unless depth
+//       is NULL
+////////////////////////////////////////////////////////////////////////
+void RasterizeLine(uint32_t *framebuffer, const GpuPrimitive &primitive, const TileRect &rect,
+                   DepthTarget *depth)
+{
+  const VertexRegister *v0 = &primitive.vertices[0];
+  const VertexRegister *v1 = &primitive.vertices[1];
+  const bool x_major = llabs((int64_t) v1->x_value - v0->x_value) >= llabs((int64_t) v1->y_value - v0->y_value);
+  if (x_major ? v1->x_value < v0->x_value : v1->y_value < v0->y_value)
+    swap(v0, v1);
+
+  // a: major axis, b: minor axis. Lengths and steps are 64-bit, so
+  // lines need no guard-band clipping. 
+  const int a0 = x_major ? v0->x_value : v0->y_value;
+  const int b0 = x_major ? v0->y_value : v0->x_value;
+  const int b1 = x_major ? v1->y_value : v1->x_value;
+  const int64_t length = (int64_t) (x_major ? v1->x_value : v1->y_value) - a0;
+  const int64_t db = llabs((int64_t) b1 - b0);
+  const int step_b = b1 < b0 ? -1 : 1;
+  const int b_lo = x_major ? rect.y0 : rect.x0, b_hi = x_major ? rect.y1 : rect.x1;
+
+  int64_t i = max<int64_t>(0, (int64_t) (x_major ? rect.x0 : rect.y0) - a0);
+  const int64_t last = min<int64_t>(length, (int64_t) (x_major ? rect.x1 : rect.y1) - a0);
+  if (i > last)
+    return;
+
+  const int64_t two_length = 2 * max<int64_t>(length, 1);
+  int64_t remainder;
+  int b = (int) (b0 + step_b * LineMinorSteps(i, db, length, &remainder));
+
+  // endpoint colours are clamped first so the 16.16 planes cannot overflow 
+  int c[4], c_step[4];
+  for (int ch = 0; ch < 4; ch++) {
+    int value0 = (ch == 0) ? v0->r_value : (ch == 1) ? v0->g_value : (ch == 2) ? v0->b_value : v0->z_value;
+    int value1 = (ch == 0) ? v1->r_value : (ch == 1) ? v1->g_value : (ch == 2) ? v1->b_value : v1->z_value;
+    if (ch < 3) {
+      value0 = min(max(value0, 0), 255);
+      value1 = min(max(value1, 0), 255);
+    }
+    c_step[ch] = (int) (((int64_t) (value1 - value0) * 65536) / max<int64_t>(length, 1));
+    c[ch] = (int) (value0 * 65536 + (ch < 3 ? 0x8000 : 0) + i * c_step[ch]);
+  }
+
+  const int stride = x_major ? 1 : FRAMEBUFFER_WIDTH;
+  while (i <= last) {
+    if (step_b > 0 ? b > b_hi : b < b_lo)
+      break;
+    int run = (int) (last - i + 1);
+    if (db != 0)
+      run = min<int64_t>(run, (two_length - remainder + 2 * db - 1) / (2 * db));
+    if (b >= b_lo && b <= b_hi) {
+      int a = (int) (a0 + i);
+      int offset = x_major ? b * FRAMEBUFFER_WIDTH + a : a * FRAMEBUFFER_WIDTH + b;
+      DrawLineRun(framebuffer + offset, stride, run, c, c_step, depth,
+                  depth != NULL ? depth->depth + offset : NULL);
+    }
+    i += run;
+    for (int ch = 0; ch < 4; ch++)
+      c[ch] += run * c_step[ch];
+    remainder += run * 2 * db;
+    if (remainder >= two_length) {
+      remainder -= two_length;
+      b += step_b;
+    }
+  }
+
+  if (depth != NULL) {
+    UpdateBlockMaxes(depth, max(rect.x0, min(v0->x_value, v1->x_value)),
+                     max(rect.y0, min(v0->y_value, v1->y_value)),
+                     min(rect.x1, max(v0->x_value, v1->x_value)),
+                     min(rect.y1, max(v0->y_value, v1->y_value)));
+    UpdateTileMax(depth, rect);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: --raster-bench: draw a fixed pseudo-random set of triangles
+//       with the reference rasterizer and every block kernel this CPU
+//       supports, and report pixels per second and the largest colour
+//       difference from the reference
+// output: false if a kernel covers different pixels than the reference
+//         or is off by more than 1 in a colour channel
+////////////////////////////////////////////////////////////////////////
+bool RunRasterBenchmark()
+{
+  const int kNumTriangles = 20000;
+  const int kRepeats = 5;
+  vector<GpuPrimitive> triangles(kNumTriangles);
+  uint32_t seed = 3220;
+  double total_pixels = 0;
+  for (int i = 0; i < kNumTriangles; i++) {
+    GpuPrimitive &triangle = triangles[i];
+    triangle.type = PRIM_TRIANGLE;
+    seed = seed * 1103515245 + 12345;
+    int center_x = (seed >> 8) % FRAMEBUFFER_WIDTH;
+    seed = seed * 1103515245 + 12345;
+    int center_y = (seed >> 8) % FRAMEBUFFER_HEIGHT;
+    for (int v = 0; v < 3; v++) {
+      int random[5];
+      for (int j = 0; j < 5; j++) {
+        seed = seed * 1103515245 + 12345;
+        random[j] = seed >> 8;
       }
+      VertexRegister &vertex = triangle.vertices[v];
+      vertex.x_value = center_x + random[0] % 96 - 48;
+      vertex.y_value = center_y + random[1] % 96 - 48;
+      vertex.z_value = 0;
+      vertex.r_value = random[2] & 0xFF;
+      vertex.g_value = random[3] & 0xFF;
+      vertex.b_value = random[4] & 0xFF;
     }
-    break;
-  
-    case OP_VMOVI:
-    {
-      for (int i = 0; i < NUM_VECTOR_ELEMENTS; i++) {
-        g_vector_registers[trace_op.vector_registers[0]].element[i].float_value =
-          trace_op.float_value;
+    total_pixels += llabs(EdgeFunction(triangle.vertices[0], triangle.vertices[1],
+                                     triangle.vertices[2].x_value, triangle.vertices[2].y_value)) / 2.0;
+  }
+
+  typedef struct Kernel_ {
+    const char *name;
+    TriangleKernelFn kernel;  // NULL: reference rasterizer 
+  } Kernel;
+  vector<Kernel> kernels;
+  Kernel reference = { "reference", NULL };
+  Kernel scalar = { "scalar", RasterizeTriangleScalar<false> };
+  kernels.push_back(reference);
+  kernels.push_back(scalar);
+#ifdef HAVE_SSE2
+  Kernel sse2 = { "sse2", RasterizeTriangleSSE2<false> };
+  kernels.push_back(sse2);
+#endif
+#ifdef HAVE_AVX2_TARGET
+  Kernel avx2 = { "avx2", RasterizeTriangleAVX2<false> };
+  if (__builtin_cpu_supports("avx2"))
+    kernels.push_back(avx2);
+#endif
+
+  TileRect screen = { 0, 0, FRAMEBUFFER_WIDTH - 1, FRAMEBUFFER_HEIGHT - 1 };
+  vector<uint32_t> reference_frame;
+  double reference_rate = 0;
+  bool ok = true;
+  for (size_t k = 0; k < kernels.size(); k++) {
+    vector<uint32_t> framebuffer(FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT, 0);
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    for (int repeat = 0; repeat < kRepeats; repeat++) {
+      for (int i = 0; i < kNumTriangles; i++) {
+        TriangleSetup setup;
+        TriangleSetupResult result = SETUP_OVERFLOW;
+        if (kernels[k].kernel != NULL)
+          result = SetupTriangle(triangles[i], screen, false, &setup);
+        if (result == SETUP_OK)
+          kernels[k].kernel(&framebuffer[0], setup, NULL);
+        else if (result == SETUP_OVERFLOW)
+          RasterizeTriangleReference(&framebuffer[0], triangles[i], screen, NULL);
       }
     }
-    break;
- 
-    case OP_CMP:
-    {
-      if (trace_op.scalar_registers[0] < 7)
-        SetConditionCodeInt(
-          g_scalar_registers[trace_op.scalar_registers[0]].int_value,
-          g_scalar_registers[trace_op.scalar_registers[1]].int_value);
-      else if (trace_op.scalar_registers[0] > 7)
-        SetConditionCodeFloat(
-          g_scalar_registers[trace_op.scalar_registers[0]].float_value,
-          g_scalar_registers[trace_op.scalar_registers[1]].float_value);
- 
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    double rate = total_pixels * kRepeats / seconds;
+
+    int max_difference = 0;
+    size_t coverage_mismatches = 0;
+    if (k == 0) {
+      reference_frame = framebuffer;
+      reference_rate = rate;
+    } else {
+      for (size_t p = 0; p < framebuffer.size(); p++) {
+        if ((framebuffer[p] == 0) != (reference_frame[p] == 0))
+          coverage_mismatches++;
+        for (int shift = 0; shift < 24; shift += 8)
+          max_difference = max(max_difference, abs((int) ((framebuffer[p] >> shift) & 0xFF) -
+                                                   (int) ((reference_frame[p] >> shift) & 0xFF)));
+      }
     }
-    break;
+    printf("%-10s %8.1f Mpixels/s  %5.2fx  max diff %d  coverage mismatches %zu\n",
+           kernels[k].name, rate / 1e6, rate / reference_rate, max_difference, coverage_mismatches);
+    ok &= max_difference <= 1 && coverage_mismatches == 0;
+  }
+  return ok;
+}
 
-    case OP_CMPI:
+////////////////////////////////////////////////////////////////////////
+// desc: Append the index of every queued primitive to the bins of the
+//       tiles its bounding box overlaps
+////////////////////////////////////////////////////////////////////////
+void BinPrimitives(SimulatorContext &context)
+{
+  context.gpu_tile_bins.resize(NUM_TILES_X * NUM_TILES_Y);
+  for (size_t i = 0; i < context.gpu_tile_bins.size(); i++)
+    context.gpu_tile_bins[i].clear();
+
+  for (size_t i = 0; i < context.gpu_primitives.size(); i++) {
+    const GpuPrimitive &primitive = context.gpu_primitives[i];
+    int num_vertices = (primitive.type == PRIM_TRIANGLE) ? 3 : 2;
+    int x0 = INT_MAX, y0 = INT_MAX, x1 = INT_MIN, y1 = INT_MIN;
+    for (int v = 0; v < num_vertices; v++) {
+      x0 = min(x0, primitive.vertices[v].x_value);
+      y0 = min(y0, primitive.vertices[v].y_value);
+      x1 = max(x1, primitive.vertices[v].x_value);
+      y1 = max(y1, primitive.vertices[v].y_value);
+    }
+    if (x1 < 0 || y1 < 0 || x0 >= FRAMEBUFFER_WIDTH || y0 >= FRAMEBUFFER_HEIGHT)
+      continue;
+
+    int tile_x0 = max(x0, 0) / RASTER_TILE_SIZE;
+    int tile_y0 = max(y0, 0) / RASTER_TILE_SIZE;
+    int tile_x1 = min(x1, FRAMEBUFFER_WIDTH - 1) / RASTER_TILE_SIZE;
+    int tile_y1 = min(y1, FRAMEBUFFER_HEIGHT - 1) / RASTER_TILE_SIZE;
+    for (int tile_y = tile_y0; tile_y <= tile_y1; tile_y++) {
+      for (int tile_x = tile_x0; tile_x <= tile_x1; tile_x++) {
+        int tile_idx = tile_y * NUM_TILES_X + tile_x;
+        if (primitive.type == PRIM_LINE && LineMissesRect(primitive, TileBounds(tile_idx)))
+          continue;
+        context.gpu_tile_bins[tile_idx].push_back(i);
+      }
+    }
+  }
+}
+
+void RasterizeTile(SimulatorContext &context, const int tile_idx, DepthTarget *depth)
+{
+  const vector<uint32_t> &bin = context.gpu_tile_bins[tile_idx];
+  TileRect rect = TileBounds(tile_idx);
+  for (size_t i = 0; i < bin.size(); i++) {
+    const GpuPrimitive &primitive = context.gpu_primitives[bin[i]];
+    if (primitive.type == PRIM_TRIANGLE)
+      RasterizeTriangle(&context.framebuffer[0], primitive, rect, depth);
+    else
+      RasterizeLine(&context.framebuffer[0], primitive, rect, depth);
+  }
+}
+
+typedef struct RasterJob_ {
+  SimulatorContext *context;
+  atomic<int> next_tile;
+  mutex stats_mutex;            // guards context->depth_stats 
+  int num_helpers;              // pool helpers still on the job, guarded by the pool 
+} RasterJob;
+
+void RasterWorker(RasterJob *job)
+{
+  SimulatorContext &context = *job->context;
+  DepthTarget depth_target;
+  DepthTarget *depth = NULL;
+  if (g_depth_test) {
+    depth_target.depth = &context.depth_buffer[0];
+    depth_target.block_max = &context.hiz_block_max[0];
+    depth_target.tile_max = &context.hiz_tile_max[0];
+    memset(&depth_target.stats, 0x00, sizeof(DepthStats));
+    depth = &depth_target;
+  }
+
+  for (;;) {
+    int tile_idx = job->next_tile.fetch_add(1);
+    if (tile_idx >= NUM_TILES_X * NUM_TILES_Y)
+      break;
+    if (!context.gpu_tile_bins[tile_idx].empty())
+      RasterizeTile(context, tile_idx, depth);
+  }
+
+  if (depth != NULL) {
+    lock_guard<mutex> lock(job->stats_mutex);
+    context.depth_stats.tiles_rejected += depth->stats.tiles_rejected;
+    context.depth_stats.blocks_rejected += depth->stats.blocks_rejected;
+    context.depth_stats.pixels_tested += depth->stats.pixels_tested;
+    context.depth_stats.pixels_failed += depth->stats.pixels_failed;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////
+// Rasterizer helper threads, started once and shared by every context
+// in the process, so batch workers flushing at the same time share one
+// set of helpers instead of each starting their own per FLUSH.
+// Rasterize() posts a job, works on its tiles alongside any idle
+// helpers, and returns once no helper is still on the job.
+////////////////////////////////////////////////////////////////////////
+class RasterPool {
+ public:
+  explicit RasterPool(const int num_helpers);
+  ~RasterPool();
+  void Rasterize(RasterJob *job);
+
+ private:
+  void Help();
+
+  mutex mutex_;
+  condition_variable job_posted_;
+  condition_variable job_released_;
+  deque<RasterJob *> jobs_;     // posted jobs that may have tiles left 
+  bool stop_;
+  vector<thread> helpers_;
+};
+
+RasterPool::RasterPool(const int num_helpers)
+  : stop_(false)
+{
+  for (int i = 0; i < num_helpers; i++)
+    helpers_.push_back(thread(&RasterPool::Help, this));
+}
+
+RasterPool::~RasterPool()
+{
+  {
+    lock_guard<mutex> lock(mutex_);
+    stop_ = true;
+  }
+  job_posted_.notify_all();
+  for (size_t i = 0; i < helpers_.size(); i++)
+    helpers_[i].join();
+}
+
+void RasterPool::Rasterize(RasterJob *job)
+{
+  job->num_helpers = 0;
+  if (!helpers_.empty()) {
     {
-      if (trace_op.scalar_registers[0] < 7)
-        SetConditionCodeInt(
-          g_scalar_registers[trace_op.scalar_registers[0]].int_value,
-          trace_op.int_value);
-      else if (trace_op.scalar_registers[0] > 7)
-        SetConditionCodeFloat(
-          g_scalar_registers[trace_op.scalar_registers[0]].float_value,
-          trace_op.float_value);
- 
+      lock_guard<mutex> lock(mutex_);
+      jobs_.push_back(job);
     }
-    break;
+    job_posted_.notify_all();
+  }
+  RasterWorker(job);
+
+  // every tile is taken: no new helper may join, wait for the rest 
+  unique_lock<mutex> lock(mutex_);
+  jobs_.erase(remove(jobs_.begin(), jobs_.end(), job), jobs_.end());
+  job_released_.wait(lock, [job] { return job->num_helpers == 0; });
+}
+
+void RasterPool::Help()
+{
+  unique_lock<mutex> lock(mutex_);
+  for (;;) {
+    job_posted_.wait(lock, [this] { return stop_ || !jobs_.empty(); });
+    if (stop_)
+      return;
+    RasterJob *job = jobs_.front();
+    if (job->next_tile.load() >= NUM_TILES_X * NUM_TILES_Y) {
+      jobs_.pop_front();
+      continue;
+    }
+    job->num_helpers++;
+    lock.unlock();
+    RasterWorker(job);
+    lock.lock();
+    jobs_.erase(remove(jobs_.begin(), jobs_.end(), job), jobs_.end());
+    if (--job->num_helpers == 0)
+      job_released_.notify_all();
+  }
+}
+
+static int NumRasterThreads()
+{
+  int num_threads = g_gpu_threads;
+  if (num_threads <= 0)
+    num_threads = max(1u, thread::hardware_concurrency());
+  return min(num_threads, NUM_TILES_X * NUM_TILES_Y);
+}
+
+// the pool for g_gpu_threads, created on the first FLUSH that draws 
+static RasterPool &SharedRasterPool()
+{
+  static RasterPool s_pool(NumRasterThreads() - 1);  // plus the flushing thread 
+  return s_pool;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Vertex pipeline
+// TRANSLATE/ROTATE/SCALE only append to gpu_pending_transforms; the
+// model-view matrix is brought up to date once per primitive (or at
+// PUSHMATRIX). SETVERTEX appends to gpu_vertex_buffer, which is
+// transformed as one batch at ENDPRIMITIVE or DRAW, or earlier when a
+// matrix operation follows vertices not yet transformed. Matrices are
+// 16.16 fixed point; buffered coordinates are 1.11.4 like the vector
+// registers they come from.
+////////////////////////////////////////////////////////////////////////
+#define MAX_PENDING_TRANSFORMS 64  // fold early so the list stays bounded 
+
+static inline int32_t FloatToFixed1616(const double value)
+{
+  return (int32_t) llround(value * 65536.0);
+}
+
+static inline int32_t MultiplyFixed1616(const int32_t a, const int32_t b)
+{
+  return (int32_t) (((int64_t) a * b) >> 16);
+}
+
+TransformMatrix IdentityMatrix()
+{
+  TransformMatrix matrix = { 1 << 16, 0, 0, 0, 1 << 16, 0 };
+  return matrix;
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: matrix = matrix * transform, so transform applies to vertices
+//       before everything already in matrix (OpenGL order)
+////////////////////////////////////////////////////////////////////////
+void ApplyTransform(TransformMatrix &matrix, const TransformOp &transform)
+{
+  TransformMatrix t = IdentityMatrix();
+  if (transform.opcode == OP_TRANSLATE) {
+    t.tx = FloatToFixed1616(transform.x);
+    t.ty = FloatToFixed1616(transform.y);
+  } else if (transform.opcode == OP_SCALE) {
+    t.a = FloatToFixed1616(transform.x);
+    t.d = FloatToFixed1616(transform.y);
+  } else {
+    // ROTATE: x = angle in degrees, y = z of the rotation axis, like
+    // glRotatef(angle, 0, 0, z). The baseline read both operands but
+    // never defined the operation, so the convention is ours: the
+    // rotation is counter-clockwise about +z, or clockwise when z < 0.
+    // Only the sign of z counts; z == 0 is taken as +z.
+    double radians = transform.x * (M_PI / 180.0) * (transform.y < 0 ? -1.0 : 1.0);
+    t.a = t.d = FloatToFixed1616(cos(radians));
+    t.c = FloatToFixed1616(sin(radians));
+    t.b = -t.c;
+  }
+
+  TransformMatrix m = matrix;
+  matrix.a = MultiplyFixed1616(m.a, t.a) + MultiplyFixed1616(m.b, t.c);
+  matrix.b = MultiplyFixed1616(m.a, t.b) + MultiplyFixed1616(m.b, t.d);
+  matrix.tx = MultiplyFixed1616(m.a, t.tx) + MultiplyFixed1616(m.b, t.ty) + m.tx;
+  matrix.c = MultiplyFixed1616(m.c, t.a) + MultiplyFixed1616(m.d, t.c);
+  matrix.d = MultiplyFixed1616(m.c, t.b) + MultiplyFixed1616(m.d, t.d);
+  matrix.ty = MultiplyFixed1616(m.c, t.tx) + MultiplyFixed1616(m.d, t.ty) + m.ty;
+}
+
+// bring gpu_matrix up to date with the pending transforms 
+const TransformMatrix &CurrentMatrix(SimulatorContext &context)
+{
+  for (size_t i = 0; i < context.gpu_pending_transforms.size(); i++)
+    ApplyTransform(context.gpu_matrix, context.gpu_pending_transforms[i]);
+  context.gpu_pending_transforms.clear();
+  return context.gpu_matrix;
+}
+
+// values: 1.11.4 x, y, z, then r, g, b 
+void GpuAppendVertex(SimulatorContext &context, const int *values)
+{
+  VertexBuffer &buffer = context.gpu_vertex_buffer;
+  buffer.x.push_back(values[0]);
+  buffer.y.push_back(values[1]);
+  buffer.z.push_back(values[2]);
+  buffer.r.push_back(values[3]);
+  buffer.g.push_back(values[4]);
+  buffer.b.push_back(values[5]);
+}
+
+// 1.11.4 model coordinates -> pixels: (m * 16.16) >> 20, rounded 
+void TransformVerticesScalar(const TransformMatrix &matrix, int *x, int *y, int *z, const size_t count)
+{
+  for (size_t i = 0; i < count; i++) {
+    int64_t model_x = x[i], model_y = y[i];
+    x[i] = (int) ((matrix.a * model_x + matrix.b * model_y + ((int64_t) matrix.tx << 4) + (1 << 19)) >> 20);
+    y[i] = (int) ((matrix.c * model_x + matrix.d * model_y + ((int64_t) matrix.ty << 4) + (1 << 19)) >> 20);
+    z[i] = (z[i] + 8) >> 4;
+  }
+}
+
+#ifdef HAVE_AVX2_TARGET
+__attribute__((target("avx2")))
+void TransformVerticesAVX2(const TransformMatrix &matrix, int *x, int *y, int *z, const size_t count)
+{
+  const __m256i a = _mm256_set1_epi64x(matrix.a), b = _mm256_set1_epi64x(matrix.b);
+  const __m256i c = _mm256_set1_epi64x(matrix.c), d = _mm256_set1_epi64x(matrix.d);
+  const __m256i tx = _mm256_set1_epi64x(((int64_t) matrix.tx << 4) + (1 << 19));
+  const __m256i ty = _mm256_set1_epi64x(((int64_t) matrix.ty << 4) + (1 << 19));
+  const __m256i low_halves = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    // four vertices per step, one 64-bit lane each 
+    __m256i model_x = _mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i *) (x + i)));
+    __m256i model_y = _mm256_cvtepi32_epi64(_mm_loadu_si128((const __m128i *) (y + i)));
+    __m256i screen_x = _mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epi32(a, model_x),
+                                                         _mm256_mul_epi32(b, model_y)), tx);
+    __m256i screen_y = _mm256_add_epi64(_mm256_add_epi64(_mm256_mul_epi32(c, model_x),
+                                                         _mm256_mul_epi32(d, model_y)), ty);
+    // logical shifts: only the low 32 bits of each lane are kept 
+    screen_x = _mm256_permutevar8x32_epi32(_mm256_srli_epi64(screen_x, 20), low_halves);
+    screen_y = _mm256_permutevar8x32_epi32(_mm256_srli_epi64(screen_y, 20), low_halves);
+    _mm_storeu_si128((__m128i *) (x + i), _mm256_castsi256_si128(screen_x));
+    _mm_storeu_si128((__m128i *) (y + i), _mm256_castsi256_si128(screen_y));
+    __m128i depth = _mm_loadu_si128((const __m128i *) (z + i));
+    _mm_storeu_si128((__m128i *) (z + i), _mm_srai_epi32(_mm_add_epi32(depth, _mm_set1_epi32(8)), 4));
+  }
+  TransformVerticesScalar(matrix, x + i, y + i, z + i, count - i);
+}
+#endif
+
+typedef void (*TransformVerticesFn)(const TransformMatrix &matrix, int *x, int *y, int *z,
+                                    const size_t count);
+
+TransformVerticesFn SelectTransformVertices()
+{
+#ifdef HAVE_AVX2_TARGET
+  if (__builtin_cpu_supports("avx2"))
+    return TransformVerticesAVX2;
+#endif
+  return TransformVerticesScalar;
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Transform the untransformed part of the vertex buffer to
+//       pixels with the current model-view matrix
+////////////////////////////////////////////////////////////////////////
+void GpuTransformVertices(SimulatorContext &context)
+{
+  static const TransformVerticesFn s_transform_vertices = SelectTransformVertices();
+  VertexBuffer &buffer = context.gpu_vertex_buffer;
+  size_t first = buffer.num_transformed;
+  if (first == buffer.x.size())
+    return;
+  s_transform_vertices(CurrentMatrix(context), &buffer.x[first], &buffer.y[first], &buffer.z[first],
+                       buffer.x.size() - first);
+  buffer.num_transformed = buffer.x.size();
+}
+
+// matrix operations first transform the vertices set so far, so
+// each vertex keeps the matrix that was current at its SETVERTEX 
+void GpuQueueTransform(SimulatorContext &context, const TransformOp &transform)
+{
+  GpuTransformVertices(context);
+  context.gpu_pending_transforms.push_back(transform);
+  if (context.gpu_pending_transforms.size() >= MAX_PENDING_TRANSFORMS)
+    CurrentMatrix(context);
+}
+
+void GpuPushMatrix(SimulatorContext &context)
+{
+  GpuTransformVertices(context);
+  context.gpu_matrix_stack.push_back(CurrentMatrix(context));
+}
+
+void GpuPopMatrix(SimulatorContext &context)
+{
+  GpuTransformVertices(context);
+  context.gpu_pending_transforms.clear();
+  if (context.gpu_matrix_stack.empty()) {
+    context.gpu_matrix = IdentityMatrix();
+    return;
+  }
+  context.gpu_matrix = context.gpu_matrix_stack.back();
+  context.gpu_matrix_stack.pop_back();
+}
+
+void GpuLoadIdentity(SimulatorContext &context)
+{
+  GpuTransformVertices(context);
+  context.gpu_pending_transforms.clear();
+  context.gpu_matrix = IdentityMatrix();
+}
+
+void ClearVertexBuffer(VertexBuffer &buffer)
+{
+  buffer.x.clear();
+  buffer.y.clear();
+  buffer.z.clear();
+  buffer.r.clear();
+  buffer.g.clear();
+  buffer.b.clear();
+  buffer.num_transformed = 0;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Guard-band clipping
+// The triangle kernels step edge functions in 32 bits, which only
+// holds while every vertex is within RASTER_GUARD_BAND pixels of the
+// origin. GpuDraw clips a triangle reaching further to that square and
+// queues the convex polygon left as a fan of triangles. The new
+// vertices are rounded to whole pixels, far off screen: an edge cut at
+// one end barely moves on screen, one cut at both ends by at most half
+// a pixel.
+////////////////////////////////////////////////////////////////////////
+static inline bool InGuardBand(const VertexRegister &vertex)
+{
+  return vertex.x_value >= -RASTER_GUARD_BAND && vertex.x_value <= RASTER_GUARD_BAND &&
+         vertex.y_value >= -RASTER_GUARD_BAND && vertex.y_value <= RASTER_GUARD_BAND;
+}
+
+// signed distance of vertex inside the guard band edge clip_edge
+// (0..3: right, left, bottom, top) 
+static inline double GuardBandDistance(const VertexRegister &vertex, const int clip_edge)
+{
+  double value = (clip_edge < 2) ? vertex.x_value : vertex.y_value;
+  return RASTER_GUARD_BAND - ((clip_edge & 1) ? -value : value);
+}
+
+// the vertex where a->b crosses clip_edge, every value rounded 
+static VertexRegister ClipVertex(const VertexRegister &a, const VertexRegister &b, const int clip_edge)
+{
+  double distance_a = GuardBandDistance(a, clip_edge);
+  double t = distance_a / (distance_a - GuardBandDistance(b, clip_edge));
+  VertexRegister vertex;
+  vertex.x_value = (int) lround(a.x_value + t * ((double) b.x_value - a.x_value));
+  vertex.y_value = (int) lround(a.y_value + t * ((double) b.y_value - a.y_value));
+  vertex.z_value = (int) lround(a.z_value + t * ((double) b.z_value - a.z_value));
+  vertex.r_value = (int) lround(a.r_value + t * ((double) b.r_value - a.r_value));
+  vertex.g_value = (int) lround(a.g_value + t * ((double) b.g_value - a.g_value));
+  vertex.b_value = (int) lround(a.b_value + t * ((double) b.b_value - a.b_value));
+  return vertex;
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Queue primitive, a triangle clipped to the guard band if it
+//       reaches outside it
+////////////////////////////////////////////////////////////////////////
+void QueuePrimitive(SimulatorContext &context, const GpuPrimitive &primitive)
+{
+  if (primitive.type != PRIM_TRIANGLE ||
+      (InGuardBand(primitive.vertices[0]) && InGuardBand(primitive.vertices[1]) &&
+       InGuardBand(primitive.vertices[2]))) {
+    context.gpu_primitives.push_back(primitive);
+    return;
+  }
+
+  // Sutherland-Hodgman: each edge adds at most one vertex 
+  VertexRegister polygon[2][7];
+  int count = 3;
+  for (int v = 0; v < 3; v++)
+    polygon[0][v] = primitive.vertices[v];
+  for (int clip_edge = 0; clip_edge < 4; clip_edge++) {
+    const VertexRegister *in = polygon[clip_edge & 1];
+    VertexRegister *out = polygon[(clip_edge & 1) ^ 1];
+    int num_out = 0;
+    for (int i = 0; i < count; i++) {
+      const VertexRegister &p = in[i], &q = in[(i + 1) % count];
+      double distance_p = GuardBandDistance(p, clip_edge), distance_q = GuardBandDistance(q, clip_edge);
+      if (distance_p >= 0)
+        out[num_out++] = p;
+      if ((distance_p >= 0 && distance_q < 0) || (distance_p < 0 && distance_q > 0))
+        out[num_out++] = ClipVertex(p, q, clip_edge);
+    }
+    count = num_out;
+  }
+
+  // four clip edges: the result is back in polygon[0] 
+  GpuPrimitive triangle = primitive;
+  for (int i = 1; i + 1 < count; i++) {
+    triangle.vertices[0] = polygon[0][0];
+    triangle.vertices[1] = polygon[0][i];
+    triangle.vertices[2] = polygon[0][i + 1];
+    context.gpu_primitives.push_back(triangle);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: OP_DRAW: queue the vertex buffer as a list of primitives of
+//       the given type (every 2 vertices a line, every 3 a triangle)
+////////////////////////////////////////////////////////////////////////
+void GpuDraw(SimulatorContext &context, const uint8_t type)
+{
+  GpuTransformVertices(context);
+  const VertexBuffer &buffer = context.gpu_vertex_buffer;
+  size_t num_vertices = (type == PRIM_TRIANGLE) ? 3 : 2;
+  for (size_t first = 0; first + num_vertices <= buffer.x.size(); first += num_vertices) {
+    GpuPrimitive primitive;
+    memset(&primitive, 0x00, sizeof(primitive));
+    primitive.type = type;
+    for (size_t v = 0; v < num_vertices; v++) {
+      VertexRegister &vertex = primitive.vertices[v];
+      vertex.x_value = buffer.x[first + v];
+      vertex.y_value = buffer.y[first + v];
+      vertex.z_value = buffer.z[first + v];
+      vertex.r_value = buffer.r[first + v];
+      vertex.g_value = buffer.g[first + v];
+      vertex.b_value = buffer.b[first + v];
+    }
+    QueuePrimitive(context, primitive);
+  }
+  ClearVertexBuffer(context.gpu_vertex_buffer);
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: OP_FLUSH: rasterize the queued primitives, then resolve the
+//       frame into resolved_framebuffer and start a cleared one
+////////////////////////////////////////////////////////////////////////
+void GpuFlush(SimulatorContext &context)
+{
+  context.framebuffer.resize(FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT, 0);
+
+  if (!context.gpu_primitives.empty()) {
+    if (g_depth_test)
+      ClearDepth(context);
+    BinPrimitives(context);
+
+    RasterJob job;
+    job.context = &context;
+    job.next_tile = 0;
+    SharedRasterPool().Rasterize(&job);
+  }
+
+  context.resolved_framebuffer.swap(context.framebuffer);
+  context.framebuffer.assign(FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT, 0);
+  context.gpu_primitives.clear();
+  context.frame_count++;
+  if (context.frame_sink != NULL)
+    context.frame_sink->Push(context.resolved_framebuffer);
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Run the pipeline side of one graphics op. Called directly, or
+//       on the render thread with --gpu-async; either way it only
+//       touches the vertex pipeline, primitives and framebuffers.
+////////////////////////////////////////////////////////////////////////
+void ExecuteGpuCommand(SimulatorContext &context, const GpuCommand &command)
+{
+  switch (command.opcode) {
+    case OP_SETVERTEX:
+      GpuAppendVertex(context, command.values);
+      break;
+    case OP_ROTATE: case OP_TRANSLATE: case OP_SCALE:
+      GpuQueueTransform(context, command.transform);
+      break;
+    case OP_PUSHMATRIX:
+      GpuPushMatrix(context);
+      break;
+    case OP_POPMATRIX:
+      GpuPopMatrix(context);
+      break;
+    case OP_LOADIDENTITY:
+      GpuLoadIdentity(context);
+      break;
+    case OP_BEGINPRIMITIVE:
+      ClearVertexBuffer(context.gpu_vertex_buffer);
+      break;
+    case OP_ENDPRIMITIVE:
+      GpuTransformVertices(context);
+      break;
+    case OP_DRAW:
+      GpuDraw(context, command.primitive_type);
+      break;
+    case OP_FLUSH:
+      GpuFlush(context);
+      break;
+    default:
+      break;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Execute a graphics opcode: update the architectural state the
+//       CPU sees (GSR, vertex registers) and issue the rest as a
+//       GpuCommand. With a gpu_queue the CPU only waits at FLUSH, and
+//       only until the previous frame is done, so frame N renders
+//       while the CPU works on frame N + 1.
+////////////////////////////////////////////////////////////////////////
+void ExecuteGraphicsOp(SimulatorContext &context, const uint8_t opcode, const TraceOp &trace_op)
+{
+  const VectorRegister &source = context.vector_registers[trace_op.vector_registers[0]];
+  int &status = context.gpu_status_register.int_value;
+  GpuCommand command = GpuCommand();
+  command.opcode = opcode;
+
+  switch (opcode) {
+    case OP_SETVERTEX:
+    {
+      VertexRegister &vertex = context.gpu_vertex_registers[context.vertex_id];
+      vertex.x_value = source.element[1].ToInt();
+      vertex.y_value = source.element[2].ToInt();
+      vertex.z_value = source.element[3].ToInt();
+      context.vertex_id = (context.vertex_id + 1) % NUM_VERTEX_REGISTER;
+      // the buffer keeps the 1.11.4 model coordinates 
+      command.values[0] = source.element[1].raw;
+      command.values[1] = source.element[2].raw;
+      command.values[2] = source.element[3].raw;
+      command.values[3] = vertex.r_value;
+      command.values[4] = vertex.g_value;
+      command.values[5] = vertex.b_value;
+    }
+    break;
+
+    case OP_SETCOLOR:
+    {
+      VertexRegister &vertex = context.gpu_vertex_registers[context.vertex_id];
+      vertex.r_value = source.element[0].ToInt();
+      vertex.g_value = source.element[1].ToInt();
+      vertex.b_value = source.element[2].ToInt();
+    }
+    return;  // nothing for the pipeline until SETVERTEX 
+
+    case OP_ROTATE:  // angle, axis z: see ApplyTransform() 
+      command.transform.opcode = opcode;
+      command.transform.x = source.element[0].ToFloat();
+      command.transform.y = source.element[3].ToFloat();
+      break;
+
+    case OP_TRANSLATE:
+    case OP_SCALE:
+      command.transform.opcode = opcode;
+      command.transform.x = source.element[1].ToFloat();
+      command.transform.y = source.element[2].ToFloat();
+      break;
+
+    case OP_BEGINPRIMITIVE:
+      status &= ~((0x3 << PRIM_TYPE0) | (1 << END_PRIMITIVE_BIT));
+      status |= ((trace_op.primitive_type & 0x3) << PRIM_TYPE0) | (1 << BEGIN_PRIMITIVE_BIT);
+      context.vertex_id = 0;
+      break;
+
+    case OP_ENDPRIMITIVE:
+      status &= ~(1 << BEGIN_PRIMITIVE_BIT);
+      status |= 1 << END_PRIMITIVE_BIT;
+      break;
+
+    case OP_DRAW:
+      command.primitive_type = (status >> PRIM_TYPE0) & 0x3;
+      status |= 1 << DRAW_BIT;
+      break;
+
+    case OP_FLUSH:
+      status &= ~(1 << DRAW_BIT);
+      status |= 1 << FLUSH_BIT;
+      break;
+
+    default:
+      break;
+  }
+
+  if (context.gpu_queue == NULL) {
+    ExecuteGpuCommand(context, command);
+    return;
+  }
+  context.gpu_queue->Push(command);
+  if (opcode == OP_FLUSH)
+    context.gpu_queue->WaitForFlushes(1);
+}
+
+////////////////////////////////////////////////////////////////////////
+// GPU command queue (--gpu-async)
+// The CPU thread pushes GpuCommands into a single-producer/single-
+// consumer ring; the render thread executes them in order and counts
+// the FLUSHes it has finished.
+////////////////////////////////////////////////////////////////////////
+GpuCommandQueue::GpuCommandQueue()
+  : ring_(GPU_QUEUE_SIZE), head_(0), tail_(0), flushes_done_(0), done_(false),
+    flushes_pushed_(0), context_(NULL)
+{
+}
+
+GpuCommandQueue::~GpuCommandQueue()
+{
+  Finish();
+}
+
+void GpuCommandQueue::Start(SimulatorContext *context)
+{
+  context_ = context;
+  done_.store(false);
+  render_thread_ = thread(&GpuCommandQueue::Run, this);
+}
+
+void GpuCommandQueue::Finish()
+{
+  if (context_ == NULL)
+    return;
+  done_.store(true, memory_order_release);
+  render_thread_.join();
+  context_ = NULL;
+}
+
+void GpuCommandQueue::WaitForFlushes(const unsigned int max_outstanding)
+{
+  while (flushes_pushed_ - flushes_done_.load(memory_order_acquire) > max_outstanding)
+    this_thread::yield();
+}
+
+void GpuCommandQueue::Run()
+{
+  int idle_polls = 0;
+  for (;;) {
+    size_t tail = tail_.load(memory_order_relaxed);
+    if (head_.load(memory_order_acquire) == tail) {
+      if (done_.load(memory_order_acquire) && head_.load(memory_order_acquire) == tail)
+        break;
+      // stay responsive while the CPU is issuing, back off when it is not 
+      if (++idle_polls < 64)
+        this_thread::yield();
+      else
+        this_thread::sleep_for(chrono::microseconds(50));
+      continue;
+    }
+    idle_polls = 0;
+    const GpuCommand &command = ring_[tail & (GPU_QUEUE_SIZE - 1)];
+    ExecuteGpuCommand(*context_, command);
+    if (command.opcode == OP_FLUSH)
+      flushes_done_.fetch_add(1, memory_order_release);
+    tail_.store(tail + 1, memory_order_release);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////
+// Frame output (--ppm-frames, --y4m)
+// GpuFlush pushes each resolved frame into one of FRAME_SINK_SLOTS
+// preallocated slots; a writer thread encodes and writes them in order.
+////////////////////////////////////////////////////////////////////////
+FrameSink::FrameSink()
+  : head_(0), tail_(0), done_(false), format_(FRAME_PPM), file_(NULL), open_(false)
+{
+}
+
+FrameSink::~FrameSink()
+{
+  Close();
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: True if pattern has exactly one integer conversion (%u, %05d,
+//       ...) and nothing else snprintf would read an argument for
+////////////////////////////////////////////////////////////////////////
+bool IsFramePattern(const char *pattern)
+{
+  int conversions = 0;
+  for (const char *c = pattern; *c != '\0'; c++) {
+    if (*c != '%')
+      continue;
+    c++;
+    if (*c == '%')
+      continue;
+    while (*c >= '0' && *c <= '9')
+      c++;
+    if (*c != 'u' && *c != 'd')
+      return false;
+    conversions++;
+  }
+  return conversions == 1;
+}
+
+bool FrameSink::Open(const char *path, const FrameFormat format)
+{
+  path_ = path;
+  format_ = format;
+  if (format_ == FRAME_PPM) {
+    if (!IsFramePattern(path)) {
+      cerr << "Error: Frame pattern " << path << " needs one frame number such as %04u" << endl;
+      return false;
+    }
+  } else {
+    file_ = strcmp(path, "-") == 0 ? stdout : fopen(path, "wb");
+    if (file_ == NULL) {
+      cerr << "Error: Failed to open frame stream " << path << endl;
+      return false;
+    }
+    fprintf(file_, "YUV4MPEG2 W%d H%d F30:1 Ip A1:1 C444\n", FRAMEBUFFER_WIDTH, FRAMEBUFFER_HEIGHT);
+  }
+
+  for (int i = 0; i < FRAME_SINK_SLOTS; i++)
+    slots_[i].resize(FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT);
+  encoded_.resize(FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT * 3);
+  head_.store(0);
+  tail_.store(0);
+  done_.store(false);
+  open_ = true;
+  writer_ = thread(&FrameSink::Drain, this);
+  return true;
+}
+
+void FrameSink::Close()
+{
+  if (!open_)
+    return;
+  done_.store(true, memory_order_release);
+  writer_.join();
+  if (file_ != NULL && file_ != stdout)
+    fclose(file_);
+  else if (file_ == stdout)
+    fflush(stdout);
+  file_ = NULL;
+  open_ = false;
+}
+
+void FrameSink::Push(const vector<uint32_t> &frame)
+{
+  size_t head = head_.load(memory_order_relaxed);
+  while (head - tail_.load(memory_order_acquire) >= FRAME_SINK_SLOTS)
+    this_thread::yield();
+  memcpy(&slots_[head % FRAME_SINK_SLOTS][0], &frame[0], slots_[0].size() * sizeof(uint32_t));
+  head_.store(head + 1, memory_order_release);
+}
+
+void FrameSink::Drain()
+{
+  bool failed = false;
+  for (;;) {
+    size_t tail = tail_.load(memory_order_relaxed);
+    if (head_.load(memory_order_acquire) == tail) {
+      if (done_.load(memory_order_acquire) && head_.load(memory_order_acquire) == tail)
+        break;
+      this_thread::sleep_for(chrono::microseconds(100));
+      continue;
+    }
+    // keep draining after a failure so Push() never blocks forever 
+    if (!failed && !WriteFrame(&slots_[tail % FRAME_SINK_SLOTS][0], (unsigned int) tail)) {
+      cerr << "Error: Failed to write frame " << tail << endl;
+      failed = true;
+    }
+    tail_.store(tail + 1, memory_order_release);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Encode one 0x00RRGGBB frame and write it out
+// input: pixels, frame_number (0 for the first FLUSH)
+// output: false on an I/O error
+////////////////////////////////////////////////////////////////////////
+bool FrameSink::WriteFrame(const uint32_t *pixels, const unsigned int frame_number)
+{
+  const size_t num_pixels = FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT;
+  unsigned char *out = &encoded_[0];
+
+  if (format_ == FRAME_PPM) {
+    for (size_t i = 0; i < num_pixels; i++) {
+      out[3 * i + 0] = (pixels[i] >> 16) & 0xFF;
+      out[3 * i + 1] = (pixels[i] >> 8) & 0xFF;
+      out[3 * i + 2] = pixels[i] & 0xFF;
+    }
+    char file_name[4096];
+    snprintf(file_name, sizeof(file_name), path_.c_str(), frame_number);
+    FILE *file = fopen(file_name, "wb");
+    if (file == NULL)
+      return false;
+    fprintf(file, "P6\n%d %d\n255\n", FRAMEBUFFER_WIDTH, FRAMEBUFFER_HEIGHT);
+    bool ok = fwrite(out, 1, num_pixels * 3, file) == num_pixels * 3;
+    return fclose(file) == 0 && ok;
+  }
+
+  // full-range BT.601, planar Y, Cb, Cr 
+  for (size_t i = 0; i < num_pixels; i++) {
+    int r = (pixels[i] >> 16) & 0xFF;
+    int g = (pixels[i] >> 8) & 0xFF;
+    int b = pixels[i] & 0xFF;
+    out[i] = (77 * r + 150 * g + 29 * b + 128) >> 8;
+    out[num_pixels + i] = min(255, ((-43 * r - 85 * g + 128 * b + 128) >> 8) + 128);
+    out[2 * num_pixels + i] = min(255, ((128 * r - 107 * g - 21 * b + 128) >> 8) + 128);
+  }
+  fputs("FRAME\n", file_);
+  return fwrite(out, 1, num_pixels * 3, file_) == num_pixels * 3;
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Execute the behavior of the instruction (Simulate)
+//       opcode is passed separately so that callers which know it at
+//       compile time (threaded handlers) get the switch folded away
+// input: opcode and instruction to execute 
+// output: Non-branch operation ? -1 : OTHER (PC-relative or absolute address)
+////////////////////////////////////////////////////////////////////////
+static ALWAYS_INLINE int ExecuteOp(SimulatorContext &context, const uint8_t opcode, const TraceOp &trace_op) 
+{
+  int ret_next_instruction_idx = -1;
+
+  switch (opcode) {
+    case OP_ADD_D: 
+    {
+      int source_value_1 = context.scalar_registers[trace_op.scalar_registers[1]].int_value;
+      int source_value_2 = context.scalar_registers[trace_op.scalar_registers[2]].int_value;
+      context.scalar_registers[trace_op.scalar_registers[0]].int_value = 
+        source_value_1 + source_value_2;
+      SetConditionCodeInt(context, context.scalar_registers[trace_op.scalar_registers[0]].int_value, 0);
+    }
+    break;
+
+    /* fill out instruction behaviors */ 
+
+    case OP_ADD_F:
+    {
+      Fixed1114 source_value_1 = FixedRegister(context.scalar_registers[trace_op.scalar_registers[1]]);
+      Fixed1114 source_value_2 = FixedRegister(context.scalar_registers[trace_op.scalar_registers[2]]);
+      Fixed1114 result = source_value_1 + source_value_2;
+      SetFixedRegister(context.scalar_registers[trace_op.scalar_registers[0]], result);
+      SetConditionCodeFixed(context, result, Fixed1114::FromRaw(0));
+    }
+    break;
+ 
+    case OP_ADDI_D:
+    {
+      int source_value_1 = context.scalar_registers[trace_op.scalar_registers[1]].int_value;
+      int source_value_2 = trace_op.int_value;
+      context.scalar_registers[trace_op.scalar_registers[0]].int_value = 
+        source_value_1 + source_value_2;
+      SetConditionCodeInt(context, context.scalar_registers[trace_op.scalar_registers[0]].int_value, 0);
+    }
+    break;
+
+    case OP_ADDI_F:
+    {
+      Fixed1114 source_value_1 = FixedRegister(context.scalar_registers[trace_op.scalar_registers[1]]);
+      Fixed1114 source_value_2 = trace_op.fixed_value;
+      Fixed1114 result = source_value_1 + source_value_2;
+      SetFixedRegister(context.scalar_registers[trace_op.scalar_registers[0]], result);
+      SetConditionCodeFixed(context, result, Fixed1114::FromRaw(0));
+    }
+    break;
+
+    case OP_VADD:
+      VectorAdd(context.vector_registers[trace_op.vector_registers[0]],
+                context.vector_registers[trace_op.vector_registers[1]],
+                context.vector_registers[trace_op.vector_registers[2]]);
+      break;
+
+    case OP_AND_D:
+    {
+      int source_value_1 = context.scalar_registers[trace_op.scalar_registers[1]].int_value;
+      int source_value_2 = context.scalar_registers[trace_op.scalar_registers[2]].int_value;
+      context.scalar_registers[trace_op.scalar_registers[0]].int_value = 
+        source_value_1 & source_value_2;
+      SetConditionCodeInt(context, context.scalar_registers[trace_op.scalar_registers[0]].int_value, 0);
+    }
+    break;
+
+    case OP_ANDI_D:
+    {
+      int source_value_1 = context.scalar_registers[trace_op.scalar_registers[1]].int_value;
+      int source_value_2 = trace_op.int_value;
+      context.scalar_registers[trace_op.scalar_registers[0]].int_value = 
+        source_value_1 & source_value_2;
+      SetConditionCodeInt(context, context.scalar_registers[trace_op.scalar_registers[0]].int_value, 0);
+    }
+    break;
+
+    case OP_MOV:
+     {
+      if (trace_op.scalar_registers[0] < 7) {
+        context.scalar_registers[trace_op.scalar_registers[0]].int_value =
+          context.scalar_registers[trace_op.scalar_registers[1]].int_value;
+        SetConditionCodeInt(context, context.scalar_registers[trace_op.scalar_registers[0]].int_value, 0);
+      } else if (trace_op.scalar_registers[0] > 7) {
+        Fixed1114 value = FixedRegister(context.scalar_registers[trace_op.scalar_registers[1]]);
+        SetFixedRegister(context.scalar_registers[trace_op.scalar_registers[0]], value);
+        SetConditionCodeFixed(context, value, Fixed1114::FromRaw(0));
+      }
+    }
+    break;
+
+    case OP_MOVI_D:
+    {
+      context.scalar_registers[trace_op.scalar_registers[0]].int_value = trace_op.int_value;
+      SetConditionCodeInt(context, context.scalar_registers[trace_op.scalar_registers[0]].int_value, 0);
+    }
+    break;
+
+    case OP_MOVI_F:
+    {
+      SetFixedRegister(context.scalar_registers[trace_op.scalar_registers[0]], trace_op.fixed_value);
+      SetConditionCodeFixed(context, trace_op.fixed_value, Fixed1114::FromRaw(0));
+    }
+    break;
+
+    case OP_VMOV:
+      context.vector_registers[trace_op.vector_registers[0]] =
+        context.vector_registers[trace_op.vector_registers[1]];
+      break;
+  
+    case OP_VMOVI:
+      VectorBroadcast(context.vector_registers[trace_op.vector_registers[0]], trace_op.fixed_value);
+      break;
+ 
+    case OP_CMP:
+    {
+      if (trace_op.scalar_registers[0] < 7)
+        SetConditionCodeInt(context, 
+          context.scalar_registers[trace_op.scalar_registers[0]].int_value,
+          context.scalar_registers[trace_op.scalar_registers[1]].int_value);
+      else if (trace_op.scalar_registers[0] > 7)
+        SetConditionCodeFixed(context, 
+          FixedRegister(context.scalar_registers[trace_op.scalar_registers[0]]),
+          FixedRegister(context.scalar_registers[trace_op.scalar_registers[1]]));
+ 
+    }
+    break;
+
+    case OP_CMPI:
+    {
+      if (trace_op.scalar_registers[0] < 7)
+        SetConditionCodeInt(context, 
+          context.scalar_registers[trace_op.scalar_registers[0]].int_value,
+          trace_op.int_value);
+      else if (trace_op.scalar_registers[0] > 7)
+        SetConditionCodeFixed(context, 
+          FixedRegister(context.scalar_registers[trace_op.scalar_registers[0]]),
+          trace_op.fixed_value);
+ 
+    }
+    break;
+
+    case OP_VCOMPMOV:
+    {
+      int idx = trace_op.idx;
+      context.vector_registers[trace_op.vector_registers[0]].element[idx] =
+        FixedRegister(context.scalar_registers[trace_op.scalar_registers[0]]);
+    }
+    break; 
+
+    case OP_VCOMPMOVI:
+    {
+      int idx = trace_op.idx;
+      context.vector_registers[trace_op.vector_registers[0]].element[idx] = trace_op.fixed_value;
+    }
+    break;
+  
+    case OP_LDB: 
+    {
+      uint8_t value = context.memory.Load8(context.scalar_registers[trace_op.scalar_registers[1]].int_value,
+                                           trace_op.int_value);
+      memcpy(&context.scalar_registers[trace_op.scalar_registers[0]], &value, sizeof(int8_t));
+    }
+    break;
+
+    case OP_LDW:
+    {
+      uint16_t value = context.memory.Load16(context.scalar_registers[trace_op.scalar_registers[1]].int_value,
+                                             trace_op.int_value);
+      memcpy(&context.scalar_registers[trace_op.scalar_registers[0]], &value, sizeof(int16_t));
+    }
+    break;
+
+    case OP_STB:
+    {
+      context.memory.Store8(context.scalar_registers[trace_op.scalar_registers[1]].int_value, trace_op.int_value,
+                            context.scalar_registers[trace_op.scalar_registers[0]].int_value);
+    }
+    break;
+
+ 
+    case OP_STW:
+    {
+      context.memory.Store16(context.scalar_registers[trace_op.scalar_registers[1]].int_value, trace_op.int_value,
+                             context.scalar_registers[trace_op.scalar_registers[0]].int_value);
+    }
+    break;
+
+
+    case OP_SETVERTEX:
+    case OP_SETCOLOR:
+    case OP_ROTATE:
+    case OP_TRANSLATE:
+    case OP_SCALE:
+    case OP_PUSHMATRIX:
+    case OP_POPMATRIX:
+    case OP_BEGINPRIMITIVE:
+    case OP_ENDPRIMITIVE:
+    case OP_LOADIDENTITY:
+    case OP_FLUSH:
+    case OP_DRAW:
+      ExecuteGraphicsOp(context, opcode, trace_op);
+      break;
+
+    case OP_BRN:
+    {
+      if (ConditionCode(context) == 0x01)
+      ret_next_instruction_idx = trace_op.int_value;
+    }
+    break;
+ 
+    case OP_BRZ:
+    {
+      if (ConditionCode(context) == 0x02)
+      ret_next_instruction_idx = trace_op.int_value;
+    }
+    break;
+ 
+    case OP_BRP:
+    {
+      if (ConditionCode(context) == 0x04)
+      ret_next_instruction_idx = trace_op.int_value;
+    }
+    break;
+ 
+    case OP_BRNZ:
+    {
+      if (ConditionCode(context) == 0x03)
+      ret_next_instruction_idx = trace_op.int_value;
+    }
+    break;
+ 
+    case OP_BRNP:
+    {
+      if (ConditionCode(context) == 0x05)
+      ret_next_instruction_idx = trace_op.int_value;
+    }
+    break;
+ 
+    case OP_BRZP:
+    {
+      if (ConditionCode(context) == 0x06)
+      ret_next_instruction_idx = trace_op.int_value;
+    }
+    break;
+ 
+    case OP_BRNZP:
+    {
+      if (ConditionCode(context) == 0x07)
+      ret_next_instruction_idx = trace_op.int_value;
+    }
+    break;
+ 
+    case OP_JMP:
+    {
+      if (context.scalar_registers[trace_op.scalar_registers[0]].int_value == 0x07)
+        ret_next_instruction_idx = context.scalar_registers[LR_IDX].int_value;
+      else
+        ret_next_instruction_idx = context.scalar_registers[trace_op.scalar_registers[0]].int_value;
+    }
+    break;
+
+    case OP_JSR:
+    {
+      ret_next_instruction_idx = trace_op.int_value;
+    }
+    break;
+ 
+    case OP_JSRR:
+    {
+      ret_next_instruction_idx = context.scalar_registers[trace_op.scalar_registers[0]].int_value;
+    } 
+    break; 
+      
+    case OP_HALT: 
+      context.program_halt = 1; 
+      break; 
+
+    default:
+    break;
+    }
+
+  return ret_next_instruction_idx;
+}
+
+int ExecuteInstruction(SimulatorContext &context, const TraceOp &trace_op) 
+{
+  return ExecuteOp(context, trace_op.opcode, trace_op);
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Update PC (and LR for JSR/JSRR) after an instruction executed
+// input: opcode of the executed instruction, return value of ExecuteOp
+////////////////////////////////////////////////////////////////////////
+static ALWAYS_INLINE void AdvanceProgramCounter(SimulatorContext &context, const uint8_t opcode, const int idx)
+{
+  context.current_pc = context.scalar_registers[PC_IDX].int_value; // debugging purpose only 
+  if (opcode == OP_JSR || opcode == OP_JSRR)
+    context.scalar_registers[LR_IDX].int_value = (context.scalar_registers[PC_IDX].int_value + 1) << 2 ;
+
+  context.scalar_registers[PC_IDX].int_value += 1; 
+  if (idx != -1) { // Branch
+    if (opcode == OP_JMP || opcode == OP_JSRR) // Absolute addressing
+      context.scalar_registers[PC_IDX].int_value = idx; 
+    else // PC-relative addressing (OP_JSR || OP_BRXXX)
+      context.scalar_registers[PC_IDX].int_value += idx; 
+  }
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Dump given trace_op
+////////////////////////////////////////////////////////////////////////
+void PrintTraceOp(SimulatorContext &context, const TraceOp &trace_op) 
+{  
+  ostream &out = *context.trace_out;
+  out << "  opcode: " << SignExtension(trace_op.opcode);
+  out << ", scalar_register[0]: " << (int) trace_op.scalar_registers[0];
+  out << ", scalar_register[1]: " << (int) trace_op.scalar_registers[1];
+  out << ", scalar_register[2]: " << (int) trace_op.scalar_registers[2];
+  out << ", vector_register[0]: " << (int) trace_op.vector_registers[0];
+  out << ", vector_register[1]: " << (int) trace_op.vector_registers[1];
+  out << ", idx: " << (int) trace_op.idx;
+  out << ", primitive_index: " << (int) trace_op.primitive_type;
+  out << ", int_value: " << (int) SignExtension(trace_op.int_value) << endl; 
+  //c  out << ", float_value: " << (float) trace_op.float_value << endl;
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Print the register contents of context after an instruction
+//       with opcode current_opcode; next_opcode is the instruction at PC
+////////////////////////////////////////////////////////////////////////
+void PrintContextState(SimulatorContext &context, const uint8_t current_opcode,
+                       const uint8_t next_opcode)
+{
+  ostream &out = *context.trace_out;
+
+  out << "--------------------------------------------------" << endl;
+  out << "3220X-Instruction Count: " << context.instruction_count
+       << " C_PC: " << (context.current_pc *4)
+       << " C_PC_IND: " << context.current_pc 
+       << ", Curr_Opcode: " << (int) current_opcode
+       << " NEXT_PC: " << ((context.scalar_registers[PC_IDX].int_value)<<2) 
+       << " NEXT_PC_IND: " << (context.scalar_registers[PC_IDX].int_value)
+       << ", Next_Opcode: " << (int) next_opcode 
+       << endl;
+  out <<"3220X-"; 
+  for (int srIdx = 0; srIdx < NUM_SCALAR_REGISTER; srIdx++) {
+    out << "R" << srIdx << ":" 
+         << ((srIdx < 8 || srIdx == 15) ? SignExtension(context.scalar_registers[srIdx].int_value) : FixedRegister(context.scalar_registers[srIdx]).ToFloat()) 
+         << (srIdx == NUM_SCALAR_REGISTER-1 ? "" : ", ");
+  }
+
+  int condition_code = ConditionCode(context);
+  out << " CC :N: " << ((condition_code &0x4) >>2) << " Z: " 
+       << ((condition_code &0x2) >>1) << " P: " << (condition_code &0x1) << "  "; 
+  out << " draw: " << (context.gpu_status_register.int_value &0x01) << " fush: " << ((context.gpu_status_register.int_value & 0x2)>>1) ;
+  out << " prim_type: "<< ((context.gpu_status_register.int_value & 0x4) >> 2)  << " "; 
+   
+  out << endl;
+  
+  // for (int vrIdx = 0; vrIdx < NUM_VECTOR_REGISTER; vrIdx++) {
+  
+  for (int vrIdx = 0; vrIdx < 6; vrIdx++) {
+    out <<"3220X-"; 
+    out << "V" << vrIdx << ":";
+    for (int elmtIdx = 0; elmtIdx < NUM_VECTOR_ELEMENTS; elmtIdx++) { 
+      out << "Element[" << elmtIdx << "] = " 
+           << context.vector_registers[vrIdx].element[elmtIdx].ToFloat() 
+           << (elmtIdx == NUM_VECTOR_ELEMENTS-1 ? "" : ",");
+    }
+    out << endl;
+  }
+  out << endl;
+  out <<"3220X-"; 
+  out <<" vertices P1_X: " << context.gpu_vertex_registers[0].x_value; 
+  out <<" vertices P1_Y: " << context.gpu_vertex_registers[0].y_value; 
+  out <<" r: " << context.gpu_vertex_registers[0].r_value; 
+  out <<" g: " << context.gpu_vertex_registers[0].g_value; 
+  out <<" b: " << context.gpu_vertex_registers[0].b_value; 
+  out <<" P2_X: " << context.gpu_vertex_registers[1].x_value; 
+  out <<" P2_Y: " << context.gpu_vertex_registers[1].y_value; 
+  out <<" r: " << context.gpu_vertex_registers[1].r_value; 
+  out <<" g: " << context.gpu_vertex_registers[1].g_value; 
+  out <<" b: " << context.gpu_vertex_registers[1].b_value; 
+  out <<" P3_X: " << context.gpu_vertex_registers[2].x_value; 
+  out <<" P3_Y: " << context.gpu_vertex_registers[2].y_value; 
+  out <<" r: " << context.gpu_vertex_registers[2].r_value; 
+  out <<" g: " << context.gpu_vertex_registers[2].g_value; 
+  out <<" b: " << context.gpu_vertex_registers[2].b_value << endl; 
+  
+  out << "--------------------------------------------------" << endl;
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Opcode of the instruction at PC, or 0 once PC has left the
+//       program (a HALT as its last instruction, or a jump past it)
+////////////////////////////////////////////////////////////////////////
+static uint8_t NextOpcode(const SimulatorContext &context)
+{
+  unsigned int next_pc = context.scalar_registers[PC_IDX].int_value;
+  return next_pc < context.num_trace_ops ? context.trace_ops[next_pc].opcode : 0;
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: This function is called every trace is executed
+//       to provide the contents of all the registers
+////////////////////////////////////////////////////////////////////////
+void PrintContext(SimulatorContext &context, const TraceOp &current_op)
+{
+  PrintContextState(context, current_op.opcode, NextOpcode(context));
+}
+
+////////////////////////////////////////////////////////////////////////
+// Delta trace (--trace-delta N)
+// One line per traced instruction:
+//   3220X-D <count> <pc> <opcode> <next_pc> <next_opcode> [fields]
+// (next_opcode is 0 when next_pc is past the end of the program)
+// where fields are the raw values that changed since the previous line:
+//   R<n>=v  CC=v  GSR=v  V<n>=e0,e1,e2,e3  P<n>=x,y,z,r,g,b  M<addr>=byte
+// M fields cover every store since the previous line, including stores
+// by instructions that --trace-ops/--trace-pc and friends filtered out.
+// Every N traced instructions a "3220X-K" keyframe lists all register
+// fields instead. --expand-trace replays the stream into the full
+// PrintContext format.
+////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////
+// desc: Remember the bytes an executed STB/STW wrote for the next delta
+//       trace line. A PC base register held current_pc during the store.
+////////////////////////////////////////////////////////////////////////
+void NoteDeltaStore(SimulatorContext &context, const TraceOp &current_op)
+{
+  if (current_op.opcode != OP_STB && current_op.opcode != OP_STW)
+    return;
+  int base_idx = current_op.scalar_registers[1];
+  int address = EffectiveAddress(base_idx == PC_IDX ? (int) context.current_pc :
+                                 context.scalar_registers[base_idx].int_value, current_op.int_value);
+  vector<int> &stored = context.trace_delta.stored_addresses;
+  stored.push_back(address);
+  if (current_op.opcode == OP_STW)
+    stored.push_back(EffectiveAddress(address, 1));
+  if (stored.size() >= context.trace_delta.stored_compact_at) {
+    // a long filtered-out stretch: keep one entry per address 
+    sort(stored.begin(), stored.end());
+    stored.erase(unique(stored.begin(), stored.end()), stored.end());
+    context.trace_delta.stored_compact_at = max((size_t) 4096, 2 * stored.size());
+  }
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Write the delta trace line for current_op
+////////////////////////////////////////////////////////////////////////
+void PrintContextDelta(SimulatorContext &context, const TraceOp &current_op)
+{
+  ostream &out = *context.trace_out;
+  TraceDeltaState &last = context.trace_delta;
+  bool keyframe = !last.valid || last.traced_since_keyframe >= g_trace_control.delta_keyframe_interval;
+  if (keyframe)
+    last.traced_since_keyframe = 0;
+  last.traced_since_keyframe++;
+  last.valid = true;
+
+  int next_pc = context.scalar_registers[PC_IDX].int_value;
+  out << (keyframe ? "3220X-K " : "3220X-D ") << context.instruction_count
+      << ' ' << context.current_pc << ' ' << (int) current_op.opcode
+      << ' ' << next_pc << ' ' << (int) NextOpcode(context);
+
+  for (int i = 0; i < NUM_SCALAR_REGISTER; i++) {
+    if (keyframe || context.scalar_registers[i].int_value != last.scalar_registers[i].int_value) {
+      out << " R" << i << '=' << context.scalar_registers[i].int_value;
+      last.scalar_registers[i] = context.scalar_registers[i];
+    }
+  }
+  int condition_code = ConditionCode(context);
+  if (keyframe || condition_code != last.condition_code_register.int_value) {
+    out << " CC=" << condition_code;
+    last.condition_code_register.int_value = condition_code;
+  }
+  if (keyframe || context.gpu_status_register.int_value != last.gpu_status_register.int_value) {
+    out << " GSR=" << context.gpu_status_register.int_value;
+    last.gpu_status_register = context.gpu_status_register;
+  }
+  for (int i = 0; i < NUM_VECTOR_REGISTER; i++) {
+    const VectorRegister &vector = context.vector_registers[i];
+    if (keyframe || memcmp(&vector, &last.vector_registers[i], sizeof(VectorRegister)) != 0) {
+      out << " V" << i << '=';
+      for (int e = 0; e < NUM_VECTOR_ELEMENTS; e++)
+        out << (e == 0 ? "" : ",") << vector.element[e].raw;
+      last.vector_registers[i] = vector;
+    }
+  }
+  for (int i = 0; i < NUM_VERTEX_REGISTER; i++) {
+    const VertexRegister &vertex = context.gpu_vertex_registers[i];
+    if (keyframe || memcmp(&vertex, &last.gpu_vertex_registers[i], sizeof(VertexRegister)) != 0) {
+      out << " P" << i << '=' << vertex.x_value << ',' << vertex.y_value << ',' << vertex.z_value
+          << ',' << vertex.r_value << ',' << vertex.g_value << ',' << vertex.b_value;
+      last.gpu_vertex_registers[i] = vertex;
+    }
+  }
+
+  // memory is not part of the register dump: report the bytes stored
+  // since the previous line, each once with its current value 
+  NoteDeltaStore(context, current_op);
+  vector<int> &stored = last.stored_addresses;
+  sort(stored.begin(), stored.end());
+  stored.erase(unique(stored.begin(), stored.end()), stored.end());
+  for (size_t i = 0; i < stored.size(); i++)
+    out << " M" << stored[i] << '=' << (int) context.memory.Load8(stored[i], 0);
+  stored.clear();
+  out << '\n';
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Apply one "name[index]=v,v,..." field of a delta trace line
+// output: false if the field is malformed or out of range
+////////////////////////////////////////////////////////////////////////
+bool ApplyDeltaField(SimulatorContext &context, const char *&p)
+{
+  const char *name = p;
+  while (*p >= 'A' && *p <= 'Z')
+    p++;
+  string field(name, p - name);
+  char *end;
+  long index = (*p != '=') ? strtol(p, &end, 10) : 0;
+  if (*p != '=')
+    p = end;
+  if (*p != '=')
+    return false;
+  p++;
+
+  int values[6];
+  int num_values = 0;
+  for (;;) {
+    values[num_values++] = strtol(p, &end, 10);
+    if (end == p)
+      return false;
+    p = end;
+    if (*p != ',' || num_values == 6)
+      break;
+    p++;
+  }
+
+  if (field == "R" && num_values == 1 && index >= 0 && index < NUM_SCALAR_REGISTER)
+    context.scalar_registers[index].int_value = values[0];
+  else if (field == "CC" && num_values == 1)
+    context.condition_code_register.int_value = values[0];
+  else if (field == "GSR" && num_values == 1)
+    context.gpu_status_register.int_value = values[0];
+  else if (field == "V" && num_values == NUM_VECTOR_ELEMENTS && index >= 0 && index < NUM_VECTOR_REGISTER)
+    for (int e = 0; e < NUM_VECTOR_ELEMENTS; e++)
+      context.vector_registers[index].element[e] = Fixed1114::FromRaw(values[e]);
+  else if (field == "P" && num_values == 6 && index >= 0 && index < NUM_VERTEX_REGISTER) {
+    VertexRegister &vertex = context.gpu_vertex_registers[index];
+    vertex.x_value = values[0];
+    vertex.y_value = values[1];
+    vertex.z_value = values[2];
+    vertex.r_value = values[3];
+    vertex.g_value = values[4];
+    vertex.b_value = values[5];
+  } else if (field == "M" && num_values == 1 && index >= 0 && (size_t) index < context.memory.size())
+    context.memory.Store8(index, 0, values[0]);
+  else
+    return false;
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Replay a --trace-delta text trace and print the full
+//       PrintContext format. Non-delta lines are copied through.
+////////////////////////////////////////////////////////////////////////
+bool ExpandTrace(const char *path)
+{
+  ifstream infile(path);
+  if (!infile) {
+    cerr << "Error: Failed to open trace file " << path << endl;
+    return false;
+  }
+
+  SimulatorContext *context = new SimulatorContext();
+  context->trace_out = &cout;
+  string line;
+  size_t line_number = 0;
+  bool ok = true;
+  while (ok && getline(infile, line)) {
+    line_number++;
+    if (line.compare(0, 8, "3220X-D ") != 0 && line.compare(0, 8, "3220X-K ") != 0) {
+      cout << line << '\n';
+      continue;
+    }
+
+    const char *p = line.c_str() + 8;
+    char *end;
+    context->instruction_count = strtoul(p, &end, 10);
+    context->current_pc = strtoul(end, &end, 10);
+    uint8_t opcode = strtol(end, &end, 10);
+    context->scalar_registers[PC_IDX].int_value = strtol(end, &end, 10);
+    uint8_t next_opcode = strtol(end, &end, 10);
+    p = end;
+    while (ok && *p == ' ') {
+      p++;
+      ok = ApplyDeltaField(*context, p);
+    }
+    if (!ok || *p != '\0') {
+      cerr << "Error: " << path << ":" << line_number << ": malformed delta trace line" << endl;
+      ok = false;
+      break;
+    }
+    PrintContextState(*context, opcode, next_opcode);
+  }
+
+  delete context;
+  return ok;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Binary trace sink (--binary-trace)
+// The executing thread appends fixed-size TraceRecords to a
+// single-producer/single-consumer ring; a writer thread drains the ring
+// to the trace file. --render-trace turns the file back into the
+// --trace "3220X-" text.
+////////////////////////////////////////////////////////////////////////
+TraceSink::TraceSink()
+  : ring_(TRACE_RING_SIZE), head_(0), tail_(0), done_(false), file_(NULL)
+{
+}
+
+TraceSink::~TraceSink()
+{
+  Close();
+}
+
+bool TraceSink::Open(const char *path)
+{
+  file_ = fopen(path, "wb");
+  if (file_ == NULL) {
+    cerr << "Error: Failed to open trace file " << path << endl;
+    return false;
+  }
+  TraceFileHeader header;
+  memset(&header, 0x00, sizeof(header));
+  header.magic = TRACE_MAGIC;
+  header.version = TRACE_VERSION;
+  header.record_size = sizeof(TraceRecord);
+  fwrite(&header, sizeof(header), 1, file_);
+
+  done_.store(false);
+  writer_ = thread(&TraceSink::Drain, this);
+  return true;
+}
+
+void TraceSink::Close()
+{
+  if (file_ == NULL)
+    return;
+  done_.store(true, memory_order_release);
+  writer_.join();
+  fclose(file_);
+  file_ = NULL;
+}
+
+void TraceSink::Drain()
+{
+  for (;;) {
+    size_t tail = tail_.load(memory_order_relaxed);
+    size_t head = head_.load(memory_order_acquire);
+    if (head == tail) {
+      if (done_.load(memory_order_acquire) && head_.load(memory_order_acquire) == tail)
+        break;
+      this_thread::sleep_for(chrono::microseconds(100));
+      continue;
+    }
+    // write the contiguous part of [tail, head) 
+    size_t first = tail & (TRACE_RING_SIZE - 1);
+    size_t count = min(head - tail, (size_t) TRACE_RING_SIZE - first);
+    fwrite(&ring_[first], sizeof(TraceRecord), count, file_);
+    tail_.store(tail + count, memory_order_release);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Record the effects of current_op, which has just executed
+////////////////////////////////////////////////////////////////////////
+void RecordTrace(SimulatorContext &context, const TraceOp &current_op)
+{
+  TraceRecord record;
+  record.instruction_count = context.instruction_count;
+  record.pc = context.current_pc;
+  record.next_pc = context.scalar_registers[PC_IDX].int_value;
+  record.opcode = current_op.opcode;
+  record.next_opcode = NextOpcode(context);
+  record.condition_code = ConditionCode(context);
+  record.gpu_status = context.gpu_status_register.int_value;
+  record.scalar_idx = TRACE_NONE;
+  record.scalar_value = 0;
+  record.link_value = context.scalar_registers[LR_IDX].int_value;
+  record.vector_idx = TRACE_NONE;
+  record.vertex_idx = TRACE_NONE;
+  memset(record.values, 0x00, sizeof(record.values));
+
+  switch (current_op.opcode) {
+    case OP_ADD_D: case OP_ADD_F: case OP_ADDI_D: case OP_ADDI_F:
+    case OP_AND_D: case OP_ANDI_D: case OP_MOV: case OP_MOVI_D:
+    case OP_MOVI_F: case OP_LDB: case OP_LDW:
+      record.scalar_idx = current_op.scalar_registers[0];
+      record.scalar_value = context.scalar_registers[record.scalar_idx].int_value;
+      break;
+
+    case OP_VADD: case OP_VMOV: case OP_VMOVI:
+    case OP_VCOMPMOV: case OP_VCOMPMOVI:
+      record.vector_idx = current_op.vector_registers[0];
+      for (int i = 0; i < NUM_VECTOR_ELEMENTS; i++)
+        record.values[i] = context.vector_registers[record.vector_idx].element[i].raw;
+      break;
+
+    case OP_SETVERTEX: case OP_SETCOLOR:
+    {
+      // SETVERTEX has already moved on to the next vertex 
+      record.vertex_idx = (current_op.opcode == OP_SETVERTEX) ?
+        (context.vertex_id + NUM_VERTEX_REGISTER - 1) % NUM_VERTEX_REGISTER : context.vertex_id;
+      const VertexRegister &vertex = context.gpu_vertex_registers[record.vertex_idx];
+      record.values[0] = vertex.x_value;
+      record.values[1] = vertex.y_value;
+      record.values[2] = vertex.z_value;
+      record.values[3] = vertex.r_value;
+      record.values[4] = vertex.g_value;
+      record.values[5] = vertex.b_value;
+    }
+    break;
+
+    default:
+      break;
+  }
+
+  context.trace_sink->Push(record);
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Offline renderer: replay a --binary-trace file and print the
+//       same per-instruction text PrintContext produces
+////////////////////////////////////////////////////////////////////////
+bool RenderTrace(const char *path)
+{
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    cerr << "Error: Failed to open trace file " << path << endl;
+    return false;
+  }
+  TraceFileHeader header;
+  if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != TRACE_MAGIC ||
+      header.version != TRACE_VERSION || header.record_size != sizeof(TraceRecord)) {
+    cerr << "Error: " << path << " is not a 3220X binary trace" << endl;
+    fclose(file);
+    return false;
+  }
+
+  SimulatorContext *context = new SimulatorContext();
+  vector<TraceRecord> records(4096);
+  size_t num_records;
+  while ((num_records = fread(&records[0], sizeof(TraceRecord), records.size(), file)) > 0) {
+    for (size_t i = 0; i < num_records; i++) {
+      const TraceRecord &record = records[i];
+      context->instruction_count = record.instruction_count;
+      context->current_pc = record.pc;
+      context->scalar_registers[PC_IDX].int_value = record.next_pc;
+      context->scalar_registers[LR_IDX].int_value = record.link_value;
+      context->condition_code_register.int_value = record.condition_code;
+      context->gpu_status_register.int_value = record.gpu_status;
+      if (record.scalar_idx != TRACE_NONE)
+        context->scalar_registers[record.scalar_idx].int_value = record.scalar_value;
+      if (record.vector_idx != TRACE_NONE)
+        for (int e = 0; e < NUM_VECTOR_ELEMENTS; e++)
+          context->vector_registers[record.vector_idx].element[e] = Fixed1114::FromRaw(record.values[e]);
+      if (record.vertex_idx != TRACE_NONE) {
+        VertexRegister &vertex = context->gpu_vertex_registers[record.vertex_idx];
+        vertex.x_value = record.values[0];
+        vertex.y_value = record.values[1];
+        vertex.z_value = record.values[2];
+        vertex.r_value = record.values[3];
+        vertex.g_value = record.values[4];
+        vertex.b_value = record.values[5];
+      }
+      PrintContextState(*context, record.opcode, record.next_opcode);
+    }
+  }
+
+  delete context;
+  fclose(file);
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Runtime trace controls (--trace and friends)
+////////////////////////////////////////////////////////////////////////
+const char *OpcodeName(const uint8_t opcode)
+{
+  switch (opcode) {
+#define OPCODE_NAME(name) case OP_##name: return #name;
+    FOR_EACH_OPCODE(OPCODE_NAME)
+#undef OPCODE_NAME
+    default: return "UNKNOWN";
+  }
+}
+
+// output: opcode for name, or -1 
+int OpcodeByName(const char *name)
+{
+  for (int opcode = 0; opcode < 256; opcode++)
+    if (strcmp(OpcodeName(opcode), name) == 0)
+      return opcode;
+  return -1;
+}
+
+uint32_t OpcodeClass(const uint8_t opcode)
+{
+  switch (opcode) {
+    case OP_VADD: case OP_VMOV: case OP_VMOVI: case OP_VCOMPMOV: case OP_VCOMPMOVI:
+      return TRACE_CLASS_VECTOR;
+    case OP_LDB: case OP_LDW: case OP_STB: case OP_STW:
+      return TRACE_CLASS_MEMORY;
+    case OP_SETVERTEX: case OP_SETCOLOR: case OP_ROTATE: case OP_TRANSLATE:
+    case OP_SCALE: case OP_PUSHMATRIX: case OP_POPMATRIX: case OP_BEGINPRIMITIVE:
+    case OP_ENDPRIMITIVE: case OP_LOADIDENTITY: case OP_FLUSH: case OP_DRAW:
+      return TRACE_CLASS_GRAPHICS;
+    case OP_BRN: case OP_BRZ: case OP_BRP: case OP_BRNZ: case OP_BRNP: case OP_BRZP:
+    case OP_BRNZP: case OP_JMP: case OP_JSR: case OP_JSRR: case OP_HALT:
+      return TRACE_CLASS_CONTROL;
+    default:
+      return TRACE_CLASS_ALU;
+  }
+}
+
+// by TRACE_CLASS_* bit 
+static const char *kOpcodeClassNames[TRACE_NUM_CLASSES] = { "alu", "vector", "memory", "graphics", "control" };
+
+// output: bit number of OpcodeClass(opcode) 
+int OpcodeClassIndex(const uint8_t opcode)
+{
+  uint32_t opcode_class = OpcodeClass(opcode);
+  int index = 0;
+  while (opcode_class > 1) {
+    opcode_class >>= 1;
+    index++;
+  }
+  return index;
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Parse "alu,vector,memory,graphics,control" into a class mask
+// output: false on an unknown class name
+////////////////////////////////////////////////////////////////////////
+bool ParseOpcodeClasses(const char *classes, uint32_t *mask)
+{
+  *mask = 0;
+  stringstream stream(classes);
+  string name;
+  while (getline(stream, name, ',')) {
+    size_t i = 0;
+    while (i < TRACE_NUM_CLASSES && name != kOpcodeClassNames[i])
+      i++;
+    if (i == TRACE_NUM_CLASSES)
+      return false;
+    *mask |= 1u << i;
+  }
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Decide whether the instruction that just executed is traced.
+//       Triggers latch: once they fire, tracing stays armed for the
+//       rest of the run (subject to the other filters).
+////////////////////////////////////////////////////////////////////////
+bool ShouldTrace(SimulatorContext &context, const TraceOp &current_op)
+{
+  const TraceControl &control = g_trace_control;
+  if (!context.trace_triggered) {
+    if (control.trigger_register >= 0 &&
+        context.scalar_registers[control.trigger_register].int_value == control.trigger_value)
+      context.trace_triggered = true;
+    else if (control.trigger_opcode >= 0 && current_op.opcode == control.trigger_opcode)
+      context.trace_triggered = true;
+    else
+      return false;
+  }
+
+  return context.instruction_count >= control.start_count &&
+         context.instruction_count <= control.stop_count &&
+         context.current_pc >= control.pc_low && context.current_pc <= control.pc_high &&
+         (OpcodeClass(current_op.opcode) & control.opcode_classes) != 0;
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Condition codes for which a BRxx instruction is taken
+//       (bit N set <=> taken when ConditionCode(context) == N).
+//       Must agree with the BRxx cases in ExecuteOp.
+////////////////////////////////////////////////////////////////////////
+uint8_t BranchTakenMask(const uint8_t opcode)
+{
+  switch (opcode) {
+    case OP_BRN: return 1 << 0x01;
+    case OP_BRZ: return 1 << 0x02;
+    case OP_BRP: return 1 << 0x04;
+    case OP_BRNZ: return 1 << 0x03;
+    case OP_BRNP: return 1 << 0x05;
+    case OP_BRZP: return 1 << 0x06;
+    case OP_BRNZP: return 1 << 0x07;
+    default: return 0;
+  }
+}
+
+bool IsConditionalBranch(const uint8_t opcode)
+{
+  return BranchTakenMask(opcode) != 0;
+}
+
+// add the instruction that just executed to the current sample window 
+static ALWAYS_INLINE void RecordSample(SimulatorContext &context, const TraceOp &current_op)
+{
+  SampleStats &stats = context.sample_stats;
+  stats.opcode_count[current_op.opcode]++;
+  stats.window_class_count[OpcodeClassIndex(current_op.opcode)]++;
+  stats.window_instructions++;
+  uint8_t taken_mask = BranchTakenMask(current_op.opcode);
+  if (taken_mask != 0) {  // BRxx leaves CC as it found it 
+    stats.branches++;
+    stats.branches_taken += (taken_mask >> ConditionCode(context)) & 1;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Per-instruction bookkeeping shared by all execution engines.
+//       Every engine is instantiated with kTrace = false (nothing here;
+//       the engine counts instructions itself, a block at a time where
+//       it can) and kTrace = true (count, filter, then write the text
+//       and/or binary trace), and with kDetailed = true for the detailed
+//       windows of sampled runs (RecordSample() first). Either way an
+//       engine returns once instruction_count reaches stop_count or
+//       SIGUSR1 asks for a checkpoint, checked between instructions or
+//       blocks (see RunEngine()).
+////////////////////////////////////////////////////////////////////////
+template <bool kTrace, bool kDetailed>
+static ALWAYS_INLINE void TraceStep(SimulatorContext &context, const TraceOp &current_op)
+{
+  if (kDetailed)
+    RecordSample(context, current_op);
+  if (!kTrace)
+    return;
+  context.instruction_count++;
+  if (!ShouldTrace(context, current_op)) {
+    if (g_trace_control.text && g_trace_control.delta_keyframe_interval != 0)
+      NoteDeltaStore(context, current_op);
+    return;
+  }
+  if (context.trace_sink != NULL)
+    RecordTrace(context, current_op);
+  if (g_trace_control.text && g_trace_control.delta_keyframe_interval != 0)
+    PrintContextDelta(context, current_op);
+  else if (g_trace_control.text)
+    PrintContext(context, current_op);
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Reference interpreter: fetch, switch on opcode, fix up PC
+////////////////////////////////////////////////////////////////////////
+template <bool kTrace, bool kDetailed>
+void RunSwitchEngine(SimulatorContext &context, const uint64_t stop_count)
+{
+  while (context.program_halt != 1 && context.instruction_count < stop_count && !g_checkpoint_signaled) {
+    const TraceOp &current_op = context.trace_ops[context.scalar_registers[PC_IDX].int_value];
+    int idx = ExecuteInstruction(context, current_op);
+    AdvanceProgramCounter(context, current_op.opcode, idx);
+    if (!kTrace)
+      context.instruction_count++;
+    TraceStep<kTrace, kDetailed>(context, current_op);
+  }
+}
+
+typedef int (*OpHandler)(SimulatorContext &context, const TraceOp &trace_op);
+
+template <uint8_t kOpcode>
+int ExecuteOpHandler(SimulatorContext &context, const TraceOp &trace_op)
+{
+  return ExecuteOp(context, kOpcode, trace_op);
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Threaded interpreter. Every TraceOp in context.trace_ops is resolved
+//       to its handler once before execution starts. With GCC/Clang the
+//       handlers are labels and each one jumps straight to the handler
+//       of the next instruction (computed goto); otherwise a table of
+//       per-opcode handler functions is used.
+////////////////////////////////////////////////////////////////////////
+template <bool kTrace, bool kDetailed>
+void RunThreadedEngine(SimulatorContext &context, const uint64_t stop_count)
+{
+  if (context.instruction_count >= stop_count || g_checkpoint_signaled)
+    return;
+#ifdef HAVE_COMPUTED_GOTO
+  void *op_labels[256];
+  for (int i = 0; i < 256; i++)
+    op_labels[i] = &&op_default;
+#define SET_OP_LABEL(name) op_labels[OP_##name] = &&op_##name;
+  FOR_EACH_OPCODE(SET_OP_LABEL)
+#undef SET_OP_LABEL
+
+  vector<void *> &handlers = context.threaded_handlers;  // not a local: see RunEngine() 
+  handlers.resize(context.num_trace_ops);
+  for (size_t i = 0; i < context.num_trace_ops; i++)
+    handlers[i] = op_labels[context.trace_ops[i].opcode];
+
+  goto *handlers[context.scalar_registers[PC_IDX].int_value];
+
+#define THREADED_HANDLER(name) \
+  op_##name: { \
+    const TraceOp &current_op = context.trace_ops[context.scalar_registers[PC_IDX].int_value]; \
+    AdvanceProgramCounter(context, OP_##name, ExecuteOp(context, OP_##name, current_op)); \
+    if (!kTrace) \
+      context.instruction_count++; \
+    TraceStep<kTrace, kDetailed>(context, current_op); \
+    if ((OP_##name == OP_HALT && context.program_halt == 1) || \
+        context.instruction_count >= stop_count || g_checkpoint_signaled) \
+      return; \
+    goto *handlers[context.scalar_registers[PC_IDX].int_value]; \
+  }
+  FOR_EACH_OPCODE(THREADED_HANDLER)
+#undef THREADED_HANDLER
+
+  op_default: {
+    const TraceOp &current_op = context.trace_ops[context.scalar_registers[PC_IDX].int_value];
+    AdvanceProgramCounter(context, current_op.opcode, ExecuteInstruction(context, current_op));
+    if (!kTrace)
+      context.instruction_count++;
+    TraceStep<kTrace, kDetailed>(context, current_op);
+    if (context.instruction_count >= stop_count || g_checkpoint_signaled)
+      return;
+    goto *handlers[context.scalar_registers[PC_IDX].int_value];
+  }
+#else
+  OpHandler op_handlers[256];
+  for (int i = 0; i < 256; i++)
+    op_handlers[i] = ExecuteInstruction;
+#define SET_OP_HANDLER(name) op_handlers[OP_##name] = ExecuteOpHandler<OP_##name>;
+  FOR_EACH_OPCODE(SET_OP_HANDLER)
+#undef SET_OP_HANDLER
+
+  while (context.program_halt != 1 && context.instruction_count < stop_count && !g_checkpoint_signaled) {
+    int pc = context.scalar_registers[PC_IDX].int_value;
+    const TraceOp &current_op = context.trace_ops[pc];
+    AdvanceProgramCounter(context, current_op.opcode, op_handlers[current_op.opcode](context, current_op));
+    if (!kTrace)
+      context.instruction_count++;
+    TraceStep<kTrace, kDetailed>(context, current_op);
+  }
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: True if trace_op ends a basic block: control transfers, HALT,
+//       and any instruction whose destination is the PC register
+////////////////////////////////////////////////////////////////////////
+bool IsBlockTerminator(const TraceOp &trace_op)
+{
+  uint8_t opcode = trace_op.opcode;
+  if (IsConditionalBranch(opcode) || opcode == OP_JMP || opcode == OP_JSR ||
+      opcode == OP_JSRR || opcode == OP_HALT)
+    return true;
+
+  switch (opcode) {
+    case OP_ADD_D: case OP_ADD_F: case OP_ADDI_D: case OP_ADDI_F:
+    case OP_AND_D: case OP_ANDI_D: case OP_MOV: case OP_MOVI_D:
+    case OP_MOVI_F: case OP_LDB: case OP_LDW:
+      return trace_op.scalar_registers[0] == PC_IDX;
+    default:
+      return false;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Block op handlers. Each one leaves PC (and LR) exactly as the
+//       switch engine would after the instruction(s) it covers.
+////////////////////////////////////////////////////////////////////////
+template <uint8_t kOpcode, bool kTrace, bool kDetailed>
+void ExecuteBlockOp(SimulatorContext &context, const BlockOp &block_op)
+{
+  AdvanceProgramCounter(context, kOpcode, ExecuteOp(context, kOpcode, *block_op.trace_op));
+  TraceStep<kTrace, kDetailed>(context, *block_op.trace_op);
+}
+
+template <bool kTrace, bool kDetailed>
+void ExecuteBlockOpGeneric(SimulatorContext &context, const BlockOp &block_op)
+{
+  const TraceOp &trace_op = *block_op.trace_op;
+  AdvanceProgramCounter(context, trace_op.opcode, ExecuteInstruction(context, trace_op));
+  TraceStep<kTrace, kDetailed>(context, trace_op);
+}
+
+// CMP/CMPI followed by BRxx
+template <uint8_t kCompareOpcode, bool kTrace, bool kDetailed>
+void ExecuteCompareBranch(SimulatorContext &context, const BlockOp &block_op)
+{
+  const TraceOp *trace_op = block_op.trace_op;
+  AdvanceProgramCounter(context, kCompareOpcode, ExecuteOp(context, kCompareOpcode, trace_op[0]));
+  TraceStep<kTrace, kDetailed>(context, trace_op[0]);
+
+  int idx = ((block_op.branch_taken_mask >> ConditionCode(context)) & 1) ?
+    trace_op[1].int_value : -1;
+  AdvanceProgramCounter(context, OP_BRNZP, idx);
+  TraceStep<kTrace, kDetailed>(context, trace_op[1]);
+}
+
+// ADDI_D followed by CMPI
+template <bool kTrace, bool kDetailed>
+void ExecuteAddiCompare(SimulatorContext &context, const BlockOp &block_op)
+{
+  const TraceOp *trace_op = block_op.trace_op;
+  AdvanceProgramCounter(context, OP_ADDI_D, ExecuteOp(context, OP_ADDI_D, trace_op[0]));
+  TraceStep<kTrace, kDetailed>(context, trace_op[0]);
+  AdvanceProgramCounter(context, OP_CMPI, ExecuteOp(context, OP_CMPI, trace_op[1]));
+  TraceStep<kTrace, kDetailed>(context, trace_op[1]);
+}
+
+// the handler of each BlockOp kind in one instantiation 
+template <bool kTrace, bool kDetailed>
+struct BlockHandlerTable {
+  BlockOpHandler handlers[NUM_BLOCK_OP_KINDS];
+
+  BlockHandlerTable() {
+    for (int i = 0; i < 256; i++)
+      handlers[i] = ExecuteBlockOpGeneric<kTrace, kDetailed>;
+#define SET_BLOCK_HANDLER(name) handlers[OP_##name] = ExecuteBlockOp<OP_##name, kTrace, kDetailed>;
+    FOR_EACH_OPCODE(SET_BLOCK_HANDLER)
+#undef SET_BLOCK_HANDLER
+    handlers[BLOCK_OP_CMP_BRANCH] = ExecuteCompareBranch<OP_CMP, kTrace, kDetailed>;
+    handlers[BLOCK_OP_CMPI_BRANCH] = ExecuteCompareBranch<OP_CMPI, kTrace, kDetailed>;
+    handlers[BLOCK_OP_ADDI_CMPI] = ExecuteAddiCompare<kTrace, kDetailed>;
+  }
+};
+
+////////////////////////////////////////////////////////////////////////
+// desc: Translate the basic block starting at start_pc into
+//       context.block_cache, fusing CMP/CMPI+BRxx and ADDI_D+CMPI pairs.
+//       Blocks serve every instantiation of RunBlockEngine(): each op
+//       has its kind, and the plain (untraced) handler ready to call.
+// output: index of the new block in context.block_cache
+////////////////////////////////////////////////////////////////////////
+int TranslateBlock(SimulatorContext &context, const int start_pc)
+{
+  static const BlockHandlerTable<false, false> s_block_handlers;
+
+  BasicBlock block;
+  block.start_pc = start_pc;
+  block.num_instructions = 0;
+
+  int num_trace_ops = (int) context.num_trace_ops;
+  int pc = start_pc;
+  while (pc < num_trace_ops) {
+    const TraceOp &trace_op = context.trace_ops[pc];
+    uint8_t opcode = trace_op.opcode;
+    bool has_next = pc + 1 < num_trace_ops && !IsBlockTerminator(trace_op);
+    uint8_t next_opcode = has_next ? context.trace_ops[pc + 1].opcode : 0;
+
+    BlockOp block_op;
+    block_op.trace_op = &trace_op;
+    block_op.branch_taken_mask = 0;
+    int length = 1;
+
+    if ((opcode == OP_CMP || opcode == OP_CMPI) && IsConditionalBranch(next_opcode)) {
+      block_op.kind = (opcode == OP_CMP) ? BLOCK_OP_CMP_BRANCH : BLOCK_OP_CMPI_BRANCH;
+      block_op.branch_taken_mask = BranchTakenMask(next_opcode);
+      length = 2;
+    } else if (opcode == OP_ADDI_D && next_opcode == OP_CMPI &&
+               !(pc + 2 < num_trace_ops && IsConditionalBranch(context.trace_ops[pc + 2].opcode))) {
+      // leave CMPI to pair with the branch when one follows
+      block_op.kind = BLOCK_OP_ADDI_CMPI;
+      length = 2;
+    } else {
+      block_op.kind = opcode;
+    }
+    block_op.handler = s_block_handlers.handlers[block_op.kind];
+
+    block.ops.push_back(block_op);
+    block.num_instructions += length;
+    pc += length;
+    if (IsBlockTerminator(context.trace_ops[pc - 1]))
+      break;
+  }
+
+  block.execution_count = 0;
+  block.jit_attempted = false;
+  block.jit_code = NULL;
+  block.jit_num_instructions = 0;
+
+  context.block_cache.push_back(block);
+  context.block_lookup[start_pc] = (int) context.block_cache.size() - 1;
+  return context.block_lookup[start_pc];
+}
+
+////////////////////////////////////////////////////////////////////////
+// x86-64 JIT (ENGINE_JIT)
+// Hot blocks are compiled to native code operating directly on the
+// scalar register file, context.memory and context.condition_code_register
+// (any pending condition code is resolved before compiled code runs).
+// Supported: ADD_D, ADDI_D, AND_D, ANDI_D, MOV, MOVI_D, CMP, CMPI (all
+// integer registers R0-R6 where the ISA splits int/float), LDB, LDW,
+// STB, STW and BRxx. Compilation stops at the first instruction that
+// is not supported (or that reads/writes the PC register); the compiled
+// code then returns that instruction's index to the interpreter.
+// Generated code: rdi = scalar registers, rsi = memory base, rdx = CC.
+// LDx/STx check their address like the interpreter's and STx set the
+// page flags of context.memory, whose address is built into the code;
+// context.jit_memory_ops maps a fault inside compiled code back to its PC.
+////////////////////////////////////////////////////////////////////////
+#if defined(__x86_64__) && defined(__unix__)
+#define HAVE_JIT
+#endif
+
+#ifdef HAVE_JIT
+class JitEmitter {
+ public:
+  void Emit8(const uint8_t value) { code_.push_back(value); }
+  void Emit32(const uint32_t value) {
+    for (int i = 0; i < 4; i++)
+      Emit8((value >> (8 * i)) & 0xff);
+  }
+  // ModRM for [rdi + disp32] with reg field reg 
+  void EmitRegisterOperand(const int reg, const int scalar_register_idx) {
+    Emit8(0x80 | (reg << 3) | 7);
+    Emit32(scalar_register_idx * sizeof(ScalarRegister));
+  }
+
+  // mov eax/ecx, [rdi + reg] 
+  void LoadEax(const int idx) { Emit8(0x8B); EmitRegisterOperand(0, idx); }
+  void LoadEcx(const int idx) { Emit8(0x8B); EmitRegisterOperand(1, idx); }
+  // mov [rdi + reg], eax 
+  void StoreEax(const int idx) { Emit8(0x89); EmitRegisterOperand(0, idx); }
+  void MovEaxImm(const int imm) { Emit8(0xB8); Emit32(imm); }
+  void MovEcxImm(const int imm) { Emit8(0xB9); Emit32(imm); }
+  void AddEax(const int idx) { Emit8(0x03); EmitRegisterOperand(0, idx); }
+  void AndEax(const int idx) { Emit8(0x23); EmitRegisterOperand(0, idx); }
+  void AddEaxImm(const int imm) { Emit8(0x05); Emit32(imm); }
+  void AndEaxImm(const int imm) { Emit8(0x25); Emit32(imm); }
+  void Ret() { Emit8(0xC3); }
+
+  ////////////////////////////////////////////////////////////////////
+  // SetConditionCodeInt(context, (int16_t) val1, (int16_t) val2) where val1 is
+  // in eax and val2 is the register src2_idx or (if src2_idx < 0) imm
+  ////////////////////////////////////////////////////////////////////
+  void SetConditionCode(const int src2_idx, const int imm) {
+    Emit8(0x0F); Emit8(0xBF); Emit8(0xC8);           // movsx ecx, ax 
+    if (src2_idx >= 0) {
+      Emit8(0x0F); Emit8(0xBF); EmitRegisterOperand(0, src2_idx); // movsx eax, word [rdi + src2]
+      Emit8(0x39); Emit8(0xC1);                       // cmp ecx, eax 
+    } else {
+      Emit8(0x81); Emit8(0xF9); Emit32((int16_t) imm); // cmp ecx, imm32 
+    }
+    MovEaxImm(0x02);
+    MovEcxImm(0x01);
+    Emit8(0x0F); Emit8(0x4C); Emit8(0xC1);           // cmovl eax, ecx 
+    MovEcxImm(0x04);
+    Emit8(0x0F); Emit8(0x4F); Emit8(0xC1);           // cmovg eax, ecx 
+    Emit8(0x89); Emit8(0x02);                        // mov [rdx], eax 
+  }
+
+  // rax = regs[base] + offset, or the start of the low guard if that
+  // is outside memory_size bytes (see DataMemory). The second byte of a
+  // word at the top of memory lands in the high guard. 
+  void ComputeAddress(const int base_idx, const int offset, const size_t memory_size) {
+    LoadEax(base_idx);
+    AddEaxImm(offset);
+    Emit8(0x3D); Emit32(memory_size);                // cmp eax, memory_size 
+    Emit8(0x48); Emit8(0x63); Emit8(0xC0);           // movsxd rax, eax 
+    Emit8(0x72); Emit8(0x07);                        // jb past the mov 
+    Emit8(0x48); Emit8(0xC7); Emit8(0xC0); Emit32(-(int) MEMORY_GUARD_SIZE); // mov rax, -guard 
+  }
+  // mov cl/cx, [rsi + rax] ; mov [rdi + dest], cl/cx 
+  void LoadMemory(const int dest_idx, const bool word) {
+    if (word) Emit8(0x66);
+    Emit8(0x8A + word); Emit8(0x0C); Emit8(0x06);
+    if (word) Emit8(0x66);
+    Emit8(0x88 + word); EmitRegisterOperand(1, dest_idx);
+  }
+  // page_flags[page of rax, and of rax + 1 for a word] = DIRTY | WRITTEN,
+  // masked like DataMemory::Store8() for a store about to fault 
+  void MarkPagesWritten(const uint8_t *page_flags, const size_t num_pages, const bool word) {
+    Emit8(0x49); Emit8(0xB8);                        // movabs r8, page_flags 
+    for (int i = 0; i < 8; i++)
+      Emit8(((uintptr_t) page_flags >> (8 * i)) & 0xff);
+    for (int byte = 0; byte <= (int) word; byte++) {
+      if (byte == 0) { Emit8(0x89); Emit8(0xC1); }           // mov ecx, eax 
+      else { Emit8(0x8D); Emit8(0x48); Emit8(0x01); }        // lea ecx, [rax + 1] 
+      Emit8(0xC1); Emit8(0xE9); Emit8(MEMORY_PAGE_SHIFT);    // shr ecx, MEMORY_PAGE_SHIFT 
+      Emit8(0x81); Emit8(0xE1); Emit32(num_pages - 1);       // and ecx, num_pages - 1 
+      Emit8(0x41); Emit8(0xC6); Emit8(0x04); Emit8(0x08);    // mov byte [r8 + rcx], flags 
+      Emit8(MEMORY_PAGE_DIRTY | MEMORY_PAGE_WRITTEN);
+    }
+  }
+  // mov cl/cx, [rdi + src] ; mov [rsi + rax], cl/cx 
+  void StoreMemory(const int src_idx, const bool word) {
+    if (word) Emit8(0x66);
+    Emit8(0x8A + word); EmitRegisterOperand(1, src_idx);
+    if (word) Emit8(0x66);
+    Emit8(0x88 + word); Emit8(0x0C); Emit8(0x06);
+  }
+
+  // return ((taken_mask >> CC) & 1) ? taken_pc : fallthrough_pc 
+  void ConditionalReturn(const uint8_t taken_mask, const int taken_pc,
+                         const int fallthrough_pc) {
+    Emit8(0x8B); Emit8(0x02);                        // mov eax, [rdx] 
+    MovEcxImm(taken_mask);
+    Emit8(0x0F); Emit8(0xA3); Emit8(0xC1);           // bt ecx, eax 
+    MovEaxImm(fallthrough_pc);
+    MovEcxImm(taken_pc);
+    Emit8(0x0F); Emit8(0x42); Emit8(0xC1);           // cmovc eax, ecx 
+    Ret();
+  }
+
+  const vector<uint8_t> &code() const { return code_; }
+
+ private:
+  vector<uint8_t> code_;
+};
+
+////////////////////////////////////////////////////////////////////////
+// desc: Can the JIT compile trace_op? (see comment above)
+////////////////////////////////////////////////////////////////////////
+bool JitSupports(const TraceOp &trace_op)
+{
+  const uint8_t *r = trace_op.scalar_registers;
+  switch (trace_op.opcode) {
+    case OP_ADD_D:
+    case OP_AND_D:
+      return r[0] != PC_IDX && r[1] != PC_IDX && r[2] != PC_IDX;
+    case OP_ADDI_D:
+    case OP_ANDI_D:
+    case OP_LDB:
+    case OP_LDW:
+    case OP_STB:
+    case OP_STW:
+      return r[0] != PC_IDX && r[1] != PC_IDX;
+    case OP_MOV:
+    case OP_CMP:
+      return r[0] < 7 && r[1] != PC_IDX;
+    case OP_MOVI_D:
+      return r[0] != PC_IDX;
+    case OP_CMPI:
+      return r[0] < 7;
+    default:
+      return IsConditionalBranch(trace_op.opcode);
+  }
+}
+
+bool JitWritesConditionCode(const uint8_t opcode)
+{
+  return opcode != OP_LDB && opcode != OP_LDW && opcode != OP_STB && opcode != OP_STW;
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Compile the instructions starting at start_pc to native code
+// output: entry point, or NULL if nothing at start_pc can be compiled;
+//         *num_compiled: instructions the entry point runs per call
+////////////////////////////////////////////////////////////////////////
+JitBlockFn JitCompileBlock(SimulatorContext &context, const int start_pc, int *num_compiled)
+{
+  int num_trace_ops = (int) context.num_trace_ops;
+  int end_pc = start_pc;  // one past the last compiled instruction 
+  bool ends_in_branch = false;
+  while (end_pc < num_trace_ops && JitSupports(context.trace_ops[end_pc])) {
+    end_pc++;
+    if (IsConditionalBranch(context.trace_ops[end_pc - 1].opcode)) {
+      ends_in_branch = true;
+      break;
+    }
+  }
+  if (end_pc == start_pc)
+    return NULL;
+
+  // CC only needs to be materialized if a later branch or the
+  // interpreter can observe it before it is overwritten 
+  vector<bool> cc_live(end_pc - start_pc);
+  bool live = true;
+  for (int pc = end_pc - 1; pc >= start_pc; pc--) {
+    uint8_t opcode = context.trace_ops[pc].opcode;
+    cc_live[pc - start_pc] = live;
+    if (IsConditionalBranch(opcode))
+      live = true;
+    else if (JitWritesConditionCode(opcode))
+      live = false;
+  }
+
+  JitEmitter jit;
+  vector<JitMemoryOp> memory_ops;
+  for (int pc = start_pc; pc < end_pc; pc++) {
+    const TraceOp &trace_op = context.trace_ops[pc];
+    const uint8_t *r = trace_op.scalar_registers;
+    bool set_cc = cc_live[pc - start_pc];
+    switch (trace_op.opcode) {
+      case OP_ADD_D:
+        jit.LoadEax(r[1]); jit.AddEax(r[2]); jit.StoreEax(r[0]);
+        if (set_cc) jit.SetConditionCode(-1, 0);
+        break;
+      case OP_AND_D:
+        jit.LoadEax(r[1]); jit.AndEax(r[2]); jit.StoreEax(r[0]);
+        if (set_cc) jit.SetConditionCode(-1, 0);
+        break;
+      case OP_ADDI_D:
+        jit.LoadEax(r[1]); jit.AddEaxImm(trace_op.int_value); jit.StoreEax(r[0]);
+        if (set_cc) jit.SetConditionCode(-1, 0);
+        break;
+      case OP_ANDI_D:
+        jit.LoadEax(r[1]); jit.AndEaxImm(trace_op.int_value); jit.StoreEax(r[0]);
+        if (set_cc) jit.SetConditionCode(-1, 0);
+        break;
+      case OP_MOV:
+        jit.LoadEax(r[1]); jit.StoreEax(r[0]);
+        if (set_cc) jit.SetConditionCode(-1, 0);
+        break;
+      case OP_MOVI_D:
+        jit.MovEaxImm(trace_op.int_value); jit.StoreEax(r[0]);
+        if (set_cc) jit.SetConditionCode(-1, 0);
+        break;
+      case OP_CMP:
+        if (set_cc) { jit.LoadEax(r[0]); jit.SetConditionCode(r[1], 0); }
+        break;
+      case OP_CMPI:
+        if (set_cc) { jit.LoadEax(r[0]); jit.SetConditionCode(-1, trace_op.int_value); }
+        break;
+      case OP_LDB:
+      case OP_LDW:
+        jit.ComputeAddress(r[1], trace_op.int_value, context.memory.size());
+        memory_ops.push_back(JitMemoryOp());
+        memory_ops.back().code_offset = jit.code().size();
+        memory_ops.back().pc = pc;
+        jit.LoadMemory(r[0], trace_op.opcode == OP_LDW);
+        break;
+      case OP_STB:
+      case OP_STW:
+        jit.ComputeAddress(r[1], trace_op.int_value, context.memory.size());
+        jit.MarkPagesWritten(context.memory.page_flags(), context.memory.num_pages(),
+                             trace_op.opcode == OP_STW);
+        memory_ops.push_back(JitMemoryOp());
+        memory_ops.back().code_offset = jit.code().size();
+        memory_ops.back().pc = pc;
+        jit.StoreMemory(r[0], trace_op.opcode == OP_STW);
+        break;
+      default: // BRxx, always last 
+        jit.ConditionalReturn(BranchTakenMask(trace_op.opcode),
+                              pc + 1 + trace_op.int_value, pc + 1);
+        break;
+    }
+  }
+  if (!ends_in_branch) {
+    jit.MovEaxImm(end_pc);
+    jit.Ret();
+  }
+
+  if (context.jit_code == NULL) {
+    void *region = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED)
+      return NULL;
+    context.jit_code = (unsigned char *) region;
+  }
+
+  const vector<uint8_t> &code = jit.code();
+  if (context.jit_code_used + code.size() > JIT_CODE_SIZE)
+    return NULL;
+
+  // W^X: region is writable only while new code is copied in 
+  if (mprotect(context.jit_code, JIT_CODE_SIZE, PROT_READ | PROT_WRITE) != 0)
+    return NULL;
+  unsigned char *entry = context.jit_code + context.jit_code_used;
+  memcpy(entry, &code[0], code.size());
+  for (size_t i = 0; i < memory_ops.size(); i++) {
+    memory_ops[i].code_offset += context.jit_code_used;
+    context.jit_memory_ops.push_back(memory_ops[i]);
+  }
+  context.jit_code_used += code.size();
+  if (mprotect(context.jit_code, JIT_CODE_SIZE, PROT_READ | PROT_EXEC) != 0)
+    return NULL;
+
+  *num_compiled = end_pc - start_pc;
+  return (JitBlockFn) entry;
+}
+#else
+JitBlockFn JitCompileBlock(SimulatorContext &context, const int start_pc, int *num_compiled)
+{
+  return NULL;
+}
+#endif // HAVE_JIT
+
+// drop all translated and compiled blocks 
+void ClearBlockCache(SimulatorContext &context)
+{
+  context.block_cache.clear();
+  context.block_lookup.assign(context.num_trace_ops, -1);
+  context.jit_code_used = 0;
+  context.jit_memory_ops.clear();
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Basic-block engine: look up (or translate) the block at PC and
+//       run all of its ops in one go. With ENGINE_JIT, blocks executed
+//       JIT_HOT_THRESHOLD times are compiled and run natively from then
+//       on. Compiled code skips per-instruction tracing and sampling,
+//       so the JIT is only used by the plain instantiation. Every
+//       instantiation returns at the first block boundary at or past
+//       stop_count. The block cache is kept across calls; RunEngine()
+//       clears it for a new run.
+////////////////////////////////////////////////////////////////////////
+template <bool kTrace, bool kDetailed>
+void RunBlockEngine(SimulatorContext &context, const uint64_t stop_count)
+{
+  static const BlockHandlerTable<kTrace, kDetailed> s_block_handlers;
+  const bool plain = !kTrace && !kDetailed;
+
+  while (context.program_halt != 1 && context.instruction_count < stop_count && !g_checkpoint_signaled) {
+    int pc = context.scalar_registers[PC_IDX].int_value;
+    int block_idx = context.block_lookup[pc];
+    if (block_idx < 0)
+      block_idx = TranslateBlock(context, pc);
+
+    BasicBlock &block = context.block_cache[block_idx];
+    if (plain && block.jit_code != NULL) {
+      ResolveConditionCode(context);
+      context.scalar_registers[PC_IDX].int_value =
+        block.jit_code(context.scalar_registers, context.memory.base(), &context.condition_code_register);
+      context.instruction_count += block.jit_num_instructions;
+      continue;
+    }
+    if (plain && g_execution_engine == ENGINE_JIT && !block.jit_attempted &&
+        ++block.execution_count >= JIT_HOT_THRESHOLD) {
+      block.jit_attempted = true;
+      block.jit_code = JitCompileBlock(context, block.start_pc, &block.jit_num_instructions);
+      if (block.jit_code != NULL)
+        continue;
+    }
+
+    const BlockOp *block_op = &block.ops[0];
+    const BlockOp *block_end = block_op + block.ops.size();
+    for (; block_op != block_end; ++block_op) {
+      if (plain)
+        block_op->handler(context, *block_op);
+      else
+        s_block_handlers.handlers[block_op->kind](context, *block_op);
+    }
+    if (!kTrace)
+      context.instruction_count += block.num_instructions;
+  }
+}
+
+// fold the finished window into the per-window class shares 
+static void EndSampleWindow(SampleStats &stats)
+{
+  if (stats.window_instructions == 0)
+    return;
+  for (int i = 0; i < TRACE_NUM_CLASSES; i++) {
+    double share = (double) stats.window_class_count[i] / stats.window_instructions;
+    stats.class_share_sum[i] += share;
+    stats.class_share_sum_sq[i] += share * share;
+    stats.window_class_count[i] = 0;
+  }
+  stats.instructions += stats.window_instructions;
+  stats.window_instructions = 0;
+  stats.windows++;
+}
+
+static bool SamplingEnabled()
+{
+  return g_sample_control.period != 0 || !g_sample_control.points.empty();
+}
+
+// output: instruction_count of the next sample point at or after count,
+//         UINT_MAX if there is none 
+static unsigned int NextSamplePoint(const SampleControl &control, const unsigned int count)
+{
+  if (control.period != 0)
+    return min<uint64_t>((count + (uint64_t) control.period - 1) / control.period * control.period, UINT_MAX);
+  vector<unsigned int>::const_iterator point = lower_bound(control.points.begin(), control.points.end(), count);
+  return point == control.points.end() ? UINT_MAX : *point;
+}
+
+// run the kTrace/kDetailed instantiation of g_execution_engine 
+template <bool kTrace, bool kDetailed>
+static void RunSelectedEngine(SimulatorContext &context, const uint64_t stop_count)
+{
+  if (g_execution_engine == ENGINE_THREADED)
+    RunThreadedEngine<kTrace, kDetailed>(context, stop_count);
+  else if (g_execution_engine == ENGINE_BLOCK || g_execution_engine == ENGINE_JIT)
+    RunBlockEngine<kTrace, kDetailed>(context, stop_count);
+  else
+    RunSwitchEngine<kTrace, kDetailed>(context, stop_count);
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Sampled simulation: fast-forward on the plain instantiation of
+//       g_execution_engine to each sample point, then run a detailed
+//       window of g_sample_control.window instructions on its kDetailed
+//       one, which is also the only one that traces. instruction_count
+//       stays exact; the block engine starts and ends windows at block
+//       boundaries. With -e jit, windows run on the block engine
+//       without compiled code. main() does not combine sampling with
+//       checkpoints.
+////////////////////////////////////////////////////////////////////////
+void RunSampledEngine(SimulatorContext &context, const bool tracing)
+{
+  const SampleControl &control = g_sample_control;
+  while (context.program_halt != 1) {
+    unsigned int sample_point = NextSamplePoint(control, context.instruction_count);
+    RunSelectedEngine<false, false>(context, sample_point);
+    if (context.program_halt == 1)
+      break;
+    unsigned int window_end = context.instruction_count +
+      min(control.window, UINT_MAX - context.instruction_count);
+    if (tracing)
+      RunSelectedEngine<true, true>(context, window_end);
+    else
+      RunSelectedEngine<false, true>(context, window_end);
+    EndSampleWindow(context.sample_stats);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Print the detailed-window statistics, scaled to the
+//       instruction_count of the whole run. Class shares come with a 95%
+//       confidence interval over the windows.
+////////////////////////////////////////////////////////////////////////
+void PrintSampleStats(SimulatorContext &context)
+{
+  SampleStats &stats = context.sample_stats;
+  EndSampleWindow(stats);  // a memory fault can end the run inside a window 
+  uint64_t total = context.instruction_count;
+  cerr << "sampling: " << stats.windows << " windows, " << stats.instructions << " of " << total
+       << " instructions simulated in detail" << endl;
+  if (stats.instructions == 0)
+    return;
+  double scale = (double) total / stats.instructions;
+
+  char line[128];
+  for (int i = 0; i < TRACE_NUM_CLASSES; i++) {
+    double mean = stats.class_share_sum[i] / stats.windows;
+    double variance = stats.windows > 1 ?
+      max(0.0, (stats.class_share_sum_sq[i] - stats.windows * mean * mean) / (stats.windows - 1)) : 0.0;
+    uint64_t sampled = 0;
+    for (int opcode = 0; opcode < 256; opcode++)
+      if (OpcodeClassIndex(opcode) == i)
+        sampled += stats.opcode_count[opcode];
+    snprintf(line, sizeof(line), "sampling: %-8s %6.2f%% +- %5.2f%%  ~%.0f instructions",
+             kOpcodeClassNames[i], 100.0 * sampled / stats.instructions,
+             100.0 * 1.96 * sqrt(variance / stats.windows), sampled * scale);
+    cerr << line << endl;
+  }
+  if (stats.branches != 0) {
+    snprintf(line, sizeof(line), "sampling: %.1f%% of %.0f conditional branches taken",
+             100.0 * stats.branches_taken / stats.branches, stats.branches * scale);
+    cerr << line << endl;
+  }
+
+  vector<pair<uint64_t, int> > opcodes;
+  for (int opcode = 0; opcode < 256; opcode++)
+    if (stats.opcode_count[opcode] != 0)
+      opcodes.push_back(make_pair(stats.opcode_count[opcode], opcode));
+  sort(opcodes.rbegin(), opcodes.rend());
+  cerr << "sampling: top opcodes:";
+  for (size_t i = 0; i < opcodes.size() && i < 8; i++) {
+    snprintf(line, sizeof(line), " %s %.1f%%", OpcodeName(opcodes[i].second),
+             100.0 * opcodes[i].first / stats.instructions);
+    cerr << line;
+  }
+  cerr << endl;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Program loading
+////////////////////////////////////////////////////////////////////////
+bool IsLittleEndianHost()
+{
+  const uint16_t probe = 1;
+  return *(const unsigned char *) &probe == 1;
+}
+
+uint32_t ReadLittleEndian32(const unsigned char *bytes)
+{
+  return (uint32_t) bytes[0] | ((uint32_t) bytes[1] << 8) |
+         ((uint32_t) bytes[2] << 16) | ((uint32_t) bytes[3] << 24);
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Convert 32 ASCII '0'/'1' characters (MSB first) to a word
+// output: false if any character is not '0' or '1'
+////////////////////////////////////////////////////////////////////////
+typedef bool (*ParseBitsFn)(const char *chars, uint32_t *word);
+
+static inline uint32_t ReverseBits32(uint32_t value)
+{
+  value = ((value >> 1) & 0x55555555) | ((value & 0x55555555) << 1);
+  value = ((value >> 2) & 0x33333333) | ((value & 0x33333333) << 2);
+  value = ((value >> 4) & 0x0F0F0F0F) | ((value & 0x0F0F0F0F) << 4);
+  value = ((value >> 8) & 0x00FF00FF) | ((value & 0x00FF00FF) << 8);
+  return (value >> 16) | (value << 16);
+}
+
+bool ParseBitsScalar(const char *chars, uint32_t *word)
+{
+  uint32_t value = 0;
+  for (int i = 0; i < 32; i++) {
+    unsigned int bit = (unsigned char) chars[i] - '0';
+    if (bit > 1)
+      return false;
+    value = (value << 1) | bit;
+  }
+  *word = value;
+  return true;
+}
+
+#ifdef HAVE_SSE2
+// movemask puts character i in bit i, so the mask is bit-reversed 
+bool ParseBitsSSE2(const char *chars, uint32_t *word)
+{
+  const __m128i zeros = _mm_set1_epi8('0');
+  const __m128i ones = _mm_set1_epi8('1');
+  __m128i lo = _mm_loadu_si128((const __m128i *) chars);
+  __m128i hi = _mm_loadu_si128((const __m128i *) (chars + 16));
+  __m128i lo_ones = _mm_cmpeq_epi8(lo, ones);
+  __m128i hi_ones = _mm_cmpeq_epi8(hi, ones);
+  uint32_t valid =
+    (uint32_t) _mm_movemask_epi8(_mm_or_si128(lo_ones, _mm_cmpeq_epi8(lo, zeros))) |
+    ((uint32_t) _mm_movemask_epi8(_mm_or_si128(hi_ones, _mm_cmpeq_epi8(hi, zeros))) << 16);
+  if (valid != 0xFFFFFFFF)
+    return false;
+  *word = ReverseBits32((uint32_t) _mm_movemask_epi8(lo_ones) |
+                        ((uint32_t) _mm_movemask_epi8(hi_ones) << 16));
+  return true;
+}
+#endif
+
+#ifdef HAVE_AVX2_TARGET
+__attribute__((target("avx2")))
+bool ParseBitsAVX2(const char *chars, uint32_t *word)
+{
+  __m256i text = _mm256_loadu_si256((const __m256i *) chars);
+  __m256i is_one = _mm256_cmpeq_epi8(text, _mm256_set1_epi8('1'));
+  __m256i is_zero = _mm256_cmpeq_epi8(text, _mm256_set1_epi8('0'));
+  if ((uint32_t) _mm256_movemask_epi8(_mm256_or_si256(is_one, is_zero)) != 0xFFFFFFFF)
+    return false;
+  *word = ReverseBits32((uint32_t) _mm256_movemask_epi8(is_one));
+  return true;
+}
+#endif
+
+ParseBitsFn SelectParseBits()
+{
+#ifdef HAVE_AVX2_TARGET
+  if (__builtin_cpu_supports("avx2"))
+    return ParseBitsAVX2;
+#endif
+#ifdef HAVE_SSE2
+  return ParseBitsSSE2;
+#else
+  return ParseBitsScalar;
+#endif
+}
+
+static inline bool IsBlank(const char c)
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Read the ASCII format: one 32-character '0'/'1' bitset per line.
+//       The whole file is read at once and each line is converted and
+//       decoded straight into the context's instruction and TraceOp storage.
+//       Blank lines are skipped; anything else is reported with its
+//       line number.
+////////////////////////////////////////////////////////////////////////
+bool LoadTextProgram(SimulatorContext &context, const char *path)
+{
+  ifstream infile(path, ios::binary | ios::ate);
+  if (!infile) {
+    cerr << "Error: Failed to open input file " << path << endl;
+    return false;
+  }
+  size_t file_size = (size_t) infile.tellg();
+  // padding keeps the 32-byte SIMD loads of a short last line in bounds 
+  vector<char> buffer(file_size + 32, '\0');
+  infile.seekg(0);
+  infile.read(&buffer[0], file_size);
+  if ((size_t) infile.gcount() != file_size) {
+    cerr << "Error: Failed to read input file " << path << endl;
+    return false;
+  }
+  infile.close();
+
+  ParseBitsFn parse_bits = SelectParseBits();
+  context.instruction_storage.reserve(file_size / 33 + 1);
+  context.trace_op_storage.reserve(file_size / 33 + 1);
+
+  const char *cursor = &buffer[0];
+  const char *end = cursor + file_size;
+  for (int line_number = 1; cursor < end; line_number++) {
+    const char *eol = (const char *) memchr(cursor, '\n', end - cursor);
+    if (eol == NULL)
+      eol = end;
+    const char *first = cursor;
+    const char *last = eol;
+    while (first < last && IsBlank(*first))
+      first++;
+    while (last > first && IsBlank(last[-1]))
+      last--;
+    cursor = eol + 1;
+    if (first == last)
+      continue;
+
+    uint32_t word;
+    if (last - first != 32 || !parse_bits(first, &word)) {
+      cerr << "Error: " << path << ":" << line_number
+           << ": expected 32 '0'/'1' characters: " << string(first, last) << endl;
+      return false;
+    }
+    context.instruction_storage.push_back(word);
+    context.trace_op_storage.push_back(DecodeInstruction(word));
+  }
+
+  context.instruction_words = context.instruction_storage.empty() ? NULL : &context.instruction_storage[0];
+  context.num_instructions = context.instruction_storage.size();
+  context.trace_ops = context.trace_op_storage.empty() ? NULL : &context.trace_op_storage[0];
+  context.num_trace_ops = context.trace_op_storage.size();
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Check that pre-decoded TraceOps from a file only hold known
+//       opcodes and in-range register and element indices, which the
+//       engines use unchecked as array indices
+// output: false if any TraceOp is out of range
+////////////////////////////////////////////////////////////////////////
+static bool ValidTraceOps(const TraceOp *trace_ops, const size_t num_trace_ops)
+{
+  for (size_t i = 0; i < num_trace_ops; i++) {
+    const TraceOp &trace_op = trace_ops[i];
+    switch (trace_op.opcode) {
+#define KNOWN_OPCODE(name) case OP_##name:
+      FOR_EACH_OPCODE(KNOWN_OPCODE)
+#undef KNOWN_OPCODE
+        break;
+      default:
+        return false;
+    }
+    for (int r = 0; r < 3; r++)
+      if (trace_op.scalar_registers[r] >= NUM_SCALAR_REGISTER ||
+          trace_op.vector_registers[r] >= NUM_VECTOR_REGISTER)
+        return false;
+    if (trace_op.idx >= NUM_VECTOR_ELEMENTS)
+      return false;
+  }
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Map a binary program (see ProgramHeader) into memory. On
+//       little-endian hosts the instruction words and the pre-decoded
+//       TraceOp section are used in place, without copying.
+// output: false if the file is not a valid binary program
+////////////////////////////////////////////////////////////////////////
+bool LoadBinaryProgram(SimulatorContext &context, const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    cerr << "Error: Failed to open input file " << path << endl;
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(ProgramHeader)) {
+    close(fd);
+    cerr << "Error: " << path << " is not a 3220X binary program" << endl;
+    return false;
+  }
+  size_t file_size = st.st_size;
+  void *mapping = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    cerr << "Error: Failed to map input file " << path << endl;
+    return false;
+  }
+  const unsigned char *file = (const unsigned char *) mapping;
+  context.program_mapping = mapping;
+  context.program_mapping_size = file_size;
+
+  ProgramHeader header;
+  memcpy(&header, file, sizeof(header));
+  uint64_t words_end = header.instructions_offset + (uint64_t) header.num_instructions * 4;
+  if (header.magic != PROGRAM_MAGIC || header.version != PROGRAM_VERSION ||
+      header.instructions_offset % 4 != 0 || words_end > file_size) {
+    cerr << "Error: " << path << " is not a 3220X binary program" << endl;
+    return false;
+  }
+
+  context.num_instructions = header.num_instructions;
+  const unsigned char *words = file + header.instructions_offset;
+  if (IsLittleEndianHost()) {
+    context.instruction_words = (const uint32_t *) words;
+  } else {
+    for (size_t i = 0; i < context.num_instructions; i++)
+      context.instruction_storage.push_back(ReadLittleEndian32(words + 4 * i));
+    context.instruction_words = context.instruction_storage.empty() ? NULL : &context.instruction_storage[0];
+  }
+
+  // The TraceOp section is in the writer's host layout; only use it if
+  // that layout matches ours and every op is in range. Otherwise
+  // PrepareProgram() decodes the instruction words again.
+  uint64_t trace_ops_end = header.trace_ops_offset +
+    (uint64_t) header.num_instructions * sizeof(TraceOp);
+  if (header.trace_op_size == sizeof(TraceOp) && IsLittleEndianHost() &&
+      header.trace_ops_offset % __alignof__(TraceOp) == 0 && trace_ops_end <= file_size) {
+    const TraceOp *trace_ops = (const TraceOp *) (file + header.trace_ops_offset);
+    if (ValidTraceOps(trace_ops, header.num_instructions)) {
+      context.trace_ops = trace_ops;
+      context.num_trace_ops = header.num_instructions;
+    } else {
+      cerr << "Warning: " << path << ": ignoring invalid decoded instructions" << endl;
+    }
+  }
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Load either program format, detected by the binary magic number
+////////////////////////////////////////////////////////////////////////
+bool LoadProgram(SimulatorContext &context, const char *path)
+{
+  ifstream infile(path, ios::binary);
+  if (!infile) {
+    cerr << "Error: Failed to open input file " << path << endl;
+    return false;
+  }
+  unsigned char magic[4] = { 0, 0, 0, 0 };
+  infile.read((char *) magic, sizeof(magic));
+  infile.close();
+
+  if (ReadLittleEndian32(magic) == PROGRAM_MAGIC)
+    return LoadBinaryProgram(context, path);
+  return LoadTextProgram(context, path);
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Write the loaded program in binary format, including the
+//       pre-decoded TraceOp section
+////////////////////////////////////////////////////////////////////////
+bool WriteBinaryProgram(SimulatorContext &context, const char *path)
+{
+  ofstream outfile(path, ios::binary);
+  if (!outfile) {
+    cerr << "Error: Failed to open output file " << path << endl;
+    return false;
+  }
+
+  ProgramHeader header;
+  memset(&header, 0x00, sizeof(header));
+  header.magic = PROGRAM_MAGIC;
+  header.version = PROGRAM_VERSION;
+  header.num_instructions = context.num_instructions;
+  header.instructions_offset = sizeof(ProgramHeader);
+  uint64_t words_end = header.instructions_offset + (uint64_t) context.num_instructions * 4;
+  header.trace_ops_offset = (words_end + 7) & ~(uint64_t) 7;
+  header.trace_op_size = sizeof(TraceOp);
+  outfile.write((const char *) &header, sizeof(header));
+
+  for (size_t i = 0; i < context.num_instructions; i++) {
+    unsigned char bytes[4];
+    for (int b = 0; b < 4; b++)
+      bytes[b] = (context.instruction_words[i] >> (8 * b)) & 0xff;
+    outfile.write((const char *) bytes, sizeof(bytes));
+  }
+  const char padding[8] = { 0 };
+  outfile.write(padding, header.trace_ops_offset - words_end);
+  outfile.write((const char *) context.trace_ops, context.num_trace_ops * sizeof(TraceOp));
+
+  outfile.close();
+  return !outfile.fail();
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Write the loaded program in the ASCII bitset format
+////////////////////////////////////////////////////////////////////////
+bool WriteTextProgram(SimulatorContext &context, const char *path)
+{
+  ofstream outfile(path);
+  if (!outfile) {
+    cerr << "Error: Failed to open output file " << path << endl;
+    return false;
+  }
+  for (size_t i = 0; i < context.num_instructions; i++)
+    outfile << bitset<sizeof(uint32_t)*CHAR_BIT>(context.instruction_words[i]) << "\n";
+
+  outfile.close();
+  return !outfile.fail();
+}
+
+static const unsigned char kZeroPage[MEMORY_IMAGE_PAGE_SIZE] = { 0 };
+
+////////////////////////////////////////////////////////////////////////
+// desc: Load the memory image that starts at image_offset in fd (see
+//       MemoryImageHeader). Whole pages are mapped copy-on-write, so
+//       they cost nothing until the program stores to them; unaligned
+//       sections and partial pages are copied.
+// input: allow_raw: treat data without the magic number as a raw image
+// output: false if the image is malformed or does not fit in memory
+////////////////////////////////////////////////////////////////////////
+static bool ReadMemoryImage(SimulatorContext &context, const int fd, const uint64_t image_offset,
+                            const uint64_t file_size, const bool allow_raw)
+{
+  if (image_offset > file_size)
+    return false;
+  vector<MemoryImageSection> sections;
+  MemoryImageHeader header;
+  if (file_size - image_offset >= sizeof(header) &&
+      pread(fd, &header, sizeof(header), image_offset) == sizeof(header) &&
+      header.magic == MEMORY_IMAGE_MAGIC) {
+    uint64_t table_size = (uint64_t) header.num_sections * sizeof(MemoryImageSection);
+    if (header.version != MEMORY_IMAGE_VERSION || sizeof(header) + table_size > file_size - image_offset)
+      return false;
+    sections.resize(header.num_sections);
+    if (table_size != 0 &&
+        pread(fd, &sections[0], table_size, image_offset + sizeof(header)) != (ssize_t) table_size)
+      return false;
+  } else if (allow_raw) {
+    MemoryImageSection raw = { 0, (uint32_t) min<uint64_t>(file_size - image_offset, UINT32_MAX), 0 };
+    sections.push_back(raw);
+  } else {
+    return false;
+  }
+
+  for (size_t i = 0; i < sections.size(); i++) {
+    const MemoryImageSection &section = sections[i];
+    uint64_t file_offset = image_offset + section.file_offset;
+    if ((uint64_t) section.address + section.size > context.memory.size() ||
+        file_offset + section.size > file_size)
+      return false;
+    size_t done = context.memory.MapFile(section.address, fd, file_offset, section.size);
+    while (done < section.size) {
+      ssize_t bytes = pread(fd, context.memory.base() + section.address + done,
+                            section.size - done, file_offset + done);
+      if (bytes <= 0)
+        return false;
+      done += bytes;
+    }
+    context.memory.MarkWritten(section.address, section.size);
+  }
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: Preload data memory from a memory image file
+// output: false if the file is unreadable or does not fit in memory
+////////////////////////////////////////////////////////////////////////
+bool LoadMemoryImage(SimulatorContext &context, const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0)
+      close(fd);
+    cerr << "Error: Failed to open memory image " << path << endl;
+    return false;
+  }
+  bool valid = ReadMemoryImage(context, fd, 0, st.st_size, true);
+  close(fd);
+  if (!valid)
+    cerr << "Error: " << path << " is not a valid memory image for "
+         << context.memory.size() << " bytes of data memory" << endl;
+  return valid;
+}
+
+// write(2) until done or an error 
+static bool WriteFully(const int fd, const void *data, size_t size)
+{
+  const char *bytes = (const char *) data;
+  while (size > 0) {
+    ssize_t written = write(fd, bytes, size);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return false;
+    bytes += written;
+    size -= written;
+  }
+  return true;
+}
+
+// Does the page go into an image of the pages with flag set? A full
+// image (MEMORY_PAGE_WRITTEN) leaves out written pages that are zero
+// again; an image of the MEMORY_PAGE_DIRTY pages must keep them, since
+// the image it is based on may not. 
+static bool InMemoryImage(const DataMemory &memory, const uint8_t flag, const uint64_t page)
+{
+  if ((memory.page_flags()[page] & flag) == 0)
+    return false;
+  return flag == MEMORY_PAGE_DIRTY ||
+    memcmp(memory.base() + (page << MEMORY_PAGE_SHIFT), kZeroPage, MEMORY_IMAGE_PAGE_SIZE) != 0;
+}
+
+// the first run of pages in the image at or after page; size 0 if
+// there is none 
+static MemoryImageSection NextMemoryRun(const DataMemory &memory, const uint8_t flag, uint64_t page)
+{
+  while (page < memory.num_pages() && !InMemoryImage(memory, flag, page))
+    page++;
+  MemoryImageSection run = { (uint32_t) (page << MEMORY_PAGE_SHIFT), 0, 0 };
+  while (page < memory.num_pages() && InMemoryImage(memory, flag, page))
+    page++;
+  run.size = (page << MEMORY_PAGE_SHIFT) - run.address;
+  return run;
+}
+
+#define FOR_EACH_MEMORY_RUN(run, memory, flag) \
+  for (MemoryImageSection run = NextMemoryRun(memory, flag, 0); run.size > 0; \
+       run = NextMemoryRun(memory, flag, ((uint64_t) run.address + run.size) >> MEMORY_PAGE_SHIFT))
+
+////////////////////////////////////////////////////////////////////////
+// desc: Write the pages of memory whose page_flags() have flag set
+//       as a memory image to fd, whose file offset must be a multiple
+//       of MEMORY_IMAGE_PAGE_SIZE: one section per run of such pages
+//       (see InMemoryImage()). Uses only write(2) and a few locals, so a
+//       forked checkpoint writer can call it: instead of keeping a
+//       section table, the flags are scanned once to count the runs,
+//       once to write their sections and once for the data.
+////////////////////////////////////////////////////////////////////////
+static bool WriteMemorySections(const DataMemory &memory, const uint8_t flag, const int fd)
+{
+  uint32_t num_sections = 0;
+  FOR_EACH_MEMORY_RUN(run, memory, flag)
+    num_sections++;
+
+  MemoryImageHeader header;
+  memset(&header, 0x00, sizeof(header));
+  header.magic = MEMORY_IMAGE_MAGIC;
+  header.version = MEMORY_IMAGE_VERSION;
+  header.num_sections = num_sections;
+  uint64_t table_end = sizeof(header) + (uint64_t) num_sections * sizeof(MemoryImageSection);
+  uint64_t data_begin = (table_end + MEMORY_IMAGE_PAGE_SIZE - 1) & ~(uint64_t) (MEMORY_IMAGE_PAGE_SIZE - 1);
+  if (!WriteFully(fd, &header, sizeof(header)))
+    return false;
+
+  uint64_t data_offset = data_begin;
+  FOR_EACH_MEMORY_RUN(run, memory, flag) {
+    MemoryImageSection section = run;
+    section.file_offset = data_offset;
+    data_offset += section.size;
+    if (!WriteFully(fd, &section, sizeof(section)))
+      return false;
+  }
+  if (num_sections > 0 && !WriteFully(fd, kZeroPage, data_begin - table_end))
+    return false;
+  FOR_EACH_MEMORY_RUN(run, memory, flag)
+    if (!WriteFully(fd, memory.base() + run.address, run.size))
+      return false;
+  return true;
+}
+
+#undef FOR_EACH_MEMORY_RUN
+
+////////////////////////////////////////////////////////////////////////
+// desc: Write data memory to path as a memory image
+////////////////////////////////////////////////////////////////////////
+bool WriteMemoryImage(SimulatorContext &context, const char *path)
+{
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    cerr << "Error: Failed to open output file " << path << endl;
+    return false;
+  }
+  bool written = WriteMemorySections(context.memory, MEMORY_PAGE_WRITTEN, fd);
+  if (close(fd) != 0)
+    written = false;
+  if (!written)
+    cerr << "Error: Failed to write " << path << endl;
+  return written;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Checkpoints
+// TakeCheckpoint() runs when the engine returns to RunEngine() at
+// next_checkpoint or on SIGUSR1: between two instructions, or between
+// two blocks on the block and JIT engines, so an image can land a few
+// instructions past its --checkpoint-every multiple. It copies the registers
+// into a CheckpointHeader and forks; the child writes the header and
+// its copy-on-write snapshot of data memory, then exits, while the
+// simulation carries on in the parent. At most CHECKPOINT_WRITERS
+// children run at once. The child only calls write(2) and friends: the
+// other threads of the process (GPU, trace and frame writers) are not
+// copied and may have held locks at the time of the fork.
+////////////////////////////////////////////////////////////////////////
+static void HandleCheckpointSignal(int)
+{
+  g_checkpoint_signaled = 1;
+}
+
+// --checkpoint-on-signal: SA_RESTART, so a SIGUSR1 does not fail the
+// blocking calls of the writer threads with EINTR. previous gets the
+// disposition main() puts back after the run. 
+static void InstallCheckpointSignalHandler(struct sigaction *previous)
+{
+  struct sigaction action;
+  memset(&action, 0x00, sizeof(action));
+  action.sa_handler = HandleCheckpointSignal;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGUSR1, &action, previous);
+}
+
+// FNV-1a over the instruction words, so a checkpoint is only restored
+// into the program it was taken from 
+static uint32_t ProgramHash(const SimulatorContext &context)
+{
+  uint32_t hash = 2166136261u;
+  const unsigned char *bytes = (const unsigned char *) context.instruction_words;
+  for (size_t i = 0; i < context.num_instructions * sizeof(uint32_t); i++)
+    hash = (hash ^ bytes[i]) * 16777619u;
+  return hash;
+}
 
-    case OP_VCOMPMOV:
-    {
-      int idx = trace_op.idx;
-      g_vector_registers[trace_op.vector_registers[0]].element[idx].float_value =
-        g_scalar_registers[trace_op.scalar_registers[0]].float_value;
-    }
-    break; 
+////////////////////////////////////////////////////////////////////////
+// desc: Write a checkpoint to temp_path, then rename it to path, so
+//       path never holds half a checkpoint. Async-signal-safe calls
+//       only (see above).
+// input: base_name: header.base_name_size bytes, the checkpoint the
+//        dirty pages are relative to; a full checkpoint writes every
+//        written page
+////////////////////////////////////////////////////////////////////////
+static bool WriteCheckpointFile(const CheckpointHeader &header, const char *base_name,
+                                const DataMemory &memory, const char *temp_path, const char *path)
+{
+  uint64_t padding = header.memory_image_offset - sizeof(header) - header.base_name_size;
+  uint8_t flag = header.base_name_size != 0 ? MEMORY_PAGE_DIRTY : MEMORY_PAGE_WRITTEN;
+  int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  bool written = fd >= 0 && WriteFully(fd, &header, sizeof(header)) &&
+    WriteFully(fd, base_name, header.base_name_size) && WriteFully(fd, kZeroPage, padding) &&
+    WriteMemorySections(memory, flag, fd);
+  if (fd >= 0 && close(fd) != 0)
+    written = false;
+  if (written && rename(temp_path, path) == 0)
+    return true;
+  unlink(temp_path);
+  static const char kMessage[] = "Error: Failed to write checkpoint ";
+  WriteFully(STDERR_FILENO, kMessage, sizeof(kMessage) - 1);
+  WriteFully(STDERR_FILENO, path, strlen(path));
+  WriteFully(STDERR_FILENO, "\n", 1);
+  return false;
+}
 
-    case OP_VCOMPMOVI:
-    {
-      int idx - trace_op.idx;
-      g_vector_registers[trace_op.vector_registers[0]].element[idx].float_value =
-        trace_op.float_value;
-    }
-    break;
-  
-    case OP_LDB: 
-    {
-      int address = g_scalar_registers[trace_op.scalar_registers[1]].int_value
-        + trace_op.int_value;
-      memcpy(&g_scalar_registers[trace_op.scalar_registers[0]],
-        &g_memory[address], sizeof(int8_t));
+////////////////////////////////////////////////////////////////////////
+// desc: Reap finished checkpoint writers, waiting for the oldest ones
+//       until at most max_running are left. A writer that failed sets
+//       context.checkpoint_failed, which ends checkpointing for the run.
+////////////////////////////////////////////////////////////////////////
+static void ReapCheckpointWriters(SimulatorContext &context, const size_t max_running)
+{
+  vector<int> &writers = context.checkpoint_writers;
+  for (size_t i = 0; i < writers.size();) {
+    int status = 0;
+    pid_t pid = waitpid(writers[i], &status, writers.size() > max_running ? 0 : WNOHANG);
+    if (pid == 0) {
+      i++;
+      continue;
     }
-    break;
+    if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      context.checkpoint_failed = true;
+    writers.erase(writers.begin() + i);
+  }
+}
 
-    case OP_LDW:
-    {
-      int address = g_scalar_registers[trace_op.scalar_registers[1]].int_value
-        + trace_op.int_value;
-      memcpy(&g_scalar_registers[trace_op.scalar_registers[0]],
-        &g_memory[address], sizeof(int16_t));
-    }
-    break;
+static void TakeCheckpoint(SimulatorContext &context)
+{
+  const CheckpointControl &control = g_checkpoint_control;
+  g_checkpoint_signaled = 0;
+  if (context.next_checkpoint != 0 && context.instruction_count >= context.next_checkpoint)
+    context.next_checkpoint = (context.instruction_count / control.interval + 1) * control.interval;
+  if (context.program_halt == 1)  // the PC is already past HALT 
+    return;
+  ReapCheckpointWriters(context, CHECKPOINT_WRITERS - 1);
+  if (context.checkpoint_failed)  // the writer reported it, keep simulating 
+    return;
 
-    case OP_STB:
-    {
-      int address = g_scalar_registers[trace_op.scalar_registers[1]].int_value
-        + trace_op.int_value;
-      memcpy(&g_memory[address], 
-        &g_scalar_registers[trace_op.scalar_registers[0]], sizeof(int8_t));
-    }
-    break;
+  CheckpointHeader header;
+  memset(&header, 0x00, sizeof(header));
+  header.magic = CHECKPOINT_MAGIC;
+  header.version = CHECKPOINT_VERSION;
+  header.num_instructions = context.num_instructions;
+  header.program_hash = ProgramHash(context);
+  header.instruction_count = context.instruction_count;
+  header.vertex_id = context.vertex_id;
+  header.condition_code_register.int_value = ConditionCode(context);
+  header.gpu_status_register = context.gpu_status_register;
+  memcpy(header.scalar_registers, context.scalar_registers, sizeof(header.scalar_registers));
+  memcpy(header.vector_registers, context.vector_registers, sizeof(header.vector_registers));
 
- 
-    case OP_STW:
-    {
-      int address = g_scalar_registers[trace_op.scalar_registers[1]].int_value
-        + trace_op.int_value;
-      memcpy(&g_memory[address], 
-        &g_scalar_registers[trace_op.scalar_registers[0]], sizeof(int16_t));
-    }
-    break;
+  char path[PATH_MAX];
+  char temp_path[PATH_MAX + 16];  // path.tmp<instruction count> 
+  if (IsFramePattern(control.path))
+    snprintf(path, sizeof(path), control.path, context.instruction_count);
+  else
+    snprintf(path, sizeof(path), "%s", control.path);
+  snprintf(temp_path, sizeof(temp_path), "%s.tmp%u", path, context.instruction_count);
 
+  // only the pages stored to since the last checkpoint, unless this
+  // starts a new chain 
+  if (context.checkpoint_chain == CHECKPOINT_CHAIN_LENGTH)
+    context.checkpoint_base.clear();
+  if (context.checkpoint_base.empty())
+    context.checkpoint_chain = 0;
+  header.base_name_size = context.checkpoint_base.size();
+  header.memory_image_offset = (sizeof(header) + header.base_name_size + MEMORY_IMAGE_PAGE_SIZE - 1) &
+    ~(uint64_t) (MEMORY_IMAGE_PAGE_SIZE - 1);
+  const char *base_name = context.checkpoint_base.c_str();
 
-    case OP_SETVERTEX:
-    {
-      float x_value =
-        g_vector_registers[(trace_op.vector_registers[0])].element[1].float_value;
-      float y_value =
-        g_vector_registers[(trace_op.vector_registers[0])].element[2].float_value;
-      float z_value =
-        g_vector_registers[(trace_op.vector_registers[0])].element[3].float_value;
-    }
-    break;
+  pid_t pid = fork();
+  if (pid == 0)
+    _exit(WriteCheckpointFile(header, base_name, context.memory, temp_path, path) ? 0 : 1);
+  if (pid > 0)
+    context.checkpoint_writers.push_back(pid);
+  else if (!WriteCheckpointFile(header, base_name, context.memory, temp_path, path))  // no fork: write in place 
+    context.checkpoint_failed = true;
 
-    case OP_SETCOLOR:
-    {
-      int r_value = 
-        (int) g_vector_registers[(trace_op.vector_registers[0])].element[0].float_value;
-      int g_value = 
-        (int) g_vector_registers[(trace_op.vector_registers[0])].element[1].float_value;
-      int b_value = 
-        (int) g_vector_registers[(trace_op.vector_registers[0])].element[2].float_value;
-    }
-    break;
+  // the next checkpoint can only name this one if it is a different
+  // file in the same directory: the pattern has its %u in the file name 
+  const char *pattern_name = strrchr(control.path, '/');
+  const char *name = strrchr(path, '/');
+  name = name != NULL ? name + 1 : path;
+  bool same_directory = IsFramePattern(control.path) &&
+    (pattern_name == NULL || memchr(control.path, '%', pattern_name - control.path) == NULL);
+  context.memory.ClearDirtyPages();
+  context.checkpoint_base = same_directory ? name : "";
+  context.checkpoint_chain++;
+}
 
-    case OP_ROTATE:  // optional
-    {
-      float angle = 
-        g_vector_registers[(trace_op.vector_registers[0])].element[0].float_value;
-      float z_value =
-        g_vector_registers[(trace_op.vector_registers[0])].element[3].float_value;
-    }
-    break; 
+////////////////////////////////////////////////////////////////////////
+// desc: Open the checkpoint at path and load its memory image, after
+//       those of the checkpoints it is based on (at most depth more)
+// output: false (reported) if one of them is missing, corrupt or not a
+//         checkpoint of this program; *header: the header of path
+////////////////////////////////////////////////////////////////////////
+static bool ReadCheckpoint(SimulatorContext &context, const char *path, const unsigned int depth,
+                           CheckpointHeader *header)
+{
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0)
+      close(fd);
+    cerr << "Error: Failed to open checkpoint " << path << endl;
+    return false;
+  }
 
-    case OP_TRANSLATE:
-    {
-      float x_value = 
-        g_vector_registers[(trace_op.vector_registers[0])].element[1].float_value;
-      float y_value = 
-        g_vector_registers[(trace_op.vector_registers[0])].element[2].float_value;
-    }
-    break;
- 
-    case OP_SCALE:  // optional
-    {
-      float x_value =
-        g_vector_registers[(trace_op.vector_registers[0])].element[1].float_value;
-      float y_valie =
-        g_vector_registers[(trace_op.vector_registers[0])].element[2].float_value;
+  if (pread(fd, header, sizeof(*header), 0) != sizeof(*header) ||
+      header->magic != CHECKPOINT_MAGIC || header->version != CHECKPOINT_VERSION) {
+    close(fd);
+    cerr << "Error: " << path << " is not a checkpoint" << endl;
+    return false;
+  }
+  if (header->num_instructions != context.num_instructions || header->program_hash != ProgramHash(context) ||
+      (uint32_t) header->scalar_registers[PC_IDX].int_value >= context.num_trace_ops) {
+    close(fd);
+    cerr << "Error: Checkpoint " << path << " was taken from a different program" << endl;
+    return false;
+  }
+
+  if (header->base_name_size == 0) {
+    context.memory.Clear();
+  } else {
+    // the base is named relative to the directory of path 
+    char base_path[PATH_MAX];
+    const char *name = strrchr(path, '/');
+    size_t directory_size = name != NULL ? name + 1 - path : 0;
+    bool named = depth > 0 && directory_size + header->base_name_size < sizeof(base_path) &&
+      pread(fd, base_path + directory_size, header->base_name_size, sizeof(*header)) ==
+        (ssize_t) header->base_name_size;
+    if (!named) {
+      close(fd);
+      cerr << "Error: Checkpoint " << path << " has a corrupt base checkpoint name" << endl;
+      return false;
     }
-    break;
- 
-    case OP_PUSHMATRIX:       // deprecated
-    {
+    memcpy(base_path, path, directory_size);
+    base_path[directory_size + header->base_name_size] = '\0';
+    CheckpointHeader base_header;
+    if (!ReadCheckpoint(context, base_path, depth - 1, &base_header)) {
+      close(fd);
+      return false;
     }
-    break;
- 
-    case OP_POPMATRIX:   // deprecated
-    {
-    }   
-    break; 
+  }
 
-    case OP_BEGINPRIMITIVE: //todo
-    {
-    }
-    break;
+  bool valid = ReadMemoryImage(context, fd, header->memory_image_offset, st.st_size, false);
+  close(fd);
+  if (!valid)
+    cerr << "Error: Checkpoint " << path << " has a corrupt memory image" << endl;
+  return valid;
+}
 
-    case OP_ENDPRIMITIVE:  //todo
-    {
-    }
-    break;
+////////////////////////////////////////////////////////////////////////
+// desc: Continue the loaded program from a checkpoint: registers, PC,
+//       instruction count and data memory are replaced by its contents
+// output: false if the file is not a checkpoint of this program
+////////////////////////////////////////////////////////////////////////
+bool RestoreCheckpoint(SimulatorContext &context, const char *path)
+{
+  CheckpointHeader header;
+  if (!ReadCheckpoint(context, path, CHECKPOINT_CHAIN_LENGTH - 1, &header))
+    return false;
 
-    case OP_LOADIDENTITY:  // deprecated 
-    {
-    }
-    break;
+  context.instruction_count = header.instruction_count;
+  context.vertex_id = header.vertex_id;
+  context.condition_code_register = header.condition_code_register;
+  context.condition_code_pending.unresolved = false;
+  context.gpu_status_register = header.gpu_status_register;
+  memcpy(context.scalar_registers, header.scalar_registers, sizeof(header.scalar_registers));
+  memcpy(context.vector_registers, header.vector_registers, sizeof(header.vector_registers));
+  memcpy(context.gpu_vertex_registers, header.gpu_vertex_registers, sizeof(header.gpu_vertex_registers));
+  context.current_pc = context.scalar_registers[PC_IDX].int_value;
+  return true;
+}
 
-    case OP_FLUSH: //todo
-    {
-    }
-    break;
+////////////////////////////////////////////////////////////////////////
+// desc: Reset context and load, then decode, the program at path; then
+//       preload g_memory_image, if any
+////////////////////////////////////////////////////////////////////////
+bool PrepareProgram(SimulatorContext &context, const char *path)
+{
+  InitializeContext(context);
+  if (g_memory_image != NULL && !LoadMemoryImage(context, g_memory_image))
+    return false;
 
-    case OP_DRAW:  //todo
-    {
-    }
-    break;
+  // text or binary (ProgramHeader) format 
+  if (!LoadProgram(context, path))
+    return false;
 
-    case OP_BRN:
-    {
-      if (g_condition_code_register.int_value == 0x01)
-      ret_next_instruction_idx = trace_op.int_value;
-    }
-    break;
- 
-    case OP_BRZ:
-    {
-      if (g_condition_code_register.int_value == 0x02)
-      ret_next_instruction_idx = trace_op.int_value;
-    }
-    break;
- 
-    case OP_BRP:
-    {
-      if (g_condition_code_register.int_value == 0x04)
-      ret_next_instruction_idx = trace_op.int_value;
-    }
-    break;
- 
-    case OP_BRNZ:
-    {
-      if (g_condition_code_register.int_value == 0x03)
-      ret_next_instruction_idx = trace_op.int_value;
-    }
-    break;
- 
-    case OP_BRNP:
-    {
-      if (g_condition_code_register.int_value == 0x05)
-      ret_next_instruction_idx = trace_op.int_value;
-    }
-    break;
- 
-    case OP_BRZP:
-    {
-      if (g_condition_code_register.int_value == 0x06)
-      ret_next_instruction_idx = trace_op.int_value;
-    }
-    break;
- 
-    case OP_BRNZP:
-    {
-      if (g_condition_code_register.int_value == 0x07)
-      ret_next_instruction_idx = trace_op.int_value;
-    }
-    break;
- 
-    case OP_JMP:
-    {
-      if (g_scalar_registers[trace_op.scalar_registers[0]].int_value == 0x07)
-        ret_next_instruction_idx = g_scalar_registers[LR_IDX].int_value;
+  ostream &out = *context.trace_out;
+  if (g_trace_control.text) {
+    out << "The contents of the instruction vectors are :" << endl;
+    for (size_t i = 0; i < context.num_instructions; i++)
+      out << "  " << bitset<sizeof(uint32_t)*CHAR_BIT>(context.instruction_words[i]) << endl;
+  }
+
+  // binary programs may already carry a decoded section 
+  if (context.trace_ops == NULL) {
+    context.trace_op_storage.reserve(context.num_instructions);
+    for (size_t i = 0; i < context.num_instructions; i++)
+      context.trace_op_storage.push_back(DecodeInstruction(context.instruction_words[i]));
+    context.trace_ops = context.trace_op_storage.empty() ? NULL : &context.trace_op_storage[0];
+    context.num_trace_ops = context.trace_op_storage.size();
+  }
+
+  if (g_trace_control.text) {
+    out << "The contents of the g_trace_ops vectors are :" << endl;
+    for (size_t i = 0; i < context.num_trace_ops; i++)
+      PrintTraceOp(context, context.trace_ops[i]);
+  }
+  return true;
+}
+
+////////////////////////////////////////////////////////////////////////
+// Memory faults
+// While RunEngine() runs a program, t_memory_fault_guard points at its
+// jump buffer. An LDx/STx that leaves data memory touches a guard range
+// of the context's DataMemory and raises SIGSEGV; the handler jumps back
+// into RunEngine(), which stops the program at the faulting PC and
+// recomputes the address from its base register, since a bad access
+// always lands at the start of the guard. Any other SIGSEGV gets the
+// default action. No engine frame between the two may own an
+// object with a destructor.
+////////////////////////////////////////////////////////////////////////
+#ifdef HAVE_GUARDED_MEMORY
+typedef struct MemoryFaultGuard_ {
+  sigjmp_buf jump;
+  const DataMemory *memory;
+  uintptr_t fault_ip;                   // host instruction, 0 if unknown 
+} MemoryFaultGuard;
+
+static thread_local MemoryFaultGuard *t_memory_fault_guard = NULL;
+
+static void HandleMemoryFault(int signal_number, siginfo_t *info, void *ucontext)
+{
+  MemoryFaultGuard *guard = t_memory_fault_guard;
+  if (guard == NULL || !guard->memory->InGuardedRange(info->si_addr)) {
+    signal(signal_number, SIG_DFL);  // not a simulated access: fault again, fatally 
+    return;
+  }
+#if defined(__linux__) && defined(__x86_64__)
+  guard->fault_ip = ((ucontext_t *) ucontext)->uc_mcontext.gregs[REG_RIP];
+#else
+  guard->fault_ip = 0;
+#endif
+  siglongjmp(guard->jump, 1);
+}
+
+static void InstallMemoryFaultHandler()
+{
+  struct sigaction action;
+  memset(&action, 0x00, sizeof(action));
+  action.sa_sigaction = HandleMemoryFault;
+  action.sa_flags = SA_SIGINFO;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGSEGV, &action, NULL);
+  sigaction(SIGBUS, &action, NULL);
+}
+
+////////////////////////////////////////////////////////////////////////
+// desc: PC of the LDx/STx that faulted. Compiled blocks do not update
+//       the PC register per instruction, so a fault inside JIT code is
+//       looked up in context.jit_memory_ops.
+////////////////////////////////////////////////////////////////////////
+static int FaultingPc(const SimulatorContext &context, const uintptr_t fault_ip)
+{
+  uintptr_t jit_begin = (uintptr_t) context.jit_code;
+  if (context.jit_code != NULL && fault_ip >= jit_begin &&
+      fault_ip < jit_begin + context.jit_code_used) {
+    const vector<JitMemoryOp> &ops = context.jit_memory_ops;
+    size_t offset = fault_ip - jit_begin;
+    size_t lo = 0, hi = ops.size();  // find the last op at or before offset 
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if (ops[mid].code_offset <= offset)
+        lo = mid + 1;
       else
-        ret_next_instruction_idx = g_scalar_registers[trace_op.scalar_registers[0]].int_value;
+        hi = mid;
     }
-    break;
+    if (lo > 0)
+      return ops[lo - 1].pc;
+  }
+  return context.scalar_registers[PC_IDX].int_value;
+}
+#endif
 
-    case OP_JSR:
-    {
-      ret_next_instruction_idx = trace_op.int_value;
-    }
-    break;
- 
-    case OP_JSRR:
-    {
-      ret_next_instruction_idx = g_scalar_registers[trace_op.scalar_registers[0]].int_value;
-    } 
-    break; 
-      
-    case OP_HALT: 
-      g_program_halt = 1; 
-      break; 
+////////////////////////////////////////////////////////////////////////
+// desc: Run the loaded program on g_execution_engine (or sampled, see
+//       RunSampledEngine()) until HALT or a memory fault, which sets
+//       context.memory_faulted. The engine returns to take a checkpoint
+//       at next_checkpoint or on SIGUSR1, then carries on where it
+//       stopped.
+////////////////////////////////////////////////////////////////////////
+static void RunEngine(SimulatorContext &context, const bool tracing)
+{
+#ifdef HAVE_GUARDED_MEMORY
+  static once_flag handler_installed;
+  call_once(handler_installed, InstallMemoryFaultHandler);
 
-    default:
-    break;
-    }
+  MemoryFaultGuard guard;
+  guard.memory = &context.memory;
+  t_memory_fault_guard = &guard;
+  if (sigsetjmp(guard.jump, 1) != 0) {
+    t_memory_fault_guard = NULL;
+    int pc = FaultingPc(context, guard.fault_ip);
+    const TraceOp &trace_op = context.trace_ops[pc];
+    uint8_t opcode = trace_op.opcode;
+    int base_idx = trace_op.scalar_registers[1];
+    context.current_pc = pc;
+    context.scalar_registers[PC_IDX].int_value = pc;
+    context.memory_faulted = true;
+    context.memory_fault_address = EffectiveAddress(context.scalar_registers[base_idx].int_value,
+                                                    trace_op.int_value);
+    context.program_halt = 1;
+    cerr << "memory fault: " << ((opcode == OP_STB || opcode == OP_STW) ? "store to" : "load from")
+         << " address " << context.memory_fault_address << " at PC " << (pc << 2)
+         << " (instruction " << pc << ")" << endl;
+    return;
+  }
+#endif
 
-  return ret_next_instruction_idx;
+  ClearBlockCache(context);
+  while (context.program_halt != 1) {
+    // UINT64_MAX: instruction_count is 32 bits, so the engine never stops 
+    // early and the count wraps as it always has 
+    uint64_t stop_count = context.next_checkpoint != 0 ? context.next_checkpoint : UINT64_MAX;
+    if (SamplingEnabled())
+      RunSampledEngine(context, tracing);
+    else if (tracing)
+      RunSelectedEngine<true, false>(context, stop_count);
+    else
+      RunSelectedEngine<false, false>(context, stop_count);
+    if (context.program_halt != 1)
+      TakeCheckpoint(context);
+  }
+
+#ifdef HAVE_GUARDED_MEMORY
+  t_memory_fault_guard = NULL;
+#endif
 }
 
 ////////////////////////////////////////////////////////////////////////
-// desc: Dump given trace_op
+// desc: Run the loaded program until HALT, from PC 0 or from where
+//       RestoreCheckpoint() left it
 ////////////////////////////////////////////////////////////////////////
-void PrintTraceOp(const TraceOp &trace_op) 
-{  
-  cout << "  opcode: " << SignExtension(trace_op.opcode);
-  cout << ", scalar_register[0]: " << (int) trace_op.scalar_registers[0];
-  cout << ", scalar_register[1]: " << (int) trace_op.scalar_registers[1];
-  cout << ", scalar_register[2]: " << (int) trace_op.scalar_registers[2];
-  cout << ", vector_register[0]: " << (int) trace_op.vector_registers[0];
-  cout << ", vector_register[1]: " << (int) trace_op.vector_registers[1];
-  cout << ", idx: " << (int) trace_op.idx;
-  cout << ", primitive_index: " << (int) trace_op.primitive_type;
-  cout << ", int_value: " << (int) SignExtension(trace_op.int_value) << endl; 
-  //c  cout << ", float_value: " << (float) trace_op.float_value << endl;
+void ExecuteProgram(SimulatorContext &context)
+{
+  const CheckpointControl &checkpoints = g_checkpoint_control;
+  if (checkpoints.path != NULL && checkpoints.interval != 0)
+    context.next_checkpoint = (context.instruction_count / checkpoints.interval + 1) * checkpoints.interval;
+
+  GpuCommandQueue gpu_queue;
+  if (g_gpu_async) {
+    bool has_graphics = false;
+    for (size_t i = 0; i < context.num_trace_ops && !has_graphics; i++)
+      has_graphics = OpcodeClass(context.trace_ops[i].opcode) == TRACE_CLASS_GRAPHICS;
+    if (has_graphics) {
+      gpu_queue.Start(&context);
+      context.gpu_queue = &gpu_queue;
+    }
+  }
+
+  bool tracing = g_trace_control.text || context.trace_sink != NULL;
+  RunEngine(context, tracing);
+  ReapCheckpointWriters(context, 0);
+
+  if (context.gpu_queue != NULL) {
+    gpu_queue.Finish();
+    context.gpu_queue = NULL;
+  }
+
+  if (SamplingEnabled())
+    PrintSampleStats(context);
+  if (g_depth_test && context.frame_count > 0) {
+    const DepthStats &stats = context.depth_stats;
+    cerr << "depth: " << stats.tiles_rejected << " triangle tiles and " << stats.blocks_rejected
+         << " blocks rejected by hierarchical Z, " << stats.pixels_failed << " of "
+         << stats.pixels_tested << " tested pixels failed" << endl;
+  }
 }
 
 ////////////////////////////////////////////////////////////////////////
-// desc: This function is called every trace is executed
-//       to provide the contents of all the registers
+// Batch mode: many programs on a pool of worker threads, one
+// SimulatorContext per worker reused for every program it picks up
 ////////////////////////////////////////////////////////////////////////
-void PrintContext(const TraceOp &current_op)
+typedef struct BatchState_ {
+  const vector<const char *> *inputs;
+  atomic<size_t> next_input;
+  atomic<int> num_failed;               // failed to load or faulted 
+  mutex report_mutex;
+} BatchState;
+
+void BatchWorker(BatchState *batch)
 {
+  SimulatorContext *context = new SimulatorContext();
+  for (;;) {
+    size_t input_idx = batch->next_input.fetch_add(1);
+    if (input_idx >= batch->inputs->size())
+      break;
+    const char *input_file = (*batch->inputs)[input_idx];
 
-  cout << "--------------------------------------------------" << endl;
-  cout << "3220X-Instruction Count: " << g_instruction_count
-       << " C_PC: " << (g_current_pc *4)
-       << " C_PC_IND: " << g_current_pc 
-       << ", Curr_Opcode: " << current_op.opcode
-       << " NEXT_PC: " << ((g_scalar_registers[PC_IDX].int_value)<<2) 
-       << " NEXT_PC_IND: " << (g_scalar_registers[PC_IDX].int_value)
-       << ", Next_Opcode: " << g_trace_ops[g_scalar_registers[PC_IDX].int_value].opcode 
-       << endl;
-  cout <<"3220X-"; 
-  for (int srIdx = 0; srIdx < NUM_SCALAR_REGISTER; srIdx++) {
-    cout << "R" << srIdx << ":" 
-         << ((srIdx < 8 || srIdx == 15) ? SignExtension(g_scalar_registers[srIdx].int_value) : (float) FIXED_TO_FLOAT1114(g_scalar_registers[srIdx].int_value)) 
-         << (srIdx == NUM_SCALAR_REGISTER-1 ? "" : ", ");
+    ofstream trace_file;
+    if (g_trace_control.text) {
+      trace_file.open((string(input_file) + ".trace").c_str());
+      context->trace_out = &trace_file;
+    }
+    bool loaded = PrepareProgram(*context, input_file);
+    if (loaded)
+      ExecuteProgram(*context);
+    if (!loaded || context->memory_faulted)
+      batch->num_failed++;
+    context->trace_out = &cout;
+
+    lock_guard<mutex> lock(batch->report_mutex);
+    cout << input_file << ": "
+         << (!loaded ? "failed to load" : context->memory_faulted ? "memory fault" : "halted") << endl;
   }
+  delete context;
+}
 
-  cout << " CC :N: " << ((g_condition_code_register.int_value &0x4) >>2) << " Z: " 
-       << ((g_condition_code_register.int_value &0x2) >>1) << " P: " << (g_condition_code_register.int_value &0x1) << "  "; 
-  cout << " draw: " << (g_gpu_status_register.int_value &0x01) << " fush: " << ((g_gpu_status_register.int_value & 0x2)>>1) ;
-  cout << " prim_type: "<< ((g_gpu_status_register.int_value & 0x4) >> 2)  << " "; 
-   
-  cout << endl;
-  
-  // for (int vrIdx = 0; vrIdx < NUM_VECTOR_REGISTER; vrIdx++) {
-  
-  for (int vrIdx = 0; vrIdx < 6; vrIdx++) {
-    cout <<"3220X-"; 
-    cout << "V" << vrIdx << ":";
-    for (int elmtIdx = 0; elmtIdx < NUM_VECTOR_ELEMENTS; elmtIdx++) { 
-      cout << "Element[" << elmtIdx << "] = " 
-           << (float)FIXED_TO_FLOAT1114(g_vector_registers[vrIdx].element[elmtIdx].int_value) 
-           << (elmtIdx == NUM_VECTOR_ELEMENTS-1 ? "" : ",");
-    }
-    cout << endl;
-  }
-  cout << endl;
-  cout <<"3220X-"; 
-  cout <<" vertices P1_X: " << g_gpu_vertex_registers[0].x_value; 
-  cout <<" vertices P1_Y: " << g_gpu_vertex_registers[0].y_value; 
-  cout <<" r: " << g_gpu_vertex_registers[0].r_value; 
-  cout <<" g: " << g_gpu_vertex_registers[0].g_value; 
-  cout <<" b: " << g_gpu_vertex_registers[0].b_value; 
-  cout <<" P2_X: " << g_gpu_vertex_registers[1].x_value; 
-  cout <<" P2_Y: " << g_gpu_vertex_registers[1].y_value; 
-  cout <<" r: " << g_gpu_vertex_registers[1].r_value; 
-  cout <<" g: " << g_gpu_vertex_registers[1].g_value; 
-  cout <<" b: " << g_gpu_vertex_registers[1].b_value; 
-  cout <<" P3_X: " << g_gpu_vertex_registers[2].x_value; 
-  cout <<" P3_Y: " << g_gpu_vertex_registers[2].y_value; 
-  cout <<" r: " << g_gpu_vertex_registers[2].r_value; 
-  cout <<" g: " << g_gpu_vertex_registers[2].g_value; 
-  cout <<" b: " << g_gpu_vertex_registers[2].b_value << endl; 
-  
-  cout << "--------------------------------------------------" << endl;
+////////////////////////////////////////////////////////////////////////
+// desc: Run every program in inputs on g_num_threads workers.
+//       --trace output goes to <input>.trace instead of stdout.
+// output: number of programs that failed to load or faulted
+////////////////////////////////////////////////////////////////////////
+int RunBatch(const vector<const char *> &inputs)
+{
+  int num_threads = g_num_threads;
+  if (num_threads <= 0)
+    num_threads = max(1u, thread::hardware_concurrency());
+  num_threads = min(num_threads, (int) inputs.size());
+
+  BatchState batch;
+  batch.inputs = &inputs;
+  batch.next_input = 0;
+  batch.num_failed = 0;
+
+  vector<thread> workers;
+  for (int i = 0; i < num_threads; i++)
+    workers.push_back(thread(BatchWorker, &batch));
+  for (size_t i = 0; i < workers.size(); i++)
+    workers[i].join();
+  return batch.num_failed;
 }
 
 int main(int argc, char **argv) 
 {
   ///////////////////////////////////////////////////////////////
-  // Initialize Global Variables
+  // Parse Options
   ///////////////////////////////////////////////////////////////
   //
-  InitializeGlobalVariables();
+  vector<const char *> input_files;
+  vector<string> listed_files;
+  const char *binary_output_file = NULL;
+  const char *text_output_file = NULL;
+  const char *binary_trace_file = NULL;
+  const char *render_trace_file = NULL;
+  const char *expand_trace_file = NULL;
+  const char *frame_output = NULL;
+  const char *memory_dump_file = NULL;
+  const char *restore_file = NULL;
+  FrameFormat frame_format = FRAME_PPM;
+  bool raster_bench = false;
+  bool usage_error = false;
+  for (int i = 1; i < argc && !usage_error; i++) {
+    if (strcmp(argv[i], "--to-binary") == 0 && i + 1 < argc) {
+      binary_output_file = argv[++i];
+    } else if (strcmp(argv[i], "--to-text") == 0 && i + 1 < argc) {
+      text_output_file = argv[++i];
+    } else if (strcmp(argv[i], "--binary-trace") == 0 && i + 1 < argc) {
+      binary_trace_file = argv[++i];
+    } else if (strcmp(argv[i], "--render-trace") == 0 && i + 1 < argc) {
+      render_trace_file = argv[++i];
+    } else if (strcmp(argv[i], "--trace") == 0) {
+      g_trace_control.text = true;
+    } else if (strcmp(argv[i], "--trace-delta") == 0 && i + 1 < argc) {
+      g_trace_control.text = true;
+      g_trace_control.delta_keyframe_interval = strtoul(argv[++i], NULL, 10);
+      if (g_trace_control.delta_keyframe_interval == 0)
+        usage_error = true;
+    } else if (strcmp(argv[i], "--expand-trace") == 0 && i + 1 < argc) {
+      expand_trace_file = argv[++i];
+    } else if (strcmp(argv[i], "--trace-pc") == 0 && i + 1 < argc) {
+      if (sscanf(argv[++i], "%u:%u", &g_trace_control.pc_low, &g_trace_control.pc_high) != 2)
+        usage_error = true;
+    } else if (strcmp(argv[i], "--trace-ops") == 0 && i + 1 < argc) {
+      if (!ParseOpcodeClasses(argv[++i], &g_trace_control.opcode_classes)) {
+        cerr << "Error: Unknown opcode class in " << argv[i] << endl;
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--trace-start") == 0 && i + 1 < argc) {
+      g_trace_control.start_count = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--trace-stop") == 0 && i + 1 < argc) {
+      g_trace_control.stop_count = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--trace-when") == 0 && i + 1 < argc) {
+      int reg = -1;
+      if (sscanf(argv[++i], "R%d=%d", &reg, &g_trace_control.trigger_value) != 2 ||
+          reg < 0 || reg >= NUM_SCALAR_REGISTER)
+        usage_error = true;
+      g_trace_control.trigger_register = reg;
+    } else if (strcmp(argv[i], "--trace-on-first") == 0 && i + 1 < argc) {
+      g_trace_control.trigger_opcode = OpcodeByName(argv[++i]);
+      if (g_trace_control.trigger_opcode < 0) {
+        cerr << "Error: Unknown opcode " << argv[i] << endl;
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--raster-bench") == 0) {
+      raster_bench = true;
+    } else if (strcmp(argv[i], "--ppm-frames") == 0 && i + 1 < argc) {
+      frame_output = argv[++i];
+      frame_format = FRAME_PPM;
+    } else if (strcmp(argv[i], "--y4m") == 0 && i + 1 < argc) {
+      frame_output = argv[++i];
+      frame_format = FRAME_Y4M;
+    } else if (strcmp(argv[i], "--depth-test") == 0) {
+      g_depth_test = true;
+    } else if (strcmp(argv[i], "--memory-size") == 0 && i + 1 < argc) {
+      if (!ParseMemorySize(argv[++i], &g_memory_size)) {
+        cerr << "Error: --memory-size must be a power of 2 from 4K to 2G, not " << argv[i] << endl;
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--memory-image") == 0 && i + 1 < argc) {
+      g_memory_image = argv[++i];
+    } else if (strcmp(argv[i], "--dump-memory") == 0 && i + 1 < argc) {
+      memory_dump_file = argv[++i];
+    } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+      g_checkpoint_control.path = argv[++i];
+    } else if (strcmp(argv[i], "--checkpoint-every") == 0 && i + 1 < argc) {
+      g_checkpoint_control.interval = strtoul(argv[++i], NULL, 10);
+      if (g_checkpoint_control.interval == 0)
+        usage_error = true;
+    } else if (strcmp(argv[i], "--checkpoint-on-signal") == 0) {
+      g_checkpoint_control.on_signal = true;
+    } else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+      restore_file = argv[++i];
+    } else if (strcmp(argv[i], "--sample-period") == 0 && i + 1 < argc) {
+      g_sample_control.period = strtoul(argv[++i], NULL, 10);
+      if (g_sample_control.period == 0)
+        usage_error = true;
+    } else if (strcmp(argv[i], "--sample-at") == 0 && i + 1 < argc) {
+      stringstream stream(argv[++i]);
+      string point;
+      while (getline(stream, point, ','))
+        g_sample_control.points.push_back(strtoul(point.c_str(), NULL, 10));
+      sort(g_sample_control.points.begin(), g_sample_control.points.end());
+      if (g_sample_control.points.empty())
+        usage_error = true;
+    } else if (strcmp(argv[i], "--sample-window") == 0 && i + 1 < argc) {
+      g_sample_control.window = strtoul(argv[++i], NULL, 10);
+      if (g_sample_control.window == 0)
+        usage_error = true;
+    } else if (strcmp(argv[i], "--gpu-async") == 0) {
+      g_gpu_async = true;
+    } else if (strcmp(argv[i], "--gpu-threads") == 0 && i + 1 < argc) {
+      g_gpu_threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      g_num_threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+      ifstream list_file(argv[++i]);
+      if (!list_file) {
+        cerr << "Error: Failed to open program list " << argv[i] << endl;
+        return 1;
+      }
+      string line;
+      while (getline(list_file, line))
+        if (!line.empty())
+          listed_files.push_back(line);
+    } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+      const char *engine = argv[++i];
+      if (strcmp(engine, "switch") == 0)
+        g_execution_engine = ENGINE_SWITCH;
+      else if (strcmp(engine, "threaded") == 0)
+        g_execution_engine = ENGINE_THREADED;
+      else if (strcmp(engine, "block") == 0)
+        g_execution_engine = ENGINE_BLOCK;
+      else if (strcmp(engine, "jit") == 0)
+        g_execution_engine = ENGINE_JIT;
+      else {
+        cerr << "Error: Unknown execution engine " << engine << endl;
+        return 1;
+      }
+    } else if (argv[i][0] != '-') {
+      input_files.push_back(argv[i]);
+    } else {
+      usage_error = true;
+    }
+  }
+  for (size_t i = 0; i < listed_files.size(); i++)
+    input_files.push_back(listed_files[i].c_str());
 
   ///////////////////////////////////////////////////////////////
-  // Load Program
+  // Render a binary trace as text (no program needed)
   ///////////////////////////////////////////////////////////////
   //
-  if (argc != 2) {
-    cerr << "Usage: " << argv[0] << " <input>" << endl;
-    return 1;
-  }
+  if (render_trace_file != NULL && !usage_error && input_files.empty())
+    return RenderTrace(render_trace_file) ? 0 : 1;
+  if (expand_trace_file != NULL && !usage_error && input_files.empty())
+    return ExpandTrace(expand_trace_file) ? 0 : 1;
+  if (raster_bench && !usage_error && input_files.empty())
+    return RunRasterBenchmark() ? 0 : 1;
 
-  ifstream infile(argv[1]);
-  if (!infile) {
-    cerr << "Error: Failed to open input file " << argv[1] << endl;
+  bool converting = binary_output_file != NULL || text_output_file != NULL;
+  bool checkpointing = g_checkpoint_control.interval != 0 || g_checkpoint_control.on_signal;
+  if (checkpointing != (g_checkpoint_control.path != NULL) || (checkpointing && SamplingEnabled()) ||
+      (g_sample_control.period != 0 && !g_sample_control.points.empty()))
+    usage_error = true;
+  bool single_only = converting || binary_trace_file != NULL || frame_output != NULL ||
+    memory_dump_file != NULL || checkpointing || restore_file != NULL || SamplingEnabled();
+  if (usage_error || input_files.empty() || (single_only && input_files.size() != 1)) {
+    cerr << "Usage: " << argv[0] << " [-e switch|threaded|block|jit]"
+         << " [--trace | --trace-delta <keyframe interval>] [--binary-trace <output>] <input>"
+         << endl;
+    cerr << "       trace filters: [--trace-pc <lo>:<hi>] [--trace-ops alu,vector,memory,graphics,control]"
+         << endl;
+    cerr << "                      [--trace-start <n>] [--trace-stop <n>]"
+         << " [--trace-when R<n>=<value>] [--trace-on-first <OPCODE>]" << endl;
+    cerr << "       " << argv[0] << " [--to-binary <output>] [--to-text <output>] <input>" << endl;
+    cerr << "       " << argv[0] << " [-e switch|threaded|block|jit]"
+         << " [-j <threads>] [-l <program list>] <input>..." << endl;
+    cerr << "       frames: [--ppm-frames <pattern, e.g. out/frame%04u.ppm>] [--y4m <output | ->]"
+         << endl;
+    cerr << "       common: [--gpu-threads <rasterizer threads>] [--gpu-async] [--depth-test]" << endl;
+    cerr << "       memory: [--memory-size <bytes, e.g. 64M; default 1M>] [--memory-image <image>]" << endl;
+    cerr << "               [--dump-memory <output image>]" << endl;
+    cerr << "       checkpoints: [--checkpoint <file | pattern, e.g. ckpt/%010u.ckpt>]" << endl;
+    cerr << "                    [--checkpoint-every <n>] [--checkpoint-on-signal (SIGUSR1)]"
+         << " [--restore <checkpoint>]" << endl;
+    cerr << "       sampling: [--sample-period <n> | --sample-at <n>,<n>...] [--sample-window <n, default 10000>]"
+         << endl;
+    cerr << "       " << argv[0] << " --render-trace <binary trace>" << endl;
+    cerr << "       " << argv[0] << " --expand-trace <--trace-delta text trace>" << endl;
+    cerr << "       " << argv[0] << " --raster-bench" << endl;
     return 1;
   }
-  vector< bitset<sizeof(uint32_t)*CHAR_BIT> > instructions;
-  while (!infile.eof()) {
-    bitset<sizeof(uint32_t)*CHAR_BIT> bits;
-    infile >> bits;
-    if (infile.eof())  break;
-    instructions.push_back(bits);
-  }
-  
-  infile.close();
+  if (SamplingEnabled() && g_execution_engine == ENGINE_JIT)
+    cerr << "Warning: -e jit only fast-forwards; detailed sample windows run on the block engine" << endl;
 
-#ifdef DEBUG
-  cout << "The contents of the instruction vectors are :" << endl;
-  for (vector< bitset<sizeof(uint32_t)*CHAR_BIT> >::iterator ii =
-      instructions.begin(); ii != instructions.end(); ii++) {
-    cout << "  " << *ii << endl;
-  }
-#endif // DEBUG
+  ///////////////////////////////////////////////////////////////
+  // Batch mode: several programs run in parallel
+  ///////////////////////////////////////////////////////////////
+  //
+  if (input_files.size() > 1)
+    return RunBatch(input_files) == 0 ? 0 : 1;
 
   ///////////////////////////////////////////////////////////////
-  // Decode instructions into g_trace_ops
+  // Load Program
   ///////////////////////////////////////////////////////////////
   //
-  for (vector< bitset<sizeof(uint32_t)*CHAR_BIT> >::iterator ii =
-      instructions.begin(); ii != instructions.end(); ii++) {
-    uint32_t inst = (uint32_t) ((*ii).to_ulong());
-    TraceOp trace_op = DecodeInstruction(inst);
-    g_trace_ops.push_back(trace_op);
-  }
+  SimulatorContext *context = new SimulatorContext();
+  if (!PrepareProgram(*context, input_files[0]))
+    return 1;
 
-#ifdef DEBUG
-  cout << "The contents of the g_trace_ops vectors are :" << endl;
-  for (vector<TraceOp>::iterator ii = g_trace_ops.begin();
-      ii != g_trace_ops.end(); ii++) {
-    PrintTraceOp(*ii);
+  ///////////////////////////////////////////////////////////////
+  // Convert only (--to-binary / --to-text)
+  ///////////////////////////////////////////////////////////////
+  //
+  if (converting) {
+    if (binary_output_file != NULL && !WriteBinaryProgram(*context, binary_output_file))
+      return 1;
+    if (text_output_file != NULL && !WriteTextProgram(*context, text_output_file))
+      return 1;
+    return 0;
   }
-#endif // DEBUG
 
   ///////////////////////////////////////////////////////////////
   // Execute 
   ///////////////////////////////////////////////////////////////
   //
-  g_scalar_registers[PC_IDX].int_value = 0;
-  for (;;) {
-    TraceOp current_op = g_trace_ops[g_scalar_registers[PC_IDX].int_value];
-    int idx = ExecuteInstruction(current_op);
-    g_current_pc = g_scalar_registers[PC_IDX].int_value; // debugging purpose only 
-    if (current_op.opcode == OP_JSR || current_op.opcode == OP_JSRR)
-      g_scalar_registers[LR_IDX].int_value = (g_scalar_registers[PC_IDX].int_value + 1) << 2 ;
-
-
-    
-    g_scalar_registers[PC_IDX].int_value += 1; 
-    if (idx != -1) { // Branch
-      if (current_op.opcode == OP_JMP || current_op.opcode == OP_JSRR) // Absolute addressing
-        g_scalar_registers[PC_IDX].int_value = idx; 
-      else // PC-relative addressing (OP_JSR || OP_BRXXX)
-        g_scalar_registers[PC_IDX].int_value += idx; 
-    }
-
-#ifdef DEBUG
-    g_instruction_count++;
-    PrintContext(current_op);
-#endif // DEBUG
-
-    if (g_program_halt == 1) 
-      break;
+  TraceSink trace_sink;
+  if (binary_trace_file != NULL) {
+    if (!trace_sink.Open(binary_trace_file))
+      return 1;
+    context->trace_sink = &trace_sink;
+  }
+  FrameSink frame_sink;
+  if (frame_output != NULL) {
+    if (!frame_sink.Open(frame_output, frame_format))
+      return 1;
+    context->frame_sink = &frame_sink;
   }
 
-  return 0;
+  if (restore_file != NULL && !RestoreCheckpoint(*context, restore_file))
+    return 1;
+  struct sigaction previous_usr1_action;
+  if (g_checkpoint_control.on_signal)
+    InstallCheckpointSignalHandler(&previous_usr1_action);
+  ExecuteProgram(*context);
+  if (g_checkpoint_control.on_signal)
+    sigaction(SIGUSR1, &previous_usr1_action, NULL);
+  int status = (context->memory_faulted || context->checkpoint_failed) ? 1 : 0;
+  if (memory_dump_file != NULL && !WriteMemoryImage(*context, memory_dump_file))
+    status = 1;
+
+  context->trace_sink = NULL;
+  trace_sink.Close();
+  context->frame_sink = NULL;
+  frame_sink.Close();
+  delete context;
+  return status;
 }
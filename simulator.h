@@ -1,13 +1,19 @@
 #ifndef __SIMULATOR_H
 #define __SIMULATOR_H
 
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <iosfwd>
+#include <thread>
 #include <string>
+#include <vector>
 
 #define PC_IDX 15
 #define LR_IDX 7
 
 #define NUM_VECTOR_ELEMENTS 4
-#define MEMORY_SIZE (1024*1024)
+#define DEFAULT_MEMORY_SIZE (1024*1024)  // --memory-size: power of 2, 4 KiB to 2 GiB (see DataMemory)
 
 #define NUM_SCALAR_REGISTER 16
 #define NUM_VECTOR_REGISTER 64
@@ -16,6 +22,16 @@
 
 #define NUM_VERTEX_REGISTER 3 
 
+#define JIT_HOT_THRESHOLD 64              // block executions before JIT compile
+#define JIT_CODE_SIZE (4*1024*1024)       // bytes of executable JIT code
+#define TRACE_RING_SIZE (1 << 16)         // binary trace records in flight, power of 2
+
+#define FRAMEBUFFER_WIDTH 640
+#define FRAMEBUFFER_HEIGHT 480
+#define RASTER_TILE_SIZE 32               // pixels per side of a rasterizer tile
+#define GPU_QUEUE_SIZE (1 << 14)          // --gpu-async commands in flight, power of 2
+#define FRAME_SINK_SLOTS 2                // FLUSHed frames waiting for the frame writer
+
 enum OpCodes {
   OP_ADD_D = 0,
   OP_ADDI_D = 1,
@@ -63,8 +79,70 @@ enum OpCodes {
   OP_HALT = 192,
 };
 
+////////////////////////////////////////////////////////////////////////
+// X-macro list of every distinct opcode (OP_RET aliases OP_JMP).
+// Used to build per-opcode dispatch tables.
+////////////////////////////////////////////////////////////////////////
+#define FOR_EACH_OPCODE(X) \
+  X(ADD_D) X(ADDI_D) X(ADD_F) X(ADDI_F) X(VADD) X(AND_D) X(ANDI_D) \
+  X(MOV) X(MOVI_D) X(MOVI_F) X(VMOV) X(VMOVI) X(CMP) X(CMPI) \
+  X(VCOMPMOV) X(VCOMPMOVI) X(LDB) X(LDW) X(STB) X(STW) \
+  X(SETVERTEX) X(SETCOLOR) X(ROTATE) X(TRANSLATE) X(SCALE) \
+  X(PUSHMATRIX) X(POPMATRIX) X(BEGINPRIMITIVE) X(ENDPRIMITIVE) \
+  X(LOADIDENTITY) X(FLUSH) X(DRAW) X(BRN) X(BRZ) X(BRP) X(BRNZ) \
+  X(BRNP) X(BRZP) X(BRNZP) X(JMP) X(JSR) X(JSRR) X(HALT)
+
+////////////////////////////////////////////////////////////////////////
+// Execution engines selectable with -e on the command line
+// ENGINE_SWITCH: fetch, ExecuteInstruction() switch, PC fix-up per step
+// ENGINE_THREADED: each TraceOp is pre-resolved to its handler and
+//                  handlers jump directly to the next one
+// ENGINE_BLOCK: basic blocks are translated once, cached, and executed
+//               a whole block per dispatch
+// ENGINE_JIT: ENGINE_BLOCK plus native x86-64 code for hot blocks
+////////////////////////////////////////////////////////////////////////
+enum ExecutionEngine {
+  ENGINE_SWITCH = 0,
+  ENGINE_THREADED = 1,
+  ENGINE_BLOCK = 2,
+  ENGINE_JIT = 3,
+};
+
+////////////////////////////////////////////////////////////////////////
+// 1.11.4 fixed-point value: 16-bit two's complement with 1 sign bit,
+// 11 integer bits and 4 fraction bits, exactly as the hardware holds it.
+// Sums wrap to 16 bits; ToInt() is the arithmetic shift (rounds down).
+////////////////////////////////////////////////////////////////////////
+struct Fixed1114 {
+	int16_t raw;
+
+	static constexpr int kFractionBits = 4;
+
+	static constexpr Fixed1114 FromRaw(const int bits) { return Fixed1114{ (int16_t) bits }; }
+	static constexpr Fixed1114 FromInt(const int value) { return FromRaw(value * (1 << kFractionBits)); }
+	static constexpr Fixed1114 FromFloat(const float value) { return FromRaw((int) (value * (1 << kFractionBits))); }
+	constexpr int ToInt() const { return raw >> kFractionBits; }
+	constexpr float ToFloat() const { return raw / (float) (1 << kFractionBits); }
+
+	constexpr Fixed1114 operator+(const Fixed1114 other) const { return FromRaw(raw + other.raw); }
+	constexpr Fixed1114 operator-(const Fixed1114 other) const { return FromRaw(raw - other.raw); }
+	constexpr bool operator==(const Fixed1114 other) const { return raw == other.raw; }
+	constexpr bool operator!=(const Fixed1114 other) const { return raw != other.raw; }
+	constexpr bool operator<(const Fixed1114 other) const { return raw < other.raw; }
+	constexpr bool operator<=(const Fixed1114 other) const { return raw <= other.raw; }
+	constexpr bool operator>(const Fixed1114 other) const { return raw > other.raw; }
+	constexpr bool operator>=(const Fixed1114 other) const { return raw >= other.raw; }
+};
+
+static_assert(sizeof(Fixed1114) == 2, "Fixed1114 must be 16 bits");
+static_assert((Fixed1114::FromFloat(1.5f) + Fixed1114::FromFloat(-2.0f)).ToFloat() == -0.5f, "1.11.4 add");
+static_assert((Fixed1114::FromInt(2047) + Fixed1114::FromInt(1)).ToInt() == -2048, "1.11.4 add wraps");
+static_assert(Fixed1114::FromFloat(-0.5f).ToInt() == -1, "1.11.4 to int rounds down");
+
 ////////////////////////////////////////////////////////////////////////
 // 1. int_value field is for integer scalar registers: R0 - R6, R7, R15
+// 2. R8 - R14 are fixed-point: int_value holds the Fixed1114 bits
+//    sign-extended (FixedRegister()/SetFixedRegister() in simulator.cc)
 ////////////////////////////////////////////////////////////////////////
 typedef struct ScalarRegister_ {
 	int int_value; 
@@ -72,12 +150,15 @@ typedef struct ScalarRegister_ {
 
 ////////////////////////////////////////////////////////////////////////
 // In this course we will use vector registers only for graphics operations.
-// Do not bother to use int_value field.
+// Elements are packed 1.11.4 values so VADD/VMOV/VMOVI touch all of
+// them with one 64-bit SIMD operation.
 ////////////////////////////////////////////////////////////////////////
 typedef struct VectorRegister_ {
-	ScalarRegister element[NUM_VECTOR_ELEMENTS]; 
+	Fixed1114 element[NUM_VECTOR_ELEMENTS]; 
 } VectorRegister;
 
+static_assert(sizeof(VectorRegister) == 8, "VectorRegister must be one 64-bit SIMD lane");
+
 
 ////////////////////////////////////////////////////////////////////////
 // only integer values are stored 
@@ -92,6 +173,67 @@ typedef struct VertexRegister_ {
 } VertexRegister;
 
 
+////////////////////////////////////////////////////////////////////////
+// Lazily evaluated condition code. ALU ops and CMP only record their
+// operands; N/Z/P is computed when a branch, a trace or a snapshot
+// reads it (ConditionCode()). While unresolved is false,
+// condition_code_register itself is current.
+// Integer and 1.11.4 operands both compare as 16-bit values, so one
+// recorded difference covers every comparison.
+////////////////////////////////////////////////////////////////////////
+typedef struct LazyConditionCode_ {
+	bool unresolved;              // int_difference is newer than condition_code_register 
+	int32_t int_difference;       // (int16_t) val1 - (int16_t) val2, cannot overflow 
+} LazyConditionCode;
+
+////////////////////////////////////////////////////////////////////////
+// Vertex pipeline state
+// TransformMatrix: 2D affine model-view transform, 16.16 fixed point.
+// TransformOp: a TRANSLATE/ROTATE/SCALE not yet folded into the matrix.
+// VertexBuffer: vertices SETVERTEX appended since BEGINPRIMITIVE, as
+// separate arrays for batch transformation; x/y/z are 1.11.4 model
+// coordinates before num_transformed and pixels from there on.
+////////////////////////////////////////////////////////////////////////
+typedef struct TransformMatrix_ {
+	int32_t a, b, tx;             // x' = a*x + b*y + tx 
+	int32_t c, d, ty;             // y' = c*x + d*y + ty 
+} TransformMatrix;
+
+typedef struct TransformOp_ {
+	uint8_t opcode;
+	float x, y;                   // ROTATE: angle in degrees, z axis 
+} TransformOp;
+
+typedef struct VertexBuffer_ {
+	std::vector<int> x, y, z;
+	std::vector<int> r, g, b;
+	size_t num_transformed;
+} VertexBuffer;
+
+////////////////////////////////////////////////////////////////////////
+// A DRAWn primitive waiting for the next FLUSH, in pixels. Lines use
+// vertices[0..1].
+////////////////////////////////////////////////////////////////////////
+enum PrimitiveType {
+  PRIM_LINE = 0,
+  PRIM_TRIANGLE = 1,
+};
+
+typedef struct GpuPrimitive_ {
+	uint8_t type;                 // PrimitiveType, from GSR[3:2] 
+	VertexRegister vertices[NUM_VERTEX_REGISTER];
+} GpuPrimitive;
+
+////////////////////////////////////////////////////////////////////////
+// --depth-test counters, summed over all FLUSHes of a program
+////////////////////////////////////////////////////////////////////////
+typedef struct DepthStats_ {
+	uint64_t tiles_rejected;      // (triangle, tile) pairs behind the tile's max Z 
+	uint64_t blocks_rejected;     // pixel blocks behind the block's max Z 
+	uint64_t pixels_tested;
+	uint64_t pixels_failed;
+} DepthStats;
+
 ////////////////////////////////////////////////////////////////////////
 // 1. opcode
 // 2. scalar_registers: If instruction has dest, src1, src2 registers
@@ -100,16 +242,562 @@ typedef struct VertexRegister_ {
 // 4. idx: This field is for VCOMPMOV instruction
 // 5. primitive_type: This field is for BEGINPRIMITIVE instruction
 // 6. int_value: This field is for integer immediate value 
+//    fixed_value: 1.11.4 immediate (ADDI_F, MOVI_F, VMOVI, VCOMPMOVI),
+//    shares storage with int_value
+// Packed to 16 bytes so large decoded programs stay cache resident;
+// engines always refer to TraceOps by reference or pointer.
 ////////////////////////////////////////////////////////////////////////
 typedef struct TraceOp_ {
-	int16_t opcode;
-	int16_t scalar_registers[3];
-	int64_t vector_registers[3];
-	int idx;
-	int primitive_type;
-	int int_value;
+	uint8_t opcode;
+	uint8_t scalar_registers[3];
+	uint8_t vector_registers[3];
+	uint8_t idx;
+	uint8_t primitive_type;
+	union {
+		int int_value;
+		Fixed1114 fixed_value;
+	};
 } TraceOp;
 
+static_assert(sizeof(TraceOp) <= 16, "TraceOp must stay packed");
+
+////////////////////////////////////////////////////////////////////////
+// Translated basic block (ENGINE_BLOCK)
+// A block is a run of g_trace_ops ending at BR*/JMP/JSR/JSRR/HALT or at
+// an instruction that writes the PC register.
+// BlockOp: one dispatch inside a block. handler executes one instruction
+//          or a fused pair (superinstruction) starting at trace_op.
+//          branch_taken_mask has bit N set when a fused branch is taken
+//          with condition code N.
+////////////////////////////////////////////////////////////////////////
+class SimulatorContext;
+struct BlockOp_;
+typedef void (*BlockOpHandler)(SimulatorContext &context, const struct BlockOp_ &block_op);
+
+// BlockOp kinds past the 256 opcodes: fused pairs 
+#define BLOCK_OP_CMP_BRANCH 256       // CMP + BRxx 
+#define BLOCK_OP_CMPI_BRANCH 257      // CMPI + BRxx 
+#define BLOCK_OP_ADDI_CMPI 258        // ADDI_D + CMPI 
+#define NUM_BLOCK_OP_KINDS 259
+
+typedef struct BlockOp_ {
+	BlockOpHandler handler;       // kind's handler without tracing or sampling 
+	const TraceOp *trace_op;
+	uint16_t kind;                // opcode or BLOCK_OP_* 
+	uint8_t branch_taken_mask;
+} BlockOp;
+
+////////////////////////////////////////////////////////////////////////
+// JIT-compiled code for a block (ENGINE_JIT)
+// input: scalar register file, data memory, condition code register
+// output: index of the next instruction to execute
+////////////////////////////////////////////////////////////////////////
+typedef int (*JitBlockFn)(ScalarRegister *scalar_registers,
+                          unsigned char *memory,
+                          ScalarRegister *condition_code_register);
+
+typedef struct BasicBlock_ {
+	int start_pc;
+	int num_instructions;
+	std::vector<BlockOp> ops;
+	unsigned int execution_count;
+	bool jit_attempted;
+	JitBlockFn jit_code;
+	int jit_num_instructions;     // executed by every call of jit_code 
+} BasicBlock;
+
+// LDx/STx compiled at code_offset in the JIT region, to find the PC of
+// a memory fault raised by compiled code 
+typedef struct JitMemoryOp_ {
+	size_t code_offset;
+	int pc;
+} JitMemoryOp;
+
+////////////////////////////////////////////////////////////////////////
+// Binary trace (--binary-trace)
+// file: TraceFileHeader followed by one TraceRecord per instruction.
+// A record holds the state an instruction may change: PC, LR, CC, GSR,
+// at most one scalar register and one vector or vertex register
+// (values[] holds the 4 vector elements or the vertex x,y,z,r,g,b).
+////////////////////////////////////////////////////////////////////////
+#define TRACE_MAGIC 0x54323233   // "322T" 
+#define TRACE_VERSION 1
+#define TRACE_NONE 0xFF
+
+typedef struct TraceFileHeader_ {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t reserved;
+} TraceFileHeader;
+
+typedef struct TraceRecord_ {
+	uint32_t instruction_count;
+	uint32_t pc;                  // index of the executed instruction 
+	uint32_t next_pc;             // PC register after it 
+	uint8_t opcode;
+	uint8_t next_opcode;
+	uint8_t condition_code;
+	uint8_t gpu_status;
+	uint8_t scalar_idx;           // changed scalar register or TRACE_NONE 
+	uint8_t vector_idx;           // changed vector register or TRACE_NONE 
+	uint8_t vertex_idx;           // changed vertex register or TRACE_NONE 
+	uint8_t reserved;
+	int32_t scalar_value;
+	int32_t link_value;           // LR 
+	int32_t values[6];
+} TraceRecord;
+
+////////////////////////////////////////////////////////////////////////
+// Runtime trace filter (--trace, --trace-pc, --trace-ops, --trace-start,
+// --trace-stop, --trace-when, --trace-on-first). An instruction is
+// traced once a trigger (if any) has fired and it passes every filter.
+////////////////////////////////////////////////////////////////////////
+#define TRACE_CLASS_ALU      (1u << 0)
+#define TRACE_CLASS_VECTOR   (1u << 1)
+#define TRACE_CLASS_MEMORY   (1u << 2)
+#define TRACE_CLASS_GRAPHICS (1u << 3)
+#define TRACE_CLASS_CONTROL  (1u << 4)
+#define TRACE_CLASS_ALL      0x1Fu
+#define TRACE_NUM_CLASSES    5
+
+typedef struct TraceControl_ {
+	bool text;                    // "3220X-" text dump to trace_out 
+	unsigned int pc_low;          // traced instruction index range 
+	unsigned int pc_high;
+	uint32_t opcode_classes;      // TRACE_CLASS_* mask 
+	unsigned int start_count;     // traced instruction_count range 
+	unsigned int stop_count;
+	int trigger_register;         // Rn=value trigger, -1 if none 
+	int trigger_value;
+	int trigger_opcode;           // first-occurrence trigger, -1 if none 
+	unsigned int delta_keyframe_interval; // --trace-delta, 0 = full dumps 
+
+	TraceControl_()
+	  : text(false), pc_low(0), pc_high(~0u), opcode_classes(TRACE_CLASS_ALL),
+	    start_count(0), stop_count(~0u), trigger_register(-1), trigger_value(0),
+	    trigger_opcode(-1), delta_keyframe_interval(0) {}
+} TraceControl;
+
+////////////////////////////////////////////////////////////////////////
+// Sampled simulation (--sample-period, --sample-at). The program
+// fast-forwards on the block engine, uninstrumented, to each sample
+// point and then runs window instructions in detail; SampleStats only
+// covers those detailed windows and is scaled up to the whole run.
+////////////////////////////////////////////////////////////////////////
+typedef struct SampleControl_ {
+	unsigned int period;          // a window every period instructions, 0 = off 
+	std::vector<unsigned int> points; // --sample-at instruction counts, sorted 
+	unsigned int window;          // instructions per detailed window 
+
+	SampleControl_() : period(0), window(10000) {}
+} SampleControl;
+
+typedef struct SampleStats_ {
+	uint64_t opcode_count[256];
+	uint64_t branches;            // conditional branches 
+	uint64_t branches_taken;
+	uint64_t instructions;        // in all windows 
+	unsigned int windows;
+	uint64_t window_class_count[TRACE_NUM_CLASSES]; // current window 
+	uint64_t window_instructions;
+	double class_share_sum[TRACE_NUM_CLASSES];      // per-window shares, for 
+	double class_share_sum_sq[TRACE_NUM_CLASSES];   // the confidence interval 
+} SampleStats;
+
+////////////////////////////////////////////////////////////////////////
+// Register state last written to a --trace-delta stream; the next line
+// only lists what differs from it. stored_addresses collects the bytes
+// stored since that line, by traced and filtered-out instructions alike.
+////////////////////////////////////////////////////////////////////////
+typedef struct TraceDeltaState_ {
+	ScalarRegister condition_code_register;
+	ScalarRegister gpu_status_register;
+	ScalarRegister scalar_registers[NUM_SCALAR_REGISTER];
+	VectorRegister vector_registers[NUM_VECTOR_REGISTER];
+	VertexRegister gpu_vertex_registers[NUM_VERTEX_REGISTER];
+	std::vector<int> stored_addresses;  // unsorted, may repeat 
+	size_t stored_compact_at;     // deduplicate stored_addresses at this size 
+	unsigned int traced_since_keyframe;
+	bool valid;                   // false until the first keyframe 
+} TraceDeltaState;
+
+////////////////////////////////////////////////////////////////////////
+// The pipeline part of a graphics op, captured when the CPU executes it
+////////////////////////////////////////////////////////////////////////
+typedef struct GpuCommand_ {
+	uint8_t opcode;
+	uint8_t primitive_type;       // DRAW: GSR primitive type 
+	int values[6];                // SETVERTEX: 1.11.4 x, y, z, then r, g, b 
+	TransformOp transform;        // TRANSLATE/ROTATE/SCALE 
+} GpuCommand;
+
+////////////////////////////////////////////////////////////////////////
+// Lock-free single-producer/single-consumer ring of GpuCommands run by
+// a render thread (--gpu-async). Push() only blocks when the render
+// thread has fallen GPU_QUEUE_SIZE commands behind; WaitForFlushes(n)
+// blocks until at most n pushed FLUSHes are still unfinished.
+////////////////////////////////////////////////////////////////////////
+class GpuCommandQueue {
+ public:
+  GpuCommandQueue();
+  ~GpuCommandQueue();
+  void Start(SimulatorContext *context);
+  void Finish();
+  void WaitForFlushes(const unsigned int max_outstanding);
+
+  void Push(const GpuCommand &command) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    while (head - tail_.load(std::memory_order_acquire) >= GPU_QUEUE_SIZE)
+      std::this_thread::yield();
+    ring_[head & (GPU_QUEUE_SIZE - 1)] = command;
+    head_.store(head + 1, std::memory_order_release);
+    if (command.opcode == OP_FLUSH)
+      flushes_pushed_++;
+  }
+
+ private:
+  void Run();
+
+  std::vector<GpuCommand> ring_;
+  alignas(64) std::atomic<size_t> head_;  // written by the CPU thread 
+  alignas(64) std::atomic<size_t> tail_;  // written by the render thread 
+  std::atomic<unsigned int> flushes_done_;
+  std::atomic<bool> done_;
+  unsigned int flushes_pushed_;           // CPU thread only 
+  SimulatorContext *context_;
+  std::thread render_thread_;
+};
+
+////////////////////////////////////////////////////////////////////////
+// Lock-free single-producer/single-consumer ring of TraceRecords drained
+// to a file by a background writer thread. Push() only blocks when the
+// writer has fallen TRACE_RING_SIZE records behind.
+////////////////////////////////////////////////////////////////////////
+class TraceSink {
+ public:
+  TraceSink();
+  ~TraceSink();
+  bool Open(const char *path);
+  void Close();
+
+  void Push(const TraceRecord &record) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    while (head - tail_.load(std::memory_order_acquire) >= TRACE_RING_SIZE)
+      std::this_thread::yield();
+    ring_[head & (TRACE_RING_SIZE - 1)] = record;
+    head_.store(head + 1, std::memory_order_release);
+  }
+
+ private:
+  void Drain();
+
+  std::vector<TraceRecord> ring_;
+  alignas(64) std::atomic<size_t> head_;  // written by the simulator 
+  alignas(64) std::atomic<size_t> tail_;  // written by the writer thread 
+  std::atomic<bool> done_;
+  FILE *file_;
+  std::thread writer_;
+};
+
+enum FrameFormat {
+  FRAME_PPM,                              // one P6 file per frame 
+  FRAME_Y4M                               // one YUV4MPEG2 4:4:4 stream 
+};
+
+////////////////////////////////////////////////////////////////////////
+// Writes every FLUSHed frame (--ppm-frames, --y4m) from a background
+// writer thread. Push() copies the frame into one of FRAME_SINK_SLOTS
+// preallocated slots and returns; it only blocks when the writer is
+// still encoding all of them.
+////////////////////////////////////////////////////////////////////////
+class FrameSink {
+ public:
+  FrameSink();
+  ~FrameSink();
+  bool Open(const char *path, const FrameFormat format);
+  void Close();
+  void Push(const std::vector<uint32_t> &frame);
+
+ private:
+  void Drain();
+  bool WriteFrame(const uint32_t *pixels, const unsigned int frame_number);
+
+  std::vector<uint32_t> slots_[FRAME_SINK_SLOTS];
+  std::vector<unsigned char> encoded_;    // writer thread scratch 
+  alignas(64) std::atomic<size_t> head_;  // frames pushed 
+  alignas(64) std::atomic<size_t> tail_;  // frames written 
+  std::atomic<bool> done_;
+  std::string path_;                      // FRAME_PPM: printf pattern 
+  FrameFormat format_;
+  FILE *file_;                            // FRAME_Y4M stream 
+  bool open_;
+  std::thread writer_;
+};
+
+////////////////////////////////////////////////////////////////////////
+// Data memory: size() bytes (--memory-size) inside one mmap reservation
+// with MEMORY_GUARD_SIZE bytes of PROT_NONE on either side. A load or
+// store checks the address it forms with a single unsigned compare and
+// sends one outside memory into the low guard, so it raises SIGSEGV,
+// which RunEngine() turns into a simulated memory fault. The kernel
+// keeps the memory sparse; a page is allocated on its first store and
+// untouched pages read as zero. Without mmap, or on a 32-bit host,
+// memory is a plain array and addresses wrap at size(). The size is at
+// most MAX_MEMORY_SIZE: addresses are 32-bit signed ints, so nothing
+// above that is reachable. Untouched pages take no RAM, and each
+// context reserves only size() plus 128 KiB of address space. Every
+// store also sets flags for its page, so --dump-memory and checkpoints
+// only look at pages that were written, not all of memory.
+////////////////////////////////////////////////////////////////////////
+// base + offset as the 32-bit address adder forms it: wraps around
+// instead of overflowing 
+static inline int EffectiveAddress(const int base, const int offset)
+{
+  return (int32_t) ((uint32_t) base + (uint32_t) offset);
+}
+
+#if defined(__unix__) && defined(__LP64__)
+#define HAVE_GUARDED_MEMORY
+#define MEMORY_GUARD_SIZE ((size_t) 64 * 1024)
+#endif
+
+#define MAX_MEMORY_SIZE ((size_t) 1 << 31)
+#define MEMORY_PAGE_SHIFT 12            // pages DataMemory keeps flags for 
+#define MEMORY_PAGE_DIRTY 0x01          // stored to since the last ClearDirtyPages() 
+#define MEMORY_PAGE_WRITTEN 0x02        // stored to or loaded since Clear(): may not be zero 
+
+class DataMemory {
+ public:
+  explicit DataMemory(const size_t size);  // a valid --memory-size 
+  ~DataMemory();
+  DataMemory(const DataMemory &) = delete;
+  DataMemory &operator=(const DataMemory &) = delete;
+
+  void Clear();                           // all zero again, frees every page 
+  unsigned char *base() { return base_; } // address 0, for JIT code and images 
+  const unsigned char *base() const { return base_; }
+  size_t size() const { return size_; }
+  size_t num_pages() const { return page_flags_.size(); }
+  // Map a page-aligned prefix of size bytes of fd at file_offset to
+  // address, copy-on-write. Returns the bytes mapped; the caller copies
+  // the rest. 
+  size_t MapFile(const int address, const int fd, const uint64_t file_offset, const size_t size);
+  bool InGuardedRange(const void *host_address) const;
+  // MEMORY_PAGE_* per page; compiled stores set them directly 
+  const uint8_t *page_flags() const { return &page_flags_[0]; }
+  uint8_t *page_flags() { return &page_flags_[0]; }
+  void MarkWritten(const int address, const size_t size);  // filled from outside, e.g. an image 
+  void ClearDirtyPages();
+
+  // the byte at base + offset; offset is an LDx/STx immediate or 0 
+  uint8_t Load8(const int base, const int offset) const { return base_[Offset(base, offset)]; }
+  uint16_t Load16(const int base, const int offset) const {
+    return Load8(base, offset) | (Load8(base, offset + 1) << 8);  // little endian 
+  }
+  // a store that leaves memory flags some page on its way to the fault 
+  void Store8(const int base, const int offset, const uint8_t value) {
+    ptrdiff_t address = Offset(base, offset);
+    page_flags_[(address >> MEMORY_PAGE_SHIFT) & (num_pages() - 1)] = MEMORY_PAGE_DIRTY | MEMORY_PAGE_WRITTEN;
+    base_[address] = value;
+  }
+  void Store16(const int base, const int offset, const uint16_t value) {
+    Store8(base, offset, value & 0xff);
+    Store8(base, offset + 1, value >> 8);
+  }
+
+ private:
+#ifdef HAVE_GUARDED_MEMORY
+  ptrdiff_t Offset(const int base, const int offset) const {
+    int address = EffectiveAddress(base, offset);
+    return (uint32_t) address < size_ ? address : -(ptrdiff_t) MEMORY_GUARD_SIZE;
+  }
+  unsigned char *reservation_;            // guard, memory, guard 
+#else
+  ptrdiff_t Offset(const int base, const int offset) const {
+    return EffectiveAddress(base, offset) & (size_ - 1);
+  }
+  std::vector<unsigned char> storage_;
+#endif
+  uint32_t size_;
+  unsigned char *base_;
+  std::vector<uint8_t> page_flags_;       // one per page, never reallocated 
+};
+
+////////////////////////////////////////////////////////////////////////
+// All state of one simulated 3220X: architectural registers and data
+// memory, the loaded program, and execution bookkeeping. Every
+// Decode/Execute/Load function works on an explicit context, so
+// independent contexts can run on different threads of one process.
+// InitializeContext() resets it for a new program.
+////////////////////////////////////////////////////////////////////////
+class SimulatorContext {
+ public:
+  SimulatorContext();
+  ~SimulatorContext();
+
+  ///  architectural structures /// 
+  ScalarRegister condition_code_register; // store conditional code 
+  LazyConditionCode condition_code_pending; // unevaluated CC, see ConditionCode() 
+  ScalarRegister scalar_registers[NUM_SCALAR_REGISTER];  
+  VectorRegister vector_registers[NUM_VECTOR_REGISTER];
+
+  VertexRegister gpu_vertex_registers[NUM_VERTEX_REGISTER]; 
+  ScalarRegister gpu_status_register; 
+ 
+  DataMemory memory;                // data memory 
+
+  ///  GPU /// 
+  TransformMatrix gpu_matrix;                     // model-view, minus pending transforms 
+  std::vector<TransformOp> gpu_pending_transforms;
+  std::vector<TransformMatrix> gpu_matrix_stack;  // PUSHMATRIX/POPMATRIX 
+  VertexBuffer gpu_vertex_buffer;
+  GpuCommandQueue *gpu_queue;                     // --gpu-async, NULL if graphics run inline 
+  std::vector<GpuPrimitive> gpu_primitives;       // DRAWn since the last FLUSH 
+  std::vector<std::vector<uint32_t> > gpu_tile_bins; // gpu_primitives indices per tile 
+  std::vector<uint32_t> framebuffer;              // 0x00RRGGBB, frame being drawn 
+  std::vector<uint32_t> resolved_framebuffer;     // last FLUSHed frame 
+  std::vector<int32_t> depth_buffer;              // --depth-test, 16.16, smaller is nearer 
+  std::vector<int32_t> hiz_block_max;             // max depth_buffer per RASTER_BLOCK_SIZE block 
+  std::vector<int32_t> hiz_tile_max;              // max depth_buffer per tile 
+  DepthStats depth_stats;
+  unsigned int frame_count;                       // FLUSHes so far 
+  FrameSink *frame_sink;                          // frame output, NULL if off 
+
+  ///  loaded program /// 
+  const uint32_t *instruction_words;        // host byte order 
+  size_t num_instructions; 
+  std::vector<uint32_t> instruction_storage; // backs instruction_words unless mmap'd 
+
+  const TraceOp *trace_ops;                 // decoded program 
+  size_t num_trace_ops; 
+  std::vector<TraceOp> trace_op_storage;    // backs trace_ops unless mmap'd 
+
+  void *program_mapping;                    // mmap'd binary program, if any 
+  size_t program_mapping_size; 
+
+  ///  execution /// 
+  unsigned int instruction_count;
+  unsigned int vertex_id; 
+  unsigned int current_pc; 
+  unsigned int program_halt; 
+  bool memory_faulted;                      // an LDx/STx left memory, stopped at current_pc 
+  int memory_fault_address; 
+  bool trace_triggered;                     // TraceControl trigger has fired 
+  SampleStats sample_stats;                 // --sample-* detailed windows 
+  TraceDeltaState trace_delta;              // --trace-delta shadow state 
+
+  std::vector<BasicBlock> block_cache;      // ENGINE_BLOCK translation cache 
+  std::vector<int> block_lookup;            // start PC -> block_cache index or -1 
+  unsigned char *jit_code;                  // ENGINE_JIT code region 
+  size_t jit_code_used; 
+  std::vector<JitMemoryOp> jit_memory_ops;  // by code_offset 
+  std::vector<void *> threaded_handlers;    // ENGINE_THREADED label per TraceOp 
+  unsigned int next_checkpoint;             // instruction_count of the next --checkpoint-every, 0 = none 
+  std::vector<int> checkpoint_writers;      // pids of forked checkpoint writers still running 
+  bool checkpoint_failed; 
+  std::string checkpoint_base;              // file name of the last checkpoint, "" = next one is full 
+  unsigned int checkpoint_chain;            // checkpoints since the last full one 
+
+  std::ostream *trace_out;                  // --trace text output 
+  TraceSink *trace_sink;                    // binary trace, NULL if off 
+
+ private:
+  SimulatorContext(const SimulatorContext &);
+  SimulatorContext &operator=(const SimulatorContext &);
+};
+
+////////////////////////////////////////////////////////////////////////
+// Binary program file
+// header | num_instructions little-endian 32-bit words | padding to 8 |
+// optional pre-decoded TraceOp array (host layout, trace_op_size bytes
+// each; 0 = absent). Offsets are from the start of the file.
+////////////////////////////////////////////////////////////////////////
+#define PROGRAM_MAGIC 0x30323233   // "3220" 
+#define PROGRAM_VERSION 2
+
+typedef struct ProgramHeader_ {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_instructions;
+	uint32_t trace_op_size;
+	uint64_t instructions_offset;
+	uint64_t trace_ops_offset;
+} ProgramHeader;
+
+////////////////////////////////////////////////////////////////////////
+// Data memory image file (--memory-image, --dump-memory)
+// header | num_sections MemoryImageSection | section bytes. Sections
+// written by --dump-memory are runs of whole non-zero pages whose
+// address and file_offset are multiples of MEMORY_IMAGE_PAGE_SIZE, so a
+// loader can mmap them. A file without the magic number is a raw image
+// of memory from address 0.
+////////////////////////////////////////////////////////////////////////
+#define MEMORY_IMAGE_MAGIC 0x4D323233   // "322M" 
+#define MEMORY_IMAGE_VERSION 1
+#define MEMORY_IMAGE_PAGE_SIZE 4096
+
+typedef struct MemoryImageHeader_ {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_sections;
+	uint32_t reserved;
+} MemoryImageHeader;
+
+typedef struct MemoryImageSection_ {
+	uint32_t address;             // data memory address of the first byte 
+	uint32_t size;
+	uint64_t file_offset;
+} MemoryImageSection;
+
+////////////////////////////////////////////////////////////////////////
+// Checkpoint file (--checkpoint, --restore)
+// header | base_name_size bytes of base name | padding to
+// memory_image_offset | memory image (see MemoryImageHeader), with
+// section file_offsets relative to memory_image_offset. A full
+// checkpoint (no base name) holds every non-zero page. Otherwise it
+// holds only the pages stored to since the checkpoint with that file
+// name in the same directory, which is restored first; every
+// CHECKPOINT_CHAIN_LENGTH-th checkpoint is full again. Registers are
+// in host layout. The graphics pipeline (matrix stack, unfinished
+// primitive, framebuffer) is not saved and starts out empty after a
+// restore.
+////////////////////////////////////////////////////////////////////////
+#define CHECKPOINT_MAGIC 0x43323233   // "322C" 
+#define CHECKPOINT_VERSION 2
+#define CHECKPOINT_WRITERS 4          // forked checkpoint writers in flight 
+#define CHECKPOINT_CHAIN_LENGTH 16    // a full checkpoint and the ones based on it 
+
+typedef struct CheckpointHeader_ {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_instructions;    // of the program it was taken from 
+	uint32_t program_hash;        // FNV-1a of its instruction words 
+	uint32_t instruction_count;
+	uint32_t vertex_id;
+	ScalarRegister condition_code_register;  // evaluated, nothing pending 
+	ScalarRegister gpu_status_register;
+	ScalarRegister scalar_registers[NUM_SCALAR_REGISTER];  // including PC 
+	VectorRegister vector_registers[NUM_VECTOR_REGISTER];
+	VertexRegister gpu_vertex_registers[NUM_VERTEX_REGISTER];
+	uint64_t memory_image_offset;
+	uint32_t base_name_size;      // 0 = full checkpoint 
+	uint32_t reserved;
+} CheckpointHeader;
+
+////////////////////////////////////////////////////////////////////////
+// When to checkpoint: every interval instructions and/or on SIGUSR1.
+// path is a file name, overwritten by each checkpoint, or a pattern
+// with one %u for the instruction count.
+////////////////////////////////////////////////////////////////////////
+typedef struct CheckpointControl_ {
+	const char *path;             // NULL = no checkpoints 
+	unsigned int interval;        // --checkpoint-every, 0 = off 
+	bool on_signal;               // --checkpoint-on-signal 
+
+	CheckpointControl_() : path(NULL), interval(0), on_signal(false) {}
+} CheckpointControl;
+
 ////////////////////////////////////////////////////////////////////////
 // GPU Status Register 
 // GSR[0]: draw 
@@ -120,9 +808,11 @@ typedef struct TraceOp_ {
 ////////////////////////////////////////////////////////////////////////
 enum GSR_BITS{
   DRAW_BIT = 0, 
-  FLISH_BIT = 1, 
+  FLUSH_BIT = 1, 
   PRIM_TYPE0 = 2, 
   PRIM_TYPE1 = 3, 
+  BEGIN_PRIMITIVE_BIT = 4,
+  END_PRIMITIVE_BIT = 5,
 }; 
 
 #endif // __SIMULATOR_H